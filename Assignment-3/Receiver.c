@@ -1,31 +1,135 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
 
+#include "fec.h"
+
 #define SERVER_PORT 5060
 #define SERVER_IP "127.0.0.1"
 #define BUFFER_SIZE 1024
 #define CC_ALGO_1 "reno"
 #define CC_ALGO_2 "cubic"
+#define DEFAULT_FILE "send.txt"
+#define MAX_NAME_LEN 256
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+#define DEFAULT_SINK "file"
+#define DEFAULT_OUTPUT "recv.txt"
+#define MCAST_PORT 5061
+#define MCAST_PAYLOAD 1400
+#define MCAST_MAGIC 0x4d435354 // "MCST"
+#define MCAST_MAX_RANGES 64
+#define MCAST_RCVBUF (4 * 1024 * 1024)
+#define NACK_DELAY_MIN_MS 5    // A NACK waits a random delay in this range,
+#define NACK_DELAY_MAX_MS 25   // so one receiver's NACK can suppress others'.
+#define NACK_HOLDOFF_MS 60     // Don't NACK a packet again within this time.
+#define NACK_RATE 50           // NACK datagrams per second, at most.
+#define NACK_BURST 5
+#define MCAST_IDLE_TIMEOUT_MS 10000
+#define FEC_PORT 5062
+#define FEC_MAGIC 0x46454350 // "FECP"
+#define FEC_IDLE_TIMEOUT_MS 2000 // After the last packet; no retransmissions come.
+#define FEC_START_TIMEOUT_MS 30000
+
+enum mcast_type
+{
+    MCAST_DATA = 1,
+    MCAST_FIN = 2,
+    MCAST_NACK = 3
+};
+
+/**
+ * Header of every multicast datagram, all fields in network byte order.
+ * A NACK is followed by `ranges` pairs of (first seq, count) uint32_t.
+ */
+struct mcast_header
+{
+    uint32_t magic;
+    uint8_t type;
+    uint8_t ranges;   // NACK: number of ranges that follow.
+    uint16_t len;     // DATA: payload length.
+    uint32_t session; // Picked at random by the sender for each transfer.
+    uint32_t seq;     // DATA: index of the packet in the file.
+    uint32_t total;   // Number of DATA packets in the file.
+    uint32_t size;    // Size of the file in bytes.
+    uint32_t checksum;
+};
+
+struct sink;
+
+/**
+ * The operations of one kind of sink. Every one returns 0 on success and -1
+ * on error.
+ */
+struct sink_ops
+{
+    const char *name;
+    int (*open)(struct sink *sink, int size);              // Prepares for a file of size bytes.
+    int (*write)(struct sink *sink, const char *data, int len, int offset);
+    int (*reset)(struct sink *sink);                       // Drops what was written, for AGAIN.
+    int (*close)(struct sink *sink);
+};
+
+/**
+ * Where received data goes, with the counters used to report its throughput.
+ */
+struct sink
+{
+    const struct sink_ops *ops;
+    const char *path;   // Output file of the file and mmap sinks.
+    FILE *fp;           // file sink.
+    int fd;             // mmap sink.
+    char *memory;       // memory and mmap sinks: the whole file.
+    int size;           // Size of the memory/mapping.
+    int offset;         // End of the furthest write since the last reset.
+    long long bytes;    // Bytes written overall.
+    long long busy_ns;  // Time spent inside write().
+    long long first_ns; // When the first byte was written.
+    long long last_ns;  // When the last byte was written.
+};
 
 // **Function Headers**:
 
 /**
- * Receives the file size from the server.
+ * Asks the server for a file from its catalog.
+ * @param sock The socket descriptor.
+ * @param name The file's path in the catalog, or "#<id>".
+ * @return 0 on success, -1 on error.
+ */
+int send_request(int sock, const char *name);
+
+/**
+ * Receives the file size and checksum from the server.
  * @param sock The socket descriptor.
  * @param buffer The buffer to use for receiving.
  * @param ack The ACK message to send.
+ * @param checksum Where to store the file's FNV-1a checksum.
  * @return The file size, or -1 on error.
  */
-int recv_file_size(int sock, char *buffer, char *ack);
+int recv_file_size(int sock, char *buffer, char *ack, unsigned int *checksum);
+
+/**
+ * Folds a chunk of data into a running FNV-1a checksum.
+ * @param hash The checksum so far.
+ * @param data The chunk.
+ * @param len The length of the chunk.
+ * @return The updated checksum.
+ */
+unsigned int update_checksum(unsigned int hash, const char *data, int len);
 
 /**
  * Sends the key to the server.
@@ -44,15 +148,78 @@ int send_key(int sock, char *buffer);
 int send_ack(int sock, char *ack);
 
 /**
- * Writes a chunk of data to the file.
- * @param fp The file pointer.
+ * Writes a chunk of data to the sink.
+ * @param sink The sink.
  * @param sock The socket descriptor.
  * @param chunk_size The size of the chunk.
  * @param buffer The buffer containing the chunk.
  * @param ack The ACK message to send.
  * @return 0 on success, -1 on error.
  */
-int write_chunk(FILE *fp, int sock, int chunk_size, char *buffer, char *ack);
+int write_chunk(struct sink *sink, int sock, int chunk_size, char *buffer, char *ack);
+
+/**
+ * Receives a file multicast by the sender's -m mode, asking for repairs of
+ * lost packets with NACKs. NACKs go to the group after a random delay, so a
+ * receiver that hears another's NACK for the same packets stays quiet.
+ * @param sink The sink to write the file to.
+ * @param group The multicast group address.
+ * @param iface The address of the interface to join on, or NULL for any.
+ * @return 0 on success, -1 on error.
+ */
+int multicast_receive(struct sink *sink, const char *group, const char *iface);
+
+/**
+ * Receives a file sent by the sender's -F mode. Each block is rebuilt as
+ * soon as any k of its symbols arrived; there is no feedback to the sender,
+ * so the transfer ends when every block is rebuilt or the packets stop.
+ * @param sink The sink to write the file to.
+ * @param port The UDP port to listen on.
+ * @return 0 if the whole file was rebuilt, -1 otherwise.
+ */
+int fec_receive(struct sink *sink, int port);
+
+/**
+ * Computes the checksum of everything the sink holds, when it can be read
+ * back: memory and mmap hold it in memory, file re-reads the output file.
+ * @param sink The sink, after the whole file was written.
+ * @param checksum Where to store the FNV-1a checksum.
+ * @return 0 on success, -1 if the sink can't be read back.
+ */
+int sink_checksum(struct sink *sink, unsigned int *checksum);
+
+/**
+ * Finds a sink type by name.
+ * @param name One of "null", "memory", "file" or "mmap".
+ * @return The sink operations, or NULL if there is no such sink.
+ */
+const struct sink_ops *find_sink(const char *name);
+
+/**
+ * Appends to the sink and accounts for the time it took.
+ * @param sink The sink.
+ * @param data The data.
+ * @param len The length of the data.
+ * @return 0 on success, -1 on error.
+ */
+int sink_write(struct sink *sink, const char *data, int len);
+
+/**
+ * Writes to the sink at a given offset and accounts for the time it took.
+ * @param sink The sink.
+ * @param data The data.
+ * @param len The length of the data.
+ * @param offset Where in the file the data goes.
+ * @return 0 on success, -1 on error.
+ */
+int sink_write_at(struct sink *sink, const char *data, int len, int offset);
+
+/**
+ * Prints how many bytes the sink took and how fast, both counting only the
+ * time inside the sink and end to end.
+ * @param sink The sink.
+ */
+void sink_report(const struct sink *sink);
 
 /**
  * Sends an END message to the server.
@@ -62,8 +229,77 @@ int write_chunk(FILE *fp, int sock, int chunk_size, char *buffer, char *ack);
  */
 int send_end(int sock, char *buffer);
 
-int main()
+int main(int argc, char *argv[])
 {
+    struct sink sink;
+    memset(&sink, 0, sizeof(sink));
+    sink.ops = find_sink(DEFAULT_SINK);
+    sink.path = DEFAULT_OUTPUT;
+    sink.fd = -1;
+
+    const char *group = NULL;
+    const char *iface = NULL;
+    int fec_port = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:o:m:i:F:")) != -1)
+    {
+        if (opt == 'F')
+        {
+            fec_port = atoi(optarg);
+            if (fec_port <= 0 || fec_port > 65535)
+            {
+                sink.ops = NULL;
+            }
+        }
+        else if (opt == 's')
+        {
+            sink.ops = find_sink(optarg);
+        }
+        else if (opt == 'o')
+        {
+            sink.path = optarg;
+        }
+        else if (opt == 'm')
+        {
+            group = optarg;
+        }
+        else if (opt == 'i')
+        {
+            iface = optarg;
+        }
+        else
+        {
+            sink.ops = NULL;
+        }
+
+        if (sink.ops == NULL)
+        {
+            break;
+        }
+    }
+
+    if (sink.ops == NULL || argc - optind > 1 || ((group != NULL || fec_port != 0) && optind < argc))
+    {
+        printf("usage: %s [-s null|memory|file|mmap] [-o output] [file_name | #id]\n", argv[0]);
+        printf("       %s [-s null|memory|file|mmap] [-o output] -m group [-i interface_ip]\n", argv[0]);
+        printf("       %s [-s null|memory|file|mmap] [-o output] -F port (%d for the sender's default)\n", argv[0],
+               FEC_PORT);
+        return -1;
+    }
+
+    if (group != NULL)
+    {
+        return multicast_receive(&sink, group, iface);
+    }
+
+    if (fec_port != 0)
+    {
+        return fec_receive(&sink, fec_port);
+    }
+
+    const char *file_name = optind < argc ? argv[optind] : DEFAULT_FILE;
+
     int temp = 0;
     int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
@@ -99,9 +335,19 @@ int main()
     char buffer[BUFFER_SIZE] = {0};
     char *ack_msg = "ACK";
 
+    printf("Requesting %s...\n", file_name);
+
+    if (send_request(sock, file_name) == -1)
+    {
+        close(sock);
+        return -1;
+    }
+
     printf("Receiving file size...\n");
 
-    int size = recv_file_size(sock, buffer, ack_msg);
+    unsigned int expected_checksum = 0;
+    unsigned int checksum = FNV_OFFSET_BASIS;
+    int size = recv_file_size(sock, buffer, ack_msg, &expected_checksum);
 
     if (size == -1)
     {
@@ -122,6 +368,13 @@ int main()
 
     printf("File size received successfully!\n");
 
+    if (sink.ops->open(&sink, size) == -1)
+    {
+        printf("Error : Opening the %s sink failed.\n", sink.ops->name);
+        close(sock);
+        return -1;
+    }
+
     // We now declare an array to store the time it took to receive each half of the file.
     // The **even** indices will store the time it took to receive the first half (meaning in cc algorithm reno).
     // The **odd** indices will store the time it took to receive the second half (meaning in cc algorithm cubic).
@@ -134,14 +387,6 @@ int main()
 
     while (1)
     {
-        FILE *fp = fopen("recv.txt", "w");
-        if (fp == NULL)
-        {
-            printf("Error : File opening failed.\n");
-            close(sock);
-            return -1;
-        }
-
         // Setting the congestion control algorithm to reno for the receival of the first half of the file.
         if (setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, CC_ALGO_1, 6) < 0)
         {
@@ -237,12 +482,22 @@ int main()
                 }
 
                 printf("Second part of the file received successfully!\n");
+
+                if (checksum != expected_checksum)
+                {
+                    printf("Error : Checksum mismatch, expected %08x but got %08x.\n", expected_checksum, checksum);
+                    close(sock);
+                    return -1;
+                }
+
+                printf("Checksum %08x verified.\n", checksum);
                 break;
             }
             else
             {
                 chunk_size = temp;
-                temp = write_chunk(fp, sock, chunk_size, buffer, ack_msg);
+                checksum = update_checksum(checksum, buffer, chunk_size);
+                temp = write_chunk(&sink, sock, chunk_size, buffer, ack_msg);
 
                 if (temp == -1)
                 {
@@ -288,21 +543,19 @@ int main()
                 return -1;
             }
 
-            printf("Server wishes to send the file again, deleting the file and preparing to receive it again...\n");
+            printf("Server wishes to send the file again, discarding the file and preparing to receive it again...\n");
 
-            fseek(fp, 0, SEEK_SET);
-            fclose(fp);
-            int rmv = remove("recv.txt");
             counter = 0;
+            checksum = FNV_OFFSET_BASIS;
 
-            if (rmv != 0)
+            if (sink.ops->reset(&sink) == -1)
             {
-                printf("Error : File removal failed.\n");
+                printf("Error : Resetting the %s sink failed.\n", sink.ops->name);
                 close(sock);
                 return -1;
             }
 
-            printf("File deleted successfully!\n");
+            printf("File discarded successfully!\n");
         }
         else if (strcmp(buffer, "END") == 0)
         {
@@ -337,6 +590,13 @@ int main()
     close(sock);
     printf("Socket closed, goodbye!\n");
 
+    sink_report(&sink);
+
+    if (sink.ops->close(&sink) == -1)
+    {
+        printf("Error : Closing the %s sink failed.\n", sink.ops->name);
+    }
+
     printf("\n");
     printf("Time it took to receive each iteration of 1st half of the file (in %s cc protocol):\n", CC_ALGO_1);
     printf("\n");
@@ -381,7 +641,33 @@ int main()
 
 // ########################## THE FUNCTIONS: #############################
 
-int recv_file_size(int sock, char *buffer, char *ack)
+int send_request(int sock, const char *name)
+{
+    int len = (int)strlen(name) + 1;
+
+    if (len > MAX_NAME_LEN)
+    {
+        printf("Error : File name is too long.\n");
+        return -1;
+    }
+
+    int send_result = send(sock, name, len, 0);
+
+    if (send_result == -1)
+    {
+        printf("Error : Sending failed.\n");
+        return -1;
+    }
+    else if (send_result != len)
+    {
+        printf("Error : Server received a corrupted buffer.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int recv_file_size(int sock, char *buffer, char *ack, unsigned int *checksum)
 {
     int bytes = recv(sock, buffer, BUFFER_SIZE, 0);
 
@@ -396,6 +682,12 @@ int recv_file_size(int sock, char *buffer, char *ack)
         return -1;
     }
 
+    if (strcmp(buffer, "NOFILE") == 0)
+    {
+        printf("Error : The server has no such file.\n");
+        return -1;
+    }
+
     int ack_result = send_ack(sock, ack);
 
     if (ack_result == -1)
@@ -403,9 +695,13 @@ int recv_file_size(int sock, char *buffer, char *ack)
         return -1;
     }
 
-    char **end;
-    long val = strtol(buffer, end, 10);
-    int size = (int)val;
+    int size = -1;
+
+    if (sscanf(buffer, "%d %x", &size, checksum) != 2)
+    {
+        printf("Error : Malformed file size message.\n");
+        return -1;
+    }
 
     bzero(buffer, (int)(strlen(buffer) + 1));
 
@@ -486,9 +782,13 @@ int send_ack(int sock, char *ack)
     return 0;
 }
 
-int write_chunk(FILE *fp, int sock, int chunk_size, char *buffer, char *ack)
+int write_chunk(struct sink *sink, int sock, int chunk_size, char *buffer, char *ack)
 {
-    fwrite(buffer, chunk_size, 1, fp);
+    if (sink_write(sink, buffer, chunk_size) == -1)
+    {
+        printf("Error : Writing to the %s sink failed.\n", sink->ops->name);
+        return -1;
+    }
 
     int send_result = send(sock, ack, 4, 0);
 
@@ -559,3 +859,1097 @@ int send_end(int sock, char *buffer)
 
     return 0;
 }
+
+unsigned int update_checksum(unsigned int hash, const char *data, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+// ########################## THE SINKS: #############################
+
+/**
+ * Reads CLOCK_MONOTONIC.
+ * @return The current time in nanoseconds.
+ */
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Checks that a write fits in the sink's preallocated memory.
+ * @param sink The sink.
+ * @param len The length of the write.
+ * @param offset Where the write starts.
+ * @return 0 if it fits, -1 if not.
+ */
+static int check_room(const struct sink *sink, int len, int offset)
+{
+    if (offset < 0 || offset + len > sink->size)
+    {
+        printf("Error : Write past the end of the %d bytes the sink holds.\n", sink->size);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The null sink discards everything, so only the network is measured.
+
+static int null_open(struct sink *sink, int size)
+{
+    (void)sink;
+    (void)size;
+    return 0;
+}
+
+static int null_write(struct sink *sink, const char *data, int len, int offset)
+{
+    (void)sink;
+    (void)data;
+    (void)len;
+    (void)offset;
+    return 0;
+}
+
+static int null_reset(struct sink *sink)
+{
+    sink->offset = 0;
+    return 0;
+}
+
+static int null_close(struct sink *sink)
+{
+    (void)sink;
+    return 0;
+}
+
+// The memory sink keeps the file in a heap buffer for in-process consumers.
+
+static int memory_open(struct sink *sink, int size)
+{
+    // malloc(0) may return NULL, so always ask for at least one byte.
+    sink->memory = malloc(size > 0 ? size : 1);
+    sink->size = size;
+
+    return sink->memory == NULL ? -1 : 0;
+}
+
+static int memory_write(struct sink *sink, const char *data, int len, int offset)
+{
+    if (check_room(sink, len, offset) == -1)
+    {
+        return -1;
+    }
+
+    memcpy(sink->memory + offset, data, len);
+    return 0;
+}
+
+static int memory_reset(struct sink *sink)
+{
+    sink->offset = 0;
+    return 0;
+}
+
+static int memory_close(struct sink *sink)
+{
+    free(sink->memory);
+    sink->memory = NULL;
+    return 0;
+}
+
+// The file sink writes through stdio, as the receiver always did.
+
+static int file_open(struct sink *sink, int size)
+{
+    (void)size;
+    sink->fp = fopen(sink->path, "w");
+
+    return sink->fp == NULL ? -1 : 0;
+}
+
+static int file_write(struct sink *sink, const char *data, int len, int offset)
+{
+    // Only out-of-order writes (multicast repairs) pay for a seek.
+    if (ftello(sink->fp) != offset && fseeko(sink->fp, offset, SEEK_SET) == -1)
+    {
+        return -1;
+    }
+
+    return fwrite(data, len, 1, sink->fp) == 1 ? 0 : -1;
+}
+
+static int file_reset(struct sink *sink)
+{
+    sink->offset = 0;
+    sink->fp = freopen(sink->path, "w", sink->fp);
+
+    return sink->fp == NULL ? -1 : 0;
+}
+
+static int file_close(struct sink *sink)
+{
+    int result = fclose(sink->fp);
+    sink->fp = NULL;
+
+    return result == 0 ? 0 : -1;
+}
+
+// The mmap sink preallocates the output file and copies into a shared mapping.
+
+static int mmap_open(struct sink *sink, int size)
+{
+    sink->fd = open(sink->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (sink->fd == -1)
+    {
+        return -1;
+    }
+
+    sink->size = size;
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    // posix_fallocate() reserves the blocks up front, so running out of disk
+    // shows up here instead of as a SIGBUS in the middle of the transfer.
+    if (posix_fallocate(sink->fd, 0, size) != 0 && ftruncate(sink->fd, size) == -1)
+    {
+        close(sink->fd);
+        return -1;
+    }
+
+    sink->memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sink->fd, 0);
+    if (sink->memory == MAP_FAILED)
+    {
+        sink->memory = NULL;
+        close(sink->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int mmap_reset(struct sink *sink)
+{
+    sink->offset = 0;
+    return 0;
+}
+
+static int mmap_close(struct sink *sink)
+{
+    int result = 0;
+
+    if (sink->memory != NULL)
+    {
+        result = munmap(sink->memory, sink->size);
+        sink->memory = NULL;
+    }
+
+    // Trim the preallocation if the server sent less than it announced.
+    if (sink->offset < sink->size && ftruncate(sink->fd, sink->offset) == -1)
+    {
+        result = -1;
+    }
+
+    if (close(sink->fd) == -1)
+    {
+        result = -1;
+    }
+    sink->fd = -1;
+
+    return result;
+}
+
+static const struct sink_ops sink_types[] = {
+    {"null", null_open, null_write, null_reset, null_close},
+    {"memory", memory_open, memory_write, memory_reset, memory_close},
+    {"file", file_open, file_write, file_reset, file_close},
+    {"mmap", mmap_open, memory_write, mmap_reset, mmap_close},
+};
+
+const struct sink_ops *find_sink(const char *name)
+{
+    for (size_t i = 0; i < sizeof(sink_types) / sizeof(sink_types[0]); i++)
+    {
+        if (strcmp(sink_types[i].name, name) == 0)
+        {
+            return &sink_types[i];
+        }
+    }
+
+    return NULL;
+}
+
+int sink_write(struct sink *sink, const char *data, int len)
+{
+    return sink_write_at(sink, data, len, sink->offset);
+}
+
+int sink_write_at(struct sink *sink, const char *data, int len, int offset)
+{
+    long long start = now_ns();
+
+    if (sink->ops->write(sink, data, len, offset) == -1)
+    {
+        return -1;
+    }
+
+    long long end = now_ns();
+
+    if (sink->bytes == 0)
+    {
+        sink->first_ns = start;
+    }
+
+    sink->last_ns = end;
+    sink->busy_ns += end - start;
+    sink->bytes += len;
+    if (offset + len > sink->offset)
+    {
+        sink->offset = offset + len;
+    }
+
+    return 0;
+}
+
+void sink_report(const struct sink *sink)
+{
+    double busy = sink->busy_ns * 1e-9;
+    double elapsed = (sink->last_ns - sink->first_ns) * 1e-9;
+
+    printf("Sink '%s' took %lld bytes.\n", sink->ops->name, sink->bytes);
+
+    if (busy > 0)
+    {
+        printf("Time inside the sink: %f seconds (%.2f MB/s).\n", busy, sink->bytes / busy / 1e6);
+    }
+
+    if (elapsed > 0)
+    {
+        printf("Time from first to last byte: %f seconds (%.2f MB/s).\n", elapsed, sink->bytes / elapsed / 1e6);
+    }
+
+    printf("\n");
+}
+
+int sink_checksum(struct sink *sink, unsigned int *checksum)
+{
+    if (sink->memory != NULL)
+    {
+        *checksum = update_checksum(FNV_OFFSET_BASIS, sink->memory, sink->offset);
+        return 0;
+    }
+
+    if (sink->fp == NULL || fflush(sink->fp) != 0)
+    {
+        return -1;
+    }
+
+    int fd = open(sink->path, O_RDONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    char chunk[64 * BUFFER_SIZE];
+    unsigned int hash = FNV_OFFSET_BASIS;
+    int bytes;
+
+    while ((bytes = (int)read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        hash = update_checksum(hash, chunk, bytes);
+    }
+
+    close(fd);
+    *checksum = hash;
+
+    return bytes == 0 ? 0 : -1;
+}
+
+// ########################## MULTICAST: #############################
+
+/**
+ * State of a multicast reception.
+ */
+struct mcast_receiver
+{
+    int sock;
+    struct sockaddr_in group_address;
+    uint32_t session;        // 0 until the first packet arrives.
+    uint32_t total;
+    uint32_t size;
+    uint32_t checksum;
+    unsigned char *received; // One flag per DATA packet.
+    long long *nacked_ns;    // When each packet was last NACKed, by anyone.
+    uint32_t count;          // Packets received.
+    uint32_t horizon;        // Packets below this index should have arrived.
+    uint32_t first_missing;  // No packet below this index is missing.
+    long long nack_due_ns;   // When to send the next NACK, 0 if none pending.
+    double nack_tokens;
+    long long nack_refill_ns;
+    unsigned int seed;
+    long long nacks_sent;
+    long long nacks_suppressed;
+    long long duplicates;
+};
+
+/**
+ * Picks the delay before the next NACK.
+ * @param receiver The receiver.
+ * @return The delay in nanoseconds.
+ */
+static long long nack_delay_ns(struct mcast_receiver *receiver)
+{
+    int spread = NACK_DELAY_MAX_MS - NACK_DELAY_MIN_MS;
+    int delay_ms = NACK_DELAY_MIN_MS + rand_r(&receiver->seed) % (spread + 1);
+
+    return delay_ms * 1000000LL;
+}
+
+/**
+ * Starts receiving a transfer on the first packet of its session.
+ * @param receiver The receiver.
+ * @param header The packet's header, in host byte order.
+ * @param sink The sink.
+ * @return 0 on success, -1 on error.
+ */
+static int mcast_start(struct mcast_receiver *receiver, const struct mcast_header *header, struct sink *sink)
+{
+    receiver->session = header->session;
+    receiver->total = header->total;
+    receiver->size = header->size;
+    receiver->checksum = header->checksum;
+    receiver->received = calloc(header->total + 1, 1);
+    receiver->nacked_ns = calloc(header->total + 1, sizeof(long long));
+
+    if (receiver->received == NULL || receiver->nacked_ns == NULL)
+    {
+        printf("Error : Allocating the reception state failed.\n");
+        return -1;
+    }
+
+    if (sink->ops->open(sink, (int)header->size) == -1)
+    {
+        printf("Error : Opening the %s sink failed.\n", sink->ops->name);
+        return -1;
+    }
+
+    printf("Receiving a %u bytes file in %u packets (session %08x)...\n", header->size, header->total,
+           header->session);
+    return 0;
+}
+
+/**
+ * Handles one datagram from the group.
+ * @param receiver The receiver.
+ * @param packet The datagram.
+ * @param len Its length.
+ * @param sink The sink.
+ * @param now The current time in nanoseconds.
+ * @return 0 on success, -1 on error.
+ */
+static int mcast_handle(struct mcast_receiver *receiver, char *packet, int len, struct sink *sink, long long now)
+{
+    struct mcast_header header;
+
+    if (len < (int)sizeof(header))
+    {
+        return 0;
+    }
+
+    memcpy(&header, packet, sizeof(header));
+    header.session = ntohl(header.session);
+    header.seq = ntohl(header.seq);
+    header.total = ntohl(header.total);
+    header.size = ntohl(header.size);
+    header.checksum = ntohl(header.checksum);
+    header.len = ntohs(header.len);
+
+    if (ntohl(header.magic) != MCAST_MAGIC)
+    {
+        return 0;
+    }
+
+    if (receiver->session == 0 && header.type != MCAST_NACK)
+    {
+        // The reception state is sized from this header, so a stray or
+        // corrupt one mustn't start the transfer.
+        if (header.size > INT_MAX ||
+            header.total != ((uint64_t)header.size + MCAST_PAYLOAD - 1) / MCAST_PAYLOAD)
+        {
+            return 0;
+        }
+
+        if (mcast_start(receiver, &header, sink) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if (header.session != receiver->session)
+    {
+        return 0;
+    }
+
+    if (header.type == MCAST_DATA)
+    {
+        uint32_t offset = header.seq * MCAST_PAYLOAD;
+
+        if (header.seq >= receiver->total || header.len > len - (int)sizeof(header) ||
+            offset + header.len > receiver->size)
+        {
+            return 0;
+        }
+
+        if (receiver->received[header.seq])
+        {
+            receiver->duplicates++;
+            return 0;
+        }
+
+        if (sink_write_at(sink, packet + sizeof(header), header.len, (int)offset) == -1)
+        {
+            printf("Error : Writing to the %s sink failed.\n", sink->ops->name);
+            return -1;
+        }
+
+        receiver->received[header.seq] = 1;
+        receiver->count++;
+
+        if (header.seq + 1 > receiver->horizon)
+        {
+            receiver->horizon = header.seq + 1;
+        }
+    }
+    else if (header.type == MCAST_FIN)
+    {
+        // Nothing follows a FIN, so losses at the tail become visible.
+        receiver->horizon = receiver->total;
+    }
+    else if (header.type == MCAST_NACK)
+    {
+        // Someone (maybe us) asked for these: don't ask again for a while.
+        uint32_t *ranges = (uint32_t *)(packet + sizeof(header));
+        int count = header.ranges;
+
+        if ((int)(sizeof(header) + count * 2 * sizeof(uint32_t)) > len)
+        {
+            return 0;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            uint32_t first = ntohl(ranges[2 * i]);
+            uint32_t n = ntohl(ranges[2 * i + 1]);
+
+            for (uint32_t seq = first; seq < first + n && seq < receiver->total; seq++)
+            {
+                receiver->nacked_ns[seq] = now;
+            }
+        }
+    }
+
+    if (receiver->nack_due_ns == 0 && receiver->count < receiver->horizon)
+    {
+        receiver->nack_due_ns = now + nack_delay_ns(receiver);
+    }
+
+    return 0;
+}
+
+/**
+ * Sends a NACK for the missing packets nobody asked for recently, if the
+ * NACK rate limit allows it, and schedules the next one.
+ * @param receiver The receiver.
+ * @param now The current time in nanoseconds.
+ */
+static void mcast_send_nack(struct mcast_receiver *receiver, long long now)
+{
+    long long holdoff = NACK_HOLDOFF_MS * 1000000LL;
+
+    receiver->nack_tokens += (now - receiver->nack_refill_ns) * NACK_RATE / 1e9;
+    receiver->nack_refill_ns = now;
+    if (receiver->nack_tokens > NACK_BURST)
+    {
+        receiver->nack_tokens = NACK_BURST;
+    }
+
+    if (receiver->nack_tokens < 1)
+    {
+        receiver->nack_due_ns = now + (long long)((1 - receiver->nack_tokens) * 1e9 / NACK_RATE);
+        return;
+    }
+
+    char packet[sizeof(struct mcast_header) + MCAST_MAX_RANGES * 2 * sizeof(uint32_t)];
+    struct mcast_header *header = (struct mcast_header *)packet;
+    uint32_t *ranges = (uint32_t *)(packet + sizeof(struct mcast_header));
+    int count = 0;
+    int suppressed = 0;
+
+    while (receiver->first_missing < receiver->total && receiver->received[receiver->first_missing])
+    {
+        receiver->first_missing++;
+    }
+
+    for (uint32_t seq = receiver->first_missing; seq < receiver->horizon && count < MCAST_MAX_RANGES; seq++)
+    {
+        if (receiver->received[seq])
+        {
+            continue;
+        }
+
+        if (receiver->nacked_ns[seq] != 0 && now - receiver->nacked_ns[seq] < holdoff)
+        {
+            suppressed = 1;
+            continue;
+        }
+
+        if (count > 0 && ntohl(ranges[2 * (count - 1)]) + ntohl(ranges[2 * (count - 1) + 1]) == seq)
+        {
+            ranges[2 * (count - 1) + 1] = htonl(ntohl(ranges[2 * (count - 1) + 1]) + 1);
+        }
+        else
+        {
+            ranges[2 * count] = htonl(seq);
+            ranges[2 * count + 1] = htonl(1);
+            count++;
+        }
+
+        receiver->nacked_ns[seq] = now;
+    }
+
+    if (count > 0)
+    {
+        memset(header, 0, sizeof(struct mcast_header));
+        header->magic = htonl(MCAST_MAGIC);
+        header->type = MCAST_NACK;
+        header->ranges = (uint8_t)count;
+        header->session = htonl(receiver->session);
+
+        int len = (int)(sizeof(struct mcast_header) + count * 2 * sizeof(uint32_t));
+        if (sendto(receiver->sock, packet, len, 0, (struct sockaddr *)&receiver->group_address,
+                   sizeof(receiver->group_address)) == len)
+        {
+            receiver->nacks_sent++;
+            receiver->nack_tokens -= 1;
+        }
+    }
+    else if (suppressed)
+    {
+        receiver->nacks_suppressed++;
+    }
+
+    // Whatever is still missing gets asked for again once the holdoff
+    // passes, unless its repair arrives first.
+    receiver->nack_due_ns = receiver->count < receiver->horizon ? now + holdoff + nack_delay_ns(receiver) : 0;
+}
+
+int multicast_receive(struct sink *sink, const char *group, const char *iface)
+{
+    struct mcast_receiver receiver;
+    memset(&receiver, 0, sizeof(receiver));
+    receiver.seed = (unsigned int)(getpid() ^ now_ns());
+    receiver.nack_tokens = NACK_BURST;
+    receiver.nack_refill_ns = now_ns();
+
+    receiver.sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (receiver.sock == -1)
+    {
+        printf("Error : Socket creation failed.\n");
+        return -1;
+    }
+
+    // Several receivers on one host share the group's port.
+    int reuse = 1;
+    setsockopt(receiver.sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    int rcvbuf = MCAST_RCVBUF;
+    setsockopt(receiver.sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(&receiver.group_address, 0, sizeof(receiver.group_address));
+    receiver.group_address.sin_family = AF_INET;
+    receiver.group_address.sin_port = htons(MCAST_PORT);
+
+    struct ip_mreq membership;
+    memset(&membership, 0, sizeof(membership));
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    if (inet_pton(AF_INET, group, &receiver.group_address.sin_addr) <= 0 ||
+        (iface != NULL && inet_pton(AF_INET, iface, &membership.imr_interface) <= 0))
+    {
+        printf("Error: inet_pton() failed.\n");
+        close(receiver.sock);
+        return -1;
+    }
+
+    membership.imr_multiaddr = receiver.group_address.sin_addr;
+
+    // Bound to any address rather than the group's, so the NACKs we send
+    // get a unicast source address.
+    struct sockaddr_in bind_address = receiver.group_address;
+    bind_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(receiver.sock, (struct sockaddr *)&bind_address, sizeof(bind_address)) == -1)
+    {
+        printf("Error : Binding to the group's port failed.\n");
+        close(receiver.sock);
+        return -1;
+    }
+
+    if (setsockopt(receiver.sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == -1 ||
+        setsockopt(receiver.sock, IPPROTO_IP, IP_MULTICAST_IF, &membership.imr_interface,
+                   sizeof(membership.imr_interface)) == -1)
+    {
+        printf("Error : Joining multicast group %s failed.\n", group);
+        close(receiver.sock);
+        return -1;
+    }
+
+    printf("Joined multicast group %s, waiting for the sender...\n", group);
+
+    char packet[sizeof(struct mcast_header) + MCAST_PAYLOAD + MCAST_MAX_RANGES * 2 * sizeof(uint32_t)];
+    long long last_packet_ns = now_ns();
+    int result = 0;
+
+    while (receiver.session == 0 || receiver.count < receiver.total)
+    {
+        long long now = now_ns();
+        long long wait_ns = MCAST_IDLE_TIMEOUT_MS * 1000000LL - (now - last_packet_ns);
+
+        if (wait_ns <= 0)
+        {
+            printf("Error : Nothing heard from the sender for %d ms, giving up.\n", MCAST_IDLE_TIMEOUT_MS);
+            result = -1;
+            break;
+        }
+
+        if (receiver.nack_due_ns != 0 && receiver.nack_due_ns - now < wait_ns)
+        {
+            wait_ns = receiver.nack_due_ns > now ? receiver.nack_due_ns - now : 0;
+        }
+
+        struct pollfd pfd = {receiver.sock, POLLIN, 0};
+        int ready = poll(&pfd, 1, (int)((wait_ns + 999999) / 1000000));
+
+        if (ready == -1 && errno != EINTR)
+        {
+            printf("Error : poll() failed.\n");
+            result = -1;
+            break;
+        }
+
+        now = now_ns();
+
+        if (ready > 0)
+        {
+            int len;
+
+            while ((len = (int)recv(receiver.sock, packet, sizeof(packet), MSG_DONTWAIT)) > 0)
+            {
+                struct mcast_header *header = (struct mcast_header *)packet;
+
+                if (header->type != MCAST_NACK)
+                {
+                    last_packet_ns = now;
+                }
+
+                if (mcast_handle(&receiver, packet, len, sink, now) == -1)
+                {
+                    result = -1;
+                    break;
+                }
+            }
+
+            if (result == -1)
+            {
+                break;
+            }
+        }
+
+        if (receiver.nack_due_ns != 0 && now >= receiver.nack_due_ns)
+        {
+            mcast_send_nack(&receiver, now);
+        }
+    }
+
+    close(receiver.sock);
+
+    if (result == 0)
+    {
+        printf("File received successfully!\n");
+        printf("NACKs sent: %lld, suppressed: %lld, duplicate packets: %lld.\n", receiver.nacks_sent,
+               receiver.nacks_suppressed, receiver.duplicates);
+
+        unsigned int checksum;
+        if (sink_checksum(sink, &checksum) == -1)
+        {
+            printf("The %s sink can't be read back, checksum not verified.\n", sink->ops->name);
+        }
+        else if (checksum != receiver.checksum)
+        {
+            printf("Error : Checksum mismatch, expected %08x but got %08x.\n", receiver.checksum, checksum);
+            result = -1;
+        }
+        else
+        {
+            printf("Checksum %08x verified.\n", checksum);
+        }
+
+        printf("\n");
+        sink_report(sink);
+    }
+
+    if (receiver.session != 0 && sink->ops->close(sink) == -1)
+    {
+        printf("Error : Closing the %s sink failed.\n", sink->ops->name);
+    }
+
+    free(receiver.received);
+    free(receiver.nacked_ns);
+
+    return result;
+}
+
+// ########################## FORWARD ERROR CORRECTION: #############################
+
+/**
+ * Header of every FEC datagram, all fields in network byte order. The
+ * symbol (symbol_size bytes, the last data symbol zero-padded) follows.
+ */
+struct fec_header
+{
+    uint32_t magic;
+    uint32_t session; // Picked at random by the sender for each transfer.
+    uint32_t size;    // Size of the file in bytes.
+    uint32_t checksum;
+    uint32_t block;       // Index of the block the symbol belongs to.
+    uint8_t esi;          // < k: data symbol esi, >= k: repair symbol esi - k.
+    uint8_t k;            // Data symbols in this block (fewer in the last one).
+    uint8_t block_k;      // Data symbols in a full block.
+    uint8_t m;            // Repair symbols sent for this block.
+    uint16_t symbol_size; // Bytes per symbol.
+    uint16_t reserved;
+};
+
+/**
+ * The symbols of one block received so far. Freed once the block is rebuilt.
+ */
+struct fec_block
+{
+    unsigned char *symbols;                 // k slots of symbol_size bytes, in arrival order.
+    int esis[FEC_MAX_SYMBOLS];              // ESI of each slot.
+    unsigned char seen[FEC_MAX_SYMBOLS];    // Per ESI, whether it arrived.
+    int k;
+    int count;
+};
+
+/**
+ * Rebuilds a block from its k symbols and writes its data to the sink.
+ * @param block The block, holding k symbols.
+ * @param index The block's index.
+ * @param header The header of any of its packets, in host byte order.
+ * @param sink The sink.
+ * @return 0 on success, -1 on error.
+ */
+static int fec_finish_block(struct fec_block *block, uint32_t index, const struct fec_header *header,
+                            struct sink *sink)
+{
+    int k = header->k;
+    int len = header->symbol_size;
+    unsigned char *symbols[FEC_MAX_SYMBOLS];
+    unsigned char *data[FEC_MAX_SYMBOLS];
+    unsigned char *rebuilt = malloc((size_t)k * len);
+
+    if (rebuilt == NULL)
+    {
+        printf("Error : Allocating the block buffer failed.\n");
+        return -1;
+    }
+
+    for (int r = 0; r < k; r++)
+    {
+        symbols[r] = block->symbols + r * len;
+        data[r] = rebuilt + r * len;
+    }
+
+    if (fec_decode(k, block->esis, symbols, data, len) == -1)
+    {
+        printf("Error : Block %u can't be decoded.\n", index);
+        free(rebuilt);
+        return -1;
+    }
+
+    // fec_decode() only fills in the missing data symbols.
+    for (int r = 0; r < k; r++)
+    {
+        if (block->esis[r] < k)
+        {
+            memcpy(data[block->esis[r]], symbols[r], len);
+        }
+    }
+
+    long long offset = (long long)index * header->block_k * len;
+    int result = 0;
+
+    for (int j = 0; j < k && result == 0; j++)
+    {
+        long long start = offset + (long long)j * len;
+        int bytes = start + len > header->size ? (int)(header->size - start) : len;
+
+        result = sink_write_at(sink, (char *)data[j], bytes, (int)start);
+    }
+
+    free(rebuilt);
+    return result;
+}
+
+int fec_receive(struct sink *sink, int port)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == -1)
+    {
+        printf("Error : Socket creation failed.\n");
+        return -1;
+    }
+
+    int rcvbuf = MCAST_RCVBUF;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        printf("Error : Binding to port %d failed.\n", port);
+        close(sock);
+        return -1;
+    }
+
+    fec_init();
+    printf("Waiting for FEC packets on port %d...\n", port);
+
+    char packet[sizeof(struct fec_header) + 65536];
+    struct fec_header first;
+    memset(&first, 0, sizeof(first));
+    struct fec_block **blocks = NULL;
+    unsigned char *done = NULL;
+    uint32_t session = 0;
+    uint32_t block_count = 0;
+    uint32_t blocks_done = 0;
+    long long packets = 0;
+    long long packets_sent = 0; // What the sender sent for the blocks seen.
+    long long last_packet_ns = now_ns();
+    int timeout_ms = FEC_START_TIMEOUT_MS;
+    int opened = 0;
+    int result = 0;
+
+    while (session == 0 || blocks_done < block_count)
+    {
+        struct pollfd pfd = {sock, POLLIN, 0};
+        int wait_ms = timeout_ms - (int)((now_ns() - last_packet_ns) / 1000000);
+        int ready = wait_ms > 0 ? poll(&pfd, 1, wait_ms) : 0;
+
+        if (ready == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (ready <= 0)
+        {
+            break;
+        }
+
+        int len = (int)recv(sock, packet, sizeof(packet), 0);
+        struct fec_header header;
+
+        if (len < (int)sizeof(header))
+        {
+            continue;
+        }
+
+        memcpy(&header, packet, sizeof(header));
+        header.session = ntohl(header.session);
+        header.size = ntohl(header.size);
+        header.checksum = ntohl(header.checksum);
+        header.block = ntohl(header.block);
+        header.symbol_size = ntohs(header.symbol_size);
+
+        if (ntohl(header.magic) != FEC_MAGIC || header.k == 0 || header.block_k == 0 || header.k > header.block_k ||
+            header.symbol_size == 0 || len < (int)sizeof(header) + header.symbol_size ||
+            (long long)header.block * header.block_k * header.symbol_size >= header.size || header.size > INT_MAX)
+        {
+            continue;
+        }
+
+        // Only the last block may be short, by exactly what the file lacks;
+        // any other k would write its symbols outside the file.
+        long long remaining = header.size - (long long)header.block * header.block_k * header.symbol_size;
+        long long expected_k = (remaining + header.symbol_size - 1) / header.symbol_size;
+
+        if (header.k != (expected_k < header.block_k ? expected_k : header.block_k))
+        {
+            continue;
+        }
+
+        if (session == 0)
+        {
+            long long block_bytes = (long long)header.block_k * header.symbol_size;
+
+            session = header.session;
+            first = header;
+            block_count = (uint32_t)((header.size + block_bytes - 1) / block_bytes);
+            blocks = calloc(block_count, sizeof(struct fec_block *));
+            done = calloc(block_count, 1);
+            timeout_ms = FEC_IDLE_TIMEOUT_MS;
+
+            if (blocks == NULL || done == NULL || sink->ops->open(sink, (int)header.size) == -1)
+            {
+                printf("Error : Preparing to receive %u bytes failed.\n", header.size);
+                result = -1;
+                break;
+            }
+
+            opened = 1;
+
+            printf("Receiving a %u bytes file in %u blocks (session %08x)...\n", header.size, block_count, session);
+        }
+
+        if (header.session != session || header.block_k != first.block_k ||
+            header.symbol_size != first.symbol_size || header.block >= block_count)
+        {
+            continue;
+        }
+
+        last_packet_ns = now_ns();
+        packets++;
+
+        if (done[header.block])
+        {
+            continue;
+        }
+
+        struct fec_block *block = blocks[header.block];
+
+        if (block == NULL)
+        {
+            block = calloc(1, sizeof(struct fec_block));
+            if (block != NULL)
+            {
+                block->symbols = malloc((size_t)header.k * header.symbol_size);
+            }
+
+            if (block == NULL || block->symbols == NULL)
+            {
+                printf("Error : Allocating block %u failed.\n", header.block);
+                free(block);
+                result = -1;
+                break;
+            }
+
+            block->k = header.k;
+            blocks[header.block] = block;
+            packets_sent += header.k + header.m;
+        }
+
+        if (block->seen[header.esi] || header.k != block->k)
+        {
+            continue;
+        }
+
+        block->seen[header.esi] = 1;
+        block->esis[block->count] = header.esi;
+        memcpy(block->symbols + block->count * header.symbol_size, packet + sizeof(header), header.symbol_size);
+        block->count++;
+
+        if (block->count == header.k)
+        {
+            if (fec_finish_block(block, header.block, &header, sink) == -1)
+            {
+                result = -1;
+                break;
+            }
+
+            free(block->symbols);
+            free(block);
+            blocks[header.block] = NULL;
+            done[header.block] = 1;
+            blocks_done++;
+        }
+    }
+
+    close(sock);
+
+    if (session == 0)
+    {
+        printf("Error : No FEC packets arrived.\n");
+        return -1;
+    }
+
+    printf("Rebuilt %u of %u blocks from %lld packets", blocks_done, block_count, packets);
+    if (packets_sent > 0)
+    {
+        printf(" (at least %.1f%% lost on the way)", 100.0 - 100.0 * packets / packets_sent);
+    }
+    printf(".\n");
+
+    if (result == 0 && blocks_done < block_count)
+    {
+        printf("Error : %u blocks got fewer than k symbols, raise the sender's repair ratio (-p).\n",
+               block_count - blocks_done);
+        result = -1;
+    }
+
+    if (result == 0)
+    {
+        unsigned int checksum;
+
+        if (sink_checksum(sink, &checksum) == -1)
+        {
+            printf("The %s sink can't be read back, checksum not verified.\n", sink->ops->name);
+        }
+        else if (checksum != first.checksum)
+        {
+            printf("Error : Checksum mismatch, expected %08x but got %08x.\n", first.checksum, checksum);
+            result = -1;
+        }
+        else
+        {
+            printf("Checksum %08x verified.\n", checksum);
+        }
+
+        printf("\n");
+        sink_report(sink);
+    }
+
+    for (uint32_t i = 0; blocks != NULL && i < block_count; i++)
+    {
+        if (blocks[i] != NULL)
+        {
+            free(blocks[i]->symbols);
+            free(blocks[i]);
+        }
+    }
+
+    free(blocks);
+    free(done);
+
+    if (opened && sink->ops->close(sink) == -1)
+    {
+        printf("Error : Closing the %s sink failed.\n", sink->ops->name);
+    }
+
+    return result;
+}
@@ -1,18 +1,209 @@
+#include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "fec.h"
+
 
 #define SERVER_PORT 5060
 #define BUFFER_SIZE 1024
+#define CATALOG_DIR "."
+#define CATALOG_BUCKETS 1024 // Must be a power of two.
+#define CATALOG_MAX_DEPTH 8
+#define MAX_NAME_LEN 256
+#define DRR_QUANTUM (4 * BUFFER_SIZE)
+#define BURST_MSEC 50
+#define MCAST_PORT 5061
+#define MCAST_PAYLOAD 1400
+#define MCAST_MAGIC 0x4d435354 // "MCST"
+#define MCAST_MAX_RANGES 64
+#define MCAST_DEFAULT_RATE 10000000 // Bytes per second when -R isn't given.
+#define MCAST_TTL 1
+#define MCAST_FIN_INTERVAL_MS 100
+#define MCAST_LINGER_MS 2000     // Quiet time after which the sender is done.
+#define MCAST_REPAIR_HOLDOFF_MS 30 // Ignore NACKs for a packet just repaired.
+#define FEC_PORT 5062
+#define FEC_MAGIC 0x46454350 // "FECP"
+#define FEC_SYMBOL_SIZE 1024
+#define FEC_BLOCK_K 32
+#define FEC_DEFAULT_RATIO 1.0
+#define MAX_TRANSFERS 256      // Transfers the control socket can report.
+#define CONTROL_SAMPLE_MS 1000 // Window of the "current" throughput.
+
+/**
+ * A file the server can hand out. Everything a transfer needs is resolved
+ * once when the catalog is built, so serving a request costs a hash lookup
+ * and no open()/stat() calls.
+ */
+struct catalog_entry {
+  char name[MAX_NAME_LEN];    // Path relative to the catalog root.
+  int id;                     // Index in the catalog, requested as "#<id>".
+  int size;                   // Size of the file in bytes.
+  time_t mtime;               // Modification time when the file was scanned.
+  unsigned int checksum;      // FNV-1a hash of the file content.
+  int fd;                     // Descriptor kept open while the entry lives.
+  struct catalog_entry *next; // Next entry in the same hash bucket.
+};
+
+/**
+ * The set of files served, indexed both by name and by ID.
+ */
+struct catalog {
+  struct catalog_entry *buckets[CATALOG_BUCKETS];
+  struct catalog_entry **entries; // Entries ordered by ID.
+  int count;
+  int capacity;
+  int refs; // Main loop + running transfers, guarded by catalog_lock.
+};
+
+/**
+ * A token bucket: rate bytes per second, holding at most burst bytes.
+ * A rate of 0 means unlimited.
+ */
+struct token_bucket {
+  long long rate;
+  long long burst;
+  long long tokens;
+  long long last_ns; // CLOCK_MONOTONIC time of the last refill.
+};
+
+/**
+ * One client's transfer as seen by the scheduler. Active flows form a ring
+ * that the deficit round robin walks.
+ */
+struct flow {
+  struct scheduler *scheduler;
+  struct token_bucket bucket; // Per-client rate cap.
+  int deficit;                // DRR credit in bytes.
+  int waiting;                // Bytes the flow wants to send now, 0 if none.
+  struct flow *prev;
+  struct flow *next;
+};
+
+/**
+ * Shares the uplink between transfers: every chunk must first clear the
+ * client's own bucket, then wait for its DRR turn and the global bucket.
+ */
+struct scheduler {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct token_bucket total; // Cap on the egress of the whole server.
+  long long flow_rate;       // Rate given to each new flow's bucket.
+  struct flow *current;      // Flow whose DRR turn it is, NULL if no flows.
+};
+
+/**
+ * Everything the thread serving one client needs.
+ */
+struct client {
+  int sock;
+  struct sockaddr_in address;
+  struct catalog *catalog;
+  struct scheduler *scheduler;
+  struct flow flow;
+  struct transfer_stats *stats; // NULL if the stats table was full.
+};
+
+/**
+ * The steps of the transfer dialogue, in order. Time spent in each one is
+ * reported by the control socket.
+ */
+enum transfer_phase {
+  PHASE_REQUEST,     // Waiting for the file name.
+  PHASE_SIZE,        // Sending the size and checksum.
+  PHASE_FIRST_HALF,  // Sending the first half (reno).
+  PHASE_KEY,         // Exchanging the key.
+  PHASE_SECOND_HALF, // Sending the second half (cubic).
+  PHASE_FIN,         // Waiting for the FIN to be acknowledged.
+  PHASE_OPERATOR,    // Waiting for the operator to answer "again?".
+  PHASE_END,         // Closing the connection.
+  PHASE_COUNT
+};
+
+/**
+ * Live statistics of one transfer, written only by the thread serving it and
+ * read by the control thread. Counters are relaxed atomics so the data path
+ * never takes a lock; the peer and file name are published under a seqlock
+ * (generation is odd while they are being written).
+ */
+struct transfer_stats {
+  atomic_int in_use;
+  atomic_uint generation;
+  char peer[INET_ADDRSTRLEN + 6];     // "ip:port".
+  char file[MAX_NAME_LEN];            // Empty until the request is known.
+  atomic_llong start_ns;              // When the slot was claimed.
+  atomic_llong size;                  // Size of the file, 0 until known.
+  atomic_llong offset;                // Bytes of the file sent this round.
+  atomic_llong bytes;                 // Bytes sent over all rounds.
+  atomic_int phase;                   // The current enum transfer_phase.
+  atomic_llong phase_start_ns;        // When the current phase began.
+  atomic_llong phase_ns[PHASE_COUNT]; // Time spent in finished phases.
+};
+
+enum mcast_type { MCAST_DATA = 1, MCAST_FIN = 2, MCAST_NACK = 3 };
+
+/**
+ * Header of every multicast datagram, all fields in network byte order.
+ * A NACK is followed by `ranges` pairs of (first seq, count) uint32_t.
+ */
+struct mcast_header {
+  uint32_t magic;
+  uint8_t type;
+  uint8_t ranges;   // NACK: number of ranges that follow.
+  uint16_t len;     // DATA: payload length.
+  uint32_t session; // Picked at random for each transfer.
+  uint32_t seq;     // DATA: index of the packet in the file.
+  uint32_t total;   // Number of DATA packets in the file.
+  uint32_t size;    // Size of the file in bytes.
+  uint32_t checksum;
+};
+
+/**
+ * Header of every FEC datagram, all fields in network byte order. The
+ * symbol (FEC_SYMBOL_SIZE bytes, the last data symbol zero-padded) follows.
+ */
+struct fec_header {
+  uint32_t magic;
+  uint32_t session; // Picked at random for each transfer.
+  uint32_t size;    // Size of the file in bytes.
+  uint32_t checksum;
+  uint32_t block;       // Index of the block the symbol belongs to.
+  uint8_t esi;          // < k: data symbol esi, >= k: repair symbol esi - k.
+  uint8_t k;            // Data symbols in this block (fewer in the last one).
+  uint8_t block_k;      // Data symbols in a full block.
+  uint8_t m;            // Repair symbols sent for this block.
+  uint16_t symbol_size; // Bytes per symbol.
+  uint16_t reserved;
+};
+
+static volatile sig_atomic_t reload_catalog = 0;
+static pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stdin_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct transfer_stats transfer_table[MAX_TRANSFERS];
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "request", "size", "first-half", "key",
+    "second-half", "fin", "operator", "end"};
 
 // **FUNCTION HEADERS**:
 
@@ -25,13 +216,15 @@
 int send_fin(int client_sock, char *buffer);
 
 /**
- * Sends the file size to the client.
+ * Sends the file size and checksum to the client.
  * @param client_sock The client socket descriptor.
  * @param buffer The buffer to use for sending.
  * @param size The size of the file.
+ * @param checksum The FNV-1a checksum of the file.
  * @return 0 on success, -1 on error.
  */
-int send_file_size(int client_sock, char *buffer, int size);
+int send_file_size(int client_sock, char *buffer, int size,
+                   unsigned int checksum);
 
 /**
  * Asks the client for a key and verifies it.
@@ -44,15 +237,18 @@ int get_key(int client_sock, char *client_key, char *server_key);
 
 /**
  * Sends the file content to the client.
- * @param fp The file pointer.
+ * @param fd The file descriptor, read with pread() at offset counter.
  * @param client_sock The client socket descriptor.
  * @param size The total size of the file.
  * @param counter The current number of bytes sent.
  * @param buffer The buffer to use for sending.
+ * @param flow The client's flow, every chunk waits for the scheduler.
+ * @param stats The transfer's statistics, or NULL.
  * @return The updated counter (bytes sent) on success, -1 on error.
  */
-int send_file(FILE *fp, int client_sock, int size, int counter,
-              char buffer[BUFFER_SIZE]);
+int send_file(int fd, int client_sock, int size, int counter,
+              char buffer[BUFFER_SIZE], struct flow *flow,
+              struct transfer_stats *stats);
 
 /**
  * Sends an AGAIN message to the client.
@@ -71,11 +267,224 @@ int send_again(int client_sock, char *buffer);
 int send_end(int client_sock, char *buffer);
 
 /**
- * Gets the size of the file.
- * @param fp The file pointer.
- * @return The size of the file in bytes.
+ * Thread entry point, serves one client then releases what it held.
+ * @param arg The struct client, freed before returning.
+ * @return NULL.
+ */
+void *serve_client(void *arg);
+
+/**
+ * Runs the whole transfer dialogue with one client.
+ * @param client The client.
+ * @return 0 on success, -1 on error.
+ */
+int transfer_file(struct client *client);
+
+/**
+ * Receives the name of the file the client wants.
+ * @param client_sock The client socket descriptor.
+ * @param request The buffer to store the request in (MAX_NAME_LEN bytes).
+ * @return 0 on success, -1 on error.
+ */
+int recv_request(int client_sock, char *request);
+
+/**
+ * Tells the client the requested file is not in the catalog.
+ * @param client_sock The client socket descriptor.
+ * @return 0 on success, -1 on error.
+ */
+int send_no_file(int client_sock);
+
+/**
+ * Scans a directory tree and fills the catalog with every regular file in it.
+ * Files unchanged since the previous catalog (same size and mtime) reuse its
+ * checksum instead of being read again.
+ * @param catalog The catalog to fill, must be zeroed.
+ * @param root The directory to scan.
+ * @param previous The catalog being replaced, or NULL.
+ * @return The number of files indexed, or -1 on error.
+ */
+int catalog_build(struct catalog *catalog, const char *root,
+                  const struct catalog *previous);
+
+/**
+ * Looks a request up in the catalog.
+ * @param catalog The catalog.
+ * @param request A relative path, or "#<id>" to request a file by ID.
+ * @return The matching entry, or NULL if there is none.
+ */
+struct catalog_entry *catalog_lookup(const struct catalog *catalog,
+                                     const char *request);
+
+/**
+ * Closes every descriptor held by the catalog and frees its entries.
+ * @param catalog The catalog.
+ */
+void catalog_free(struct catalog *catalog);
+
+/**
+ * Takes a reference on the catalog for a transfer.
+ * @param catalog The catalog.
+ * @return The catalog.
+ */
+struct catalog *catalog_acquire(struct catalog *catalog);
+
+/**
+ * Drops a reference on the catalog, freeing it with the last one.
+ * @param catalog The catalog.
+ */
+void catalog_release(struct catalog *catalog);
+
+/**
+ * Prints the ID, size, mtime, checksum and name of every catalog entry.
+ * @param catalog The catalog.
+ */
+void catalog_print(const struct catalog *catalog);
+
+/**
+ * Computes the FNV-1a hash of a string.
+ * @param name The string.
+ * @return The hash.
+ */
+unsigned int hash_name(const char *name);
+
+/**
+ * Computes the FNV-1a checksum of a file's content.
+ * @param fd The file descriptor.
+ * @param size The size of the file.
+ * @param checksum Where to store the result.
+ * @return 0 on success, -1 on error.
+ */
+int checksum_file(int fd, int size, unsigned int *checksum);
+
+/**
+ * Initializes the scheduler.
+ * @param scheduler The scheduler.
+ * @param total_rate Cap on the server's egress in bytes per second, 0 for none.
+ * @param flow_rate Cap on each client in bytes per second, 0 for none.
+ */
+void scheduler_init(struct scheduler *scheduler, long long total_rate,
+                    long long flow_rate);
+
+/**
+ * Adds a flow to the DRR ring and, where the kernel supports it, asks it to
+ * pace the client's socket at the per-client rate.
+ * @param scheduler The scheduler.
+ * @param flow The flow to add.
+ * @param sock The client socket descriptor.
+ */
+void scheduler_join(struct scheduler *scheduler, struct flow *flow, int sock);
+
+/**
+ * Removes a flow from the DRR ring.
+ * @param scheduler The scheduler.
+ * @param flow The flow to remove.
+ */
+void scheduler_leave(struct scheduler *scheduler, struct flow *flow);
+
+/**
+ * Blocks until the flow may send a chunk: its own bucket holds enough
+ * tokens, it is the flow's DRR turn and the global bucket allows it.
+ * @param flow The flow.
+ * @param bytes The size of the chunk.
+ */
+void scheduler_acquire(struct flow *flow, int bytes);
+
+/**
+ * Multicasts one file to every receiver in the group, at a rate set by a
+ * token bucket, and multicasts a repair for every packet a receiver NACKs.
+ * Returns once no NACK has been heard for MCAST_LINGER_MS after the end.
+ * @param entry The file to send.
+ * @param group The multicast group address.
+ * @param iface The address of the interface to send on, or NULL for the
+ * default route.
+ * @param rate The sending rate in bytes per second.
+ * @return 0 on success, -1 on error.
+ */
+int multicast_file(const struct catalog_entry *entry, const char *group,
+                   const char *iface, long long rate);
+
+/**
+ * Sends one file over UDP with forward error correction and no feedback:
+ * every block of FEC_BLOCK_K symbols goes out with ceil(k * ratio) repair
+ * symbols, and any k of them rebuild the block.
+ * @param entry The file to send.
+ * @param destination The receiver (or gateway) as "ip[:port]".
+ * @param ratio Repair symbols per data symbol.
+ * @param rate The sending rate in bytes per second.
+ * @return 0 on success, -1 on error.
+ */
+int fec_send_file(const struct catalog_entry *entry, const char *destination,
+                  double ratio, long long rate);
+
+/**
+ * Claims a free slot of the stats table for a new transfer.
+ * @param address The client's address.
+ * @return The slot, or NULL if every slot is taken.
+ */
+struct transfer_stats *stats_claim(const struct sockaddr_in *address);
+
+/**
+ * Returns a slot to the stats table.
+ * @param stats The slot, or NULL.
+ */
+void stats_release(struct transfer_stats *stats);
+
+/**
+ * Records which file the transfer is sending.
+ * @param stats The transfer's statistics, or NULL.
+ * @param entry The file.
+ */
+void stats_set_file(struct transfer_stats *stats,
+                    const struct catalog_entry *entry);
+
+/**
+ * Moves the transfer to another phase, charging the time spent in the
+ * current one.
+ * @param stats The transfer's statistics, or NULL.
+ * @param phase The new phase.
+ */
+void stats_set_phase(struct transfer_stats *stats, enum transfer_phase phase);
+
+/**
+ * Opens the control socket, a Unix domain stream socket at path.
+ * @param path Where to create the socket; a stale one is removed first.
+ * @return The listening socket descriptor, or -1 on error.
+ */
+int control_open(const char *path);
+
+/**
+ * Thread entry point of the control socket. Samples every transfer's byte
+ * count each CONTROL_SAMPLE_MS and sends the report to every connection.
+ * @param arg The listening socket descriptor, cast to intptr_t.
+ * @return NULL.
+ */
+void *control_loop(void *arg);
+
+/**
+ * Formats one line per active transfer: peer, file, phase, bytes, progress,
+ * average and current throughput and the time spent in every phase.
+ * @param out Where to write the report.
+ * @param len The size of out.
+ * @param rates The current throughput of every slot in bytes per second.
+ * @param starts The start_ns the rates were measured for, per slot.
+ * @return The length of the report.
  */
-int get_file_size(FILE *fp);
+int control_report(char *out, int len, const long long *rates,
+                   const long long *starts);
+
+/**
+ * Parses a rate such as "500K" or "2M" (bytes per second).
+ * @param text The rate.
+ * @return The rate in bytes per second, or -1 if it is malformed.
+ */
+long long parse_rate(const char *text);
+
+/**
+ * Signal handler for SIGHUP, asks the main loop to rescan the catalog.
+ * @param signum The signal number.
+ */
+void handle_sighup(int signum);
 
 /**
  * Returns the minimum of two integers.
@@ -85,9 +494,118 @@ int get_file_size(FILE *fp);
  */
 int min(int a, int b);
 
-int main() {
+int main(int argc, char *argv[]) {
   signal(SIGPIPE, SIG_IGN);
 
+  const char *catalog_dir = CATALOG_DIR;
+  long long total_rate = 0;
+  long long flow_rate = 0;
+  const char *group = NULL;
+  const char *iface = NULL;
+  const char *fec_destination = NULL;
+  double fec_ratio = FEC_DEFAULT_RATIO;
+  const char *control_path = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:r:R:m:i:F:p:c:")) != -1) {
+    switch (opt) {
+    case 'c':
+      control_path = optarg;
+      break;
+    case 'F':
+      fec_destination = optarg;
+      break;
+    case 'p':
+      fec_ratio = atof(optarg);
+      if (fec_ratio < 0) {
+        flow_rate = -1;
+      }
+      break;
+    case 'd':
+      catalog_dir = optarg;
+      break;
+    case 'm':
+      group = optarg;
+      break;
+    case 'i':
+      iface = optarg;
+      break;
+    case 'r':
+      flow_rate = parse_rate(optarg);
+      break;
+    case 'R':
+      total_rate = parse_rate(optarg);
+      break;
+    default:
+      flow_rate = -1;
+      break;
+    }
+
+    if (flow_rate < 0 || total_rate < 0) {
+      break;
+    }
+  }
+
+  if (flow_rate < 0 || total_rate < 0 || argc - optind > 1 ||
+      (group == NULL && fec_destination == NULL && optind < argc)) {
+    printf("usage: %s [-d catalog_dir] [-r per_client_rate] "
+           "[-R total_rate] [-c control_socket]\n"
+           "       %s [-d catalog_dir] [-R rate] -m group [-i interface_ip] "
+           "[file_name | #id]\n"
+           "       %s [-d catalog_dir] [-R rate] -F ip[:port] "
+           "[-p repair_ratio] [file_name | #id]\n"
+           "Rates are in bytes per second, with an optional K, M or G "
+           "suffix.\n",
+           argv[0], argv[0], argv[0]);
+    return -1;
+  }
+
+  // SIGHUP must interrupt accept() so the catalog is rescanned right away,
+  // hence sigaction() without SA_RESTART.
+  struct sigaction hup_action;
+  memset(&hup_action, 0, sizeof(hup_action));
+  hup_action.sa_handler = handle_sighup;
+  sigaction(SIGHUP, &hup_action, NULL);
+
+  // Threads inherit the mask they are created with: keeping SIGHUP blocked
+  // in them makes sure it lands on the main thread's accept().
+  sigset_t hup_set;
+  sigemptyset(&hup_set);
+  sigaddset(&hup_set, SIGHUP);
+
+  struct catalog *catalog = calloc(1, sizeof(struct catalog));
+  if (catalog == NULL) {
+    printf("Error : Catalog allocation failed.\n");
+    return -1;
+  }
+
+  if (catalog_build(catalog, catalog_dir, NULL) == -1) {
+    free(catalog);
+    return -1;
+  }
+  catalog->refs = 1;
+
+  printf("Catalog of %s:\n", catalog_dir);
+  catalog_print(catalog);
+
+  if (group != NULL || fec_destination != NULL) {
+    const char *request = optind < argc ? argv[optind] : "send.txt";
+    struct catalog_entry *entry = catalog_lookup(catalog, request);
+    long long rate = total_rate > 0 ? total_rate : MCAST_DEFAULT_RATE;
+    int result = -1;
+
+    if (entry == NULL) {
+      printf("Error : %s is not in the catalog.\n", request);
+    } else if (group != NULL) {
+      result = multicast_file(entry, group, iface, rate);
+    } else {
+      result = fec_send_file(entry, fec_destination, fec_ratio, rate);
+    }
+
+    catalog_release(catalog);
+    return result;
+  }
+
   int temp = 0;
   int listen_sock = -1;
   listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -97,6 +615,34 @@ int main() {
     return 0;
   }
 
+  struct scheduler scheduler;
+  scheduler_init(&scheduler, total_rate, flow_rate);
+
+  if (control_path != NULL) {
+    int control_sock = control_open(control_path);
+    pthread_t control_thread;
+
+    if (control_sock == -1) {
+      close(listen_sock);
+      return -1;
+    }
+
+    pthread_sigmask(SIG_BLOCK, &hup_set, NULL);
+    int created = pthread_create(&control_thread, NULL, control_loop,
+                                 (void *)(intptr_t)control_sock);
+    pthread_sigmask(SIG_UNBLOCK, &hup_set, NULL);
+
+    if (created != 0) {
+      printf("Error : Control thread creation failed.\n");
+      close(control_sock);
+      close(listen_sock);
+      return -1;
+    }
+    pthread_detach(control_thread);
+
+    printf("Control socket listening on %s.\n", control_path);
+  }
+
   int reuse = 1;
   temp = setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
   if (temp < 0) {
@@ -137,6 +683,27 @@ int main() {
     int client_sock = accept(listen_sock, (struct sockaddr *)&client_address,
                              &client_addr_len);
 
+    if (client_sock == -1 && errno == EINTR) {
+      if (reload_catalog) {
+        reload_catalog = 0;
+        struct catalog *fresh = calloc(1, sizeof(struct catalog));
+
+        if (fresh == NULL || catalog_build(fresh, catalog_dir, catalog) == -1) {
+          printf("Error : Catalog rescan failed, keeping the old one.\n");
+          free(fresh);
+        } else {
+          // Transfers still running keep the old catalog alive until they
+          // release it.
+          fresh->refs = 1;
+          catalog_release(catalog);
+          catalog = fresh;
+          printf("Catalog rescanned:\n");
+          catalog_print(catalog);
+        }
+      }
+      continue;
+    }
+
     if (client_sock == -1) {
       printf("Error: Accepting a client failed.");
       close(listen_sock);
@@ -145,173 +712,228 @@ int main() {
 
     printf("Connected to client!\n");
 
-    FILE *fp = fopen("send.txt", "r");
-    if (fp == NULL) {
-      printf("File open error\n");
+    struct client *client = calloc(1, sizeof(struct client));
+    if (client == NULL) {
+      printf("Error : Client allocation failed.\n");
       close(client_sock);
-      close(listen_sock);
-      return -1;
+      continue;
     }
 
-    char buffer[BUFFER_SIZE] = {0};
-    int size = get_file_size(fp);
-    int counter = 0;
+    client->sock = client_sock;
+    client->address = client_address;
+    client->catalog = catalog_acquire(catalog);
+    client->scheduler = &scheduler;
+
+    pthread_t thread;
+    pthread_sigmask(SIG_BLOCK, &hup_set, NULL);
+    int created = pthread_create(&thread, NULL, serve_client, client);
+    pthread_sigmask(SIG_UNBLOCK, &hup_set, NULL);
 
-    char client_key[10] = {0};
-    char server_key[10] = {0};
-    int key = 1714 ^ 6521;
-    sprintf(server_key, "%d", key);
+    if (created != 0) {
+      printf("Error : Client thread creation failed.\n");
+      catalog_release(client->catalog);
+      close(client_sock);
+      free(client);
+      continue;
+    }
+    pthread_detach(thread);
+  }
 
-    char message[1] = {0};
+  catalog_release(catalog);
+  close(listen_sock);
+  printf("\n");
 
-    // ######################### Sending the size of the file:
-    // ###############################
+  return 0;
+}
 
-    printf("Sending size of the file...\n");
+// **THE FUNCTIONS** :
 
-    temp = send_file_size(client_sock, buffer, size);
-    if (temp == -1) {
-      close(client_sock);
-      close(listen_sock);
-      return -1;
-    }
+void *serve_client(void *arg) {
+  struct client *client = arg;
 
-    printf("Size of the file sent successfully!\n");
+  client->stats = stats_claim(&client->address);
+  scheduler_join(client->scheduler, &client->flow, client->sock);
+  transfer_file(client);
+  scheduler_leave(client->scheduler, &client->flow);
+  stats_release(client->stats);
 
-    while (1) {
-      // ############### Setting the congestion control algorithm to reno:
-      // #####################
+  close(client->sock);
+  catalog_release(client->catalog);
+  free(client);
 
-      if (setsockopt(listen_sock, IPPROTO_TCP, TCP_CONGESTION, "reno", 6) < 0) {
-        printf("Error : Failed to set congestion control algorithm to reno.\n");
-        close(client_sock);
-        close(listen_sock);
-        return -1;
-      }
+  return NULL;
+}
 
-      printf("CC algorithm set to reno.\n");
+int transfer_file(struct client *client) {
+  int client_sock = client->sock;
+  struct transfer_stats *stats = client->stats;
+  int temp = 0;
 
-      // ####################### Sending the 1st part of the file:
-      // #############################
+  char buffer[BUFFER_SIZE] = {0};
+  char request[MAX_NAME_LEN] = {0};
 
-      printf("Sending first part of the file...\n");
+  if (recv_request(client_sock, request) == -1) {
+    return -1;
+  }
 
-      counter = send_file(fp, client_sock, size / 2, counter, buffer);
+  struct catalog_entry *entry = catalog_lookup(client->catalog, request);
+  if (entry == NULL) {
+    printf("Client requested %s, which is not in the catalog.\n", request);
+    send_no_file(client_sock);
+    return -1;
+  }
 
-      if (counter == -1) {
-        close(client_sock);
-        close(listen_sock);
-        return -1;
-      }
+  printf("Client requested %s (#%d).\n", entry->name, entry->id);
+  stats_set_file(stats, entry);
 
-      printf("First part of the file sent successfully!\n");
+  int size = entry->size;
+  int counter = 0;
 
-      // ################ Asking the client for the key and checking if it
-      // matches: #############
+  char client_key[10] = {0};
+  char server_key[10] = {0};
+  int key = 1714 ^ 6521;
+  sprintf(server_key, "%d", key);
 
-      printf("Asking client for key...\n");
+  char message[16] = {0};
 
-      temp = get_key(client_sock, client_key, server_key);
+  // ######################### Sending the size of the file:
+  // ###############################
 
-      if (temp == -1) {
-        close(client_sock);
-        close(listen_sock);
-        return -1;
-      }
+  printf("Sending size of the file...\n");
+  stats_set_phase(stats, PHASE_SIZE);
 
-      printf("Keys match!\n");
+  temp = send_file_size(client_sock, buffer, size, entry->checksum);
+  if (temp == -1) {
+    return -1;
+  }
 
-      // ################ Setting the congestion control algorithm to cubic:
-      // ####################
+  printf("Size of the file sent successfully!\n");
 
-      if (setsockopt(listen_sock, IPPROTO_TCP, TCP_CONGESTION, "cubic", 6) <
-          0) {
-        printf("Error : Failed to set congestion control algorithm to reno.\n");
-        close(client_sock);
-        close(listen_sock);
-        return -1;
-      }
+  while (1) {
+    // ############### Setting the congestion control algorithm to reno:
+    // #####################
 
-      printf("CC algorithm set to cubic.\n");
+    if (setsockopt(client_sock, IPPROTO_TCP, TCP_CONGESTION, "reno", 6) < 0) {
+      printf("Error : Failed to set congestion control algorithm to reno.\n");
+      return -1;
+    }
 
-      // ######################## Sending the 2nd part of the file:
-      // #############################
+    printf("CC algorithm set to reno.\n");
 
-      printf("Sending second part of the file...\n");
+    // ####################### Sending the 1st part of the file:
+    // #############################
 
-      counter = send_file(fp, client_sock, size, counter, buffer);
+    printf("Sending first part of the file...\n");
+    stats_set_phase(stats, PHASE_FIRST_HALF);
 
-      if (counter != size) {
-        printf("Error: File size didn't match, sending failed.\n");
-        close(client_sock);
-        close(listen_sock);
-        return -1;
-      }
+    counter = send_file(entry->fd, client_sock, size / 2, counter, buffer,
+                        &client->flow, stats);
 
-      printf("Second part of the file sent successfully!\n");
+    if (counter == -1) {
+      return -1;
+    }
 
-      // ############## Sending the client that the server is done sending the
-      // file: ##############
+    printf("First part of the file sent successfully!\n");
 
-      printf("Letting the client know we finished sending the file...\n");
+    // ################ Asking the client for the key and checking if it
+    // matches: #############
 
-      temp = send_fin(client_sock, buffer);
+    printf("Asking client for key...\n");
+    stats_set_phase(stats, PHASE_KEY);
 
-      if (temp == -1) {
-        close(client_sock);
-        close(listen_sock);
-        return -1;
-      }
+    temp = get_key(client_sock, client_key, server_key);
+
+    if (temp == -1) {
+      return -1;
+    }
 
-      printf("Client acknowledged!\n");
+    printf("Keys match!\n");
 
-      // ################ Asking sender's permission to send the file again:
-      // ######################
+    // ################ Setting the congestion control algorithm to cubic:
+    // ####################
 
-      printf("Do you want to send the file again? If so - enter 'y'. If not, "
-             "enter anything else. ");
+    if (setsockopt(client_sock, IPPROTO_TCP, TCP_CONGESTION, "cubic", 6) <
+        0) {
+      printf("Error : Failed to set congestion control algorithm to reno.\n");
+      return -1;
+    }
 
-      scanf("%s", message);
+    printf("CC algorithm set to cubic.\n");
 
-      if (strcmp(message, "y") == 0) {
-        counter = 0;
-        fseek(fp, 0, SEEK_SET);
+    // ######################## Sending the 2nd part of the file:
+    // #############################
 
-        temp = send_again(client_sock, buffer);
+    printf("Sending second part of the file...\n");
+    stats_set_phase(stats, PHASE_SECOND_HALF);
 
-        if (temp == -1) {
-          close(client_sock);
-          close(listen_sock);
-          return -1;
-        }
-      } else {
-        break;
-      }
+    counter = send_file(entry->fd, client_sock, size, counter, buffer,
+                        &client->flow, stats);
+
+    if (counter != size) {
+      printf("Error: File size didn't match, sending failed.\n");
+      return -1;
     }
 
-    printf("Asking the client to close connection...\n");
+    printf("Second part of the file sent successfully!\n");
+
+    // ############## Sending the client that the server is done sending the
+    // file: ##############
 
-    temp = send_end(client_sock, buffer);
+    printf("Letting the client know we finished sending the file...\n");
+    stats_set_phase(stats, PHASE_FIN);
+
+    temp = send_fin(client_sock, buffer);
 
     if (temp == -1) {
-      close(client_sock);
-      close(listen_sock);
       return -1;
     }
 
-    printf("Client closed the connection!\n");
+    printf("Client acknowledged!\n");
+
+    // ################ Asking sender's permission to send the file again:
+    // ######################
+
+    char peer[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client->address.sin_addr, peer, sizeof(peer));
+
+    // Several transfers may finish at once, so they take turns at stdin.
+    stats_set_phase(stats, PHASE_OPERATOR);
+    pthread_mutex_lock(&stdin_lock);
+    printf("Do you want to send %s to %s again? If so - enter 'y'. If not, "
+           "enter anything else. ",
+           entry->name, peer);
+
+    if (scanf("%15s", message) != 1) {
+      message[0] = '\0';
+    }
+    pthread_mutex_unlock(&stdin_lock);
+
+    if (strcmp(message, "y") == 0) {
+      counter = 0;
+
+      temp = send_again(client_sock, buffer);
 
-    fclose(fp);
-    close(client_sock);
+      if (temp == -1) {
+        return -1;
+      }
+    } else {
+      break;
+    }
   }
 
-  close(listen_sock);
-  printf("\n");
+  printf("Asking the client to close connection...\n");
+  stats_set_phase(stats, PHASE_END);
+
+  temp = send_end(client_sock, buffer);
+
+  if (temp == -1) {
+    return -1;
+  }
 
+  printf("Client closed the connection!\n");
   return 0;
 }
 
-// **THE FUNCTIONS** :
 
 int send_fin(int client_sock, char *buffer) {
   int send_result = send(client_sock, "FIN", 4, 0);
@@ -345,8 +967,9 @@ int send_fin(int client_sock, char *buffer) {
   return 0;
 }
 
-int send_file_size(int client_sock, char *buffer, int size) {
-  sprintf(buffer, "%d", size);
+int send_file_size(int client_sock, char *buffer, int size,
+                   unsigned int checksum) {
+  sprintf(buffer, "%d %08x", size, checksum);
 
   int send_size = send(client_sock, buffer, strlen(buffer) + 1, 0);
 
@@ -356,7 +979,7 @@ int send_file_size(int client_sock, char *buffer, int size) {
   } else if (send_size == 0) {
     printf("Error : Client's socket is closed, couldn't send to it.\n");
     return -1;
-  } else if (send_size != strlen(buffer) + 1) {
+  } else if ((size_t)send_size != strlen(buffer) + 1) {
     printf("Error : Server sent a corrupted buffer.\n");
     return -1;
   }
@@ -377,6 +1000,7 @@ int send_file_size(int client_sock, char *buffer, int size) {
   }
 
   bzero(buffer, 4);
+  return 0;
 }
 
 int get_key(int client_sock, char *client_key, char *server_key) {
@@ -427,11 +1051,15 @@ int get_key(int client_sock, char *client_key, char *server_key) {
   return 0;
 }
 
-int send_file(FILE *fp, int client_sock, int size, int counter,
-              char buffer[BUFFER_SIZE]) {
+int send_file(int fd, int client_sock, int size, int counter,
+              char buffer[BUFFER_SIZE], struct flow *flow,
+              struct transfer_stats *stats) {
   int num_bytes = min(BUFFER_SIZE, size - counter);
 
-  while (counter < size && fread(buffer, num_bytes, 1, fp) != 0) {
+  while (counter < size &&
+         pread(fd, buffer, num_bytes, counter) == num_bytes) {
+    scheduler_acquire(flow, num_bytes);
+
     int send_result = send(client_sock, buffer, num_bytes, 0);
 
     if (send_result == -1) {
@@ -463,6 +1091,15 @@ int send_file(FILE *fp, int client_sock, int size, int counter,
     bzero(buffer, 4);
     counter += num_bytes;
 
+    // Only this thread writes the counters, so plain relaxed stores do.
+    if (stats != NULL) {
+      long long bytes = atomic_load_explicit(&stats->bytes,
+                                             memory_order_relaxed);
+      atomic_store_explicit(&stats->bytes, bytes + num_bytes,
+                            memory_order_relaxed);
+      atomic_store_explicit(&stats->offset, counter, memory_order_relaxed);
+    }
+
     num_bytes = min(BUFFER_SIZE, size - counter);
   }
 
@@ -559,15 +1196,6 @@ int send_again(int client_sock, char *buffer) {
   return 0;
 }
 
-int get_file_size(FILE *fp) {
-  int size;
-  fseek(fp, 0, SEEK_END);
-  size = ftell(fp);
-  fseek(fp, 0, SEEK_SET);
-
-  return size;
-}
-
 int min(int a, int b) {
   if (a < b) {
     return a;
@@ -575,3 +1203,1233 @@ int min(int a, int b) {
     return b;
   }
 }
+
+int recv_request(int client_sock, char *request) {
+  int recv_result = recv(client_sock, request, MAX_NAME_LEN - 1, 0);
+
+  if (recv_result < 0) {
+    printf("Error : Receiving failed.\n");
+    return -1;
+  } else if (recv_result == 0) {
+    printf("Error : Client's socket is closed, nothing to receive.\n");
+    return -1;
+  }
+
+  request[recv_result] = '\0';
+  return 0;
+}
+
+int send_no_file(int client_sock) {
+  int send_result = send(client_sock, "NOFILE", 7, 0);
+
+  if (send_result == -1) {
+    printf("Error : Sending failed.\n");
+    return -1;
+  } else if (send_result != 7) {
+    printf("Error : Client received a corrupted buffer.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Adds one file to the catalog, growing the ID index when needed.
+ * @param catalog The catalog.
+ * @param name The file's path relative to the catalog root.
+ * @param path The file's path as seen from the working directory.
+ * @param previous The catalog being replaced, or NULL.
+ * @return 0 on success or if the file was skipped, -1 on error.
+ */
+static int catalog_add(struct catalog *catalog, const char *name,
+                       const char *path, const struct catalog *previous) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    printf("Warning : Skipping %s, it can't be opened.\n", name);
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size > INT_MAX) {
+    close(fd);
+    return 0;
+  }
+
+  struct catalog_entry *entry = calloc(1, sizeof(struct catalog_entry));
+  if (entry == NULL) {
+    printf("Error : Catalog entry allocation failed.\n");
+    close(fd);
+    return -1;
+  }
+
+  snprintf(entry->name, sizeof(entry->name), "%s", name);
+  entry->size = (int)st.st_size;
+  entry->mtime = st.st_mtime;
+  entry->fd = fd;
+
+  struct catalog_entry *old =
+      previous != NULL ? catalog_lookup(previous, entry->name) : NULL;
+
+  if (old != NULL && old->size == entry->size && old->mtime == entry->mtime) {
+    entry->checksum = old->checksum;
+  } else if (checksum_file(fd, entry->size, &entry->checksum) == -1) {
+    printf("Warning : Skipping %s, it can't be read.\n", name);
+    close(fd);
+    free(entry);
+    return 0;
+  }
+
+  if (catalog->count == catalog->capacity) {
+    int capacity = catalog->capacity == 0 ? 64 : catalog->capacity * 2;
+    struct catalog_entry **entries =
+        realloc(catalog->entries, capacity * sizeof(struct catalog_entry *));
+
+    if (entries == NULL) {
+      printf("Error : Catalog allocation failed.\n");
+      close(fd);
+      free(entry);
+      return -1;
+    }
+
+    catalog->entries = entries;
+    catalog->capacity = capacity;
+  }
+
+  entry->id = catalog->count;
+  catalog->entries[catalog->count++] = entry;
+
+  unsigned int bucket = hash_name(entry->name) & (CATALOG_BUCKETS - 1);
+  entry->next = catalog->buckets[bucket];
+  catalog->buckets[bucket] = entry;
+
+  return 0;
+}
+
+/**
+ * Recursively adds the regular files under a directory to the catalog.
+ * @param catalog The catalog.
+ * @param root The catalog root directory.
+ * @param relative The directory to scan, relative to root ("" for root).
+ * @param previous The catalog being replaced, or NULL.
+ * @param depth How deep below root the directory is.
+ * @return 0 on success, -1 on error.
+ */
+static int catalog_scan(struct catalog *catalog, const char *root,
+                        const char *relative, const struct catalog *previous,
+                        int depth) {
+  char dir_path[2 * MAX_NAME_LEN];
+  snprintf(dir_path, sizeof(dir_path), "%s/%s", root, relative);
+
+  DIR *dir = opendir(dir_path);
+  if (dir == NULL) {
+    printf("Error : Can't open directory %s.\n", dir_path);
+    return depth == 0 ? -1 : 0;
+  }
+
+  struct dirent *dirent;
+  while ((dirent = readdir(dir)) != NULL) {
+    if (dirent->d_name[0] == '.') {
+      continue;
+    }
+
+    char name[MAX_NAME_LEN];
+    int name_len = snprintf(name, sizeof(name), "%s%s%s", relative,
+                            relative[0] == '\0' ? "" : "/", dirent->d_name);
+    if (name_len >= MAX_NAME_LEN) {
+      printf("Warning : Skipping %s%s, the name is too long.\n", relative,
+             dirent->d_name);
+      continue;
+    }
+
+    char path[2 * MAX_NAME_LEN];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+
+    struct stat st;
+    if (stat(path, &st) == -1) {
+      continue;
+    }
+
+    int result = 0;
+    if (S_ISDIR(st.st_mode) && depth < CATALOG_MAX_DEPTH) {
+      result = catalog_scan(catalog, root, name, previous, depth + 1);
+    } else if (S_ISREG(st.st_mode)) {
+      result = catalog_add(catalog, name, path, previous);
+    }
+
+    if (result == -1) {
+      closedir(dir);
+      return -1;
+    }
+  }
+
+  closedir(dir);
+  return 0;
+}
+
+int catalog_build(struct catalog *catalog, const char *root,
+                  const struct catalog *previous) {
+  if (catalog_scan(catalog, root, "", previous, 0) == -1) {
+    catalog_free(catalog);
+    return -1;
+  }
+
+  return catalog->count;
+}
+
+struct catalog_entry *catalog_lookup(const struct catalog *catalog,
+                                     const char *request) {
+  if (request[0] == '#') {
+    char *end = NULL;
+    long id = strtol(request + 1, &end, 10);
+
+    if (end == request + 1 || *end != '\0' || id < 0 ||
+        id >= catalog->count) {
+      return NULL;
+    }
+    return catalog->entries[id];
+  }
+
+  unsigned int bucket = hash_name(request) & (CATALOG_BUCKETS - 1);
+  struct catalog_entry *entry = catalog->buckets[bucket];
+
+  while (entry != NULL && strcmp(entry->name, request) != 0) {
+    entry = entry->next;
+  }
+
+  return entry;
+}
+
+void catalog_free(struct catalog *catalog) {
+  for (int i = 0; i < catalog->count; i++) {
+    close(catalog->entries[i]->fd);
+    free(catalog->entries[i]);
+  }
+
+  free(catalog->entries);
+  memset(catalog, 0, sizeof(struct catalog));
+}
+
+struct catalog *catalog_acquire(struct catalog *catalog) {
+  pthread_mutex_lock(&catalog_lock);
+  catalog->refs++;
+  pthread_mutex_unlock(&catalog_lock);
+
+  return catalog;
+}
+
+void catalog_release(struct catalog *catalog) {
+  pthread_mutex_lock(&catalog_lock);
+  int refs = --catalog->refs;
+  pthread_mutex_unlock(&catalog_lock);
+
+  if (refs == 0) {
+    catalog_free(catalog);
+    free(catalog);
+  }
+}
+
+void catalog_print(const struct catalog *catalog) {
+  for (int i = 0; i < catalog->count; i++) {
+    struct catalog_entry *entry = catalog->entries[i];
+    char mtime[32];
+
+    strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M:%S",
+             localtime(&entry->mtime));
+    printf("  #%-4d %10d bytes  %s  %08x  %s\n", entry->id, entry->size, mtime,
+           entry->checksum, entry->name);
+  }
+}
+
+unsigned int hash_name(const char *name) {
+  unsigned int hash = 2166136261u;
+
+  while (*name != '\0') {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+int checksum_file(int fd, int size, unsigned int *checksum) {
+  unsigned char chunk[64 * BUFFER_SIZE];
+  unsigned int hash = 2166136261u;
+  int offset = 0;
+
+  while (offset < size) {
+    int bytes = (int)pread(fd, chunk, min((int)sizeof(chunk), size - offset),
+                           offset);
+    if (bytes <= 0) {
+      return -1;
+    }
+
+    for (int i = 0; i < bytes; i++) {
+      hash ^= chunk[i];
+      hash *= 16777619u;
+    }
+    offset += bytes;
+  }
+
+  *checksum = hash;
+  return 0;
+}
+
+/**
+ * Reads CLOCK_MONOTONIC.
+ * @return The current time in nanoseconds.
+ */
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Sets up a bucket that starts full.
+ * @param bucket The bucket.
+ * @param rate The rate in bytes per second, 0 for unlimited.
+ */
+static void bucket_init(struct token_bucket *bucket, long long rate) {
+  bucket->rate = rate;
+  bucket->burst = rate * BURST_MSEC / 1000;
+  if (bucket->burst < 2 * BUFFER_SIZE) {
+    bucket->burst = 2 * BUFFER_SIZE;
+  }
+  bucket->tokens = bucket->burst;
+  bucket->last_ns = now_ns();
+}
+
+/**
+ * Adds the tokens earned since the last refill.
+ * @param bucket The bucket.
+ * @param now The current time in nanoseconds.
+ */
+static void bucket_refill(struct token_bucket *bucket, long long now) {
+  if (bucket->rate == 0) {
+    return;
+  }
+
+  // Idle long enough to fill the bucket: skip the multiplication, which
+  // would overflow after a long enough idle at a high rate.
+  long long missing = bucket->burst - bucket->tokens;
+  long long full_ns = missing / bucket->rate * 1000000000LL +
+                      missing % bucket->rate * 1000000000LL / bucket->rate;
+  if (now - bucket->last_ns >= full_ns) {
+    bucket->tokens = bucket->burst;
+    bucket->last_ns = now;
+    return;
+  }
+
+  long long earned = (now - bucket->last_ns) * bucket->rate / 1000000000LL;
+  if (earned > 0) {
+    bucket->tokens = bucket->tokens + earned > bucket->burst
+                         ? bucket->burst
+                         : bucket->tokens + earned;
+    // Only advance by the time actually converted into tokens, so the
+    // remainder isn't lost at low rates.
+    bucket->last_ns += earned * 1000000000LL / bucket->rate;
+  }
+}
+
+/**
+ * Computes how long until the bucket holds enough tokens.
+ * @param bucket The bucket, already refilled.
+ * @param bytes The number of tokens needed.
+ * @return The wait in nanoseconds, 0 if the tokens are there now.
+ */
+static long long bucket_wait_ns(const struct token_bucket *bucket, int bytes) {
+  if (bucket->rate == 0 || bucket->tokens >= bytes) {
+    return 0;
+  }
+
+  return (bytes - bucket->tokens) * 1000000000LL / bucket->rate + 1;
+}
+
+void scheduler_init(struct scheduler *scheduler, long long total_rate,
+                    long long flow_rate) {
+  pthread_mutex_init(&scheduler->lock, NULL);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&scheduler->cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  bucket_init(&scheduler->total, total_rate);
+  scheduler->flow_rate = flow_rate;
+  scheduler->current = NULL;
+}
+
+void scheduler_join(struct scheduler *scheduler, struct flow *flow, int sock) {
+  flow->scheduler = scheduler;
+  flow->deficit = 0;
+  flow->waiting = 0;
+  bucket_init(&flow->bucket, scheduler->flow_rate);
+
+#ifdef SO_MAX_PACING_RATE
+  // Lets the kernel (fq qdisc or TCP internal pacing) spread the packets
+  // instead of sending each chunk the bucket releases as a burst.
+  if (scheduler->flow_rate > 0) {
+    unsigned int pacing_rate = scheduler->flow_rate > UINT_MAX
+                                   ? UINT_MAX
+                                   : (unsigned int)scheduler->flow_rate;
+    setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing_rate,
+               sizeof(pacing_rate));
+  }
+#else
+  (void)sock;
+#endif
+
+  pthread_mutex_lock(&scheduler->lock);
+  if (scheduler->current == NULL) {
+    flow->prev = flow;
+    flow->next = flow;
+    scheduler->current = flow;
+  } else {
+    // Join just behind the current flow, i.e. at the end of the round.
+    flow->next = scheduler->current;
+    flow->prev = scheduler->current->prev;
+    flow->prev->next = flow;
+    scheduler->current->prev = flow;
+  }
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+void scheduler_leave(struct scheduler *scheduler, struct flow *flow) {
+  pthread_mutex_lock(&scheduler->lock);
+  if (flow->next == flow) {
+    scheduler->current = NULL;
+  } else {
+    flow->prev->next = flow->next;
+    flow->next->prev = flow->prev;
+    if (scheduler->current == flow) {
+      scheduler->current = flow->next;
+    }
+  }
+  pthread_cond_broadcast(&scheduler->cond);
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+/**
+ * Finds the flow allowed to send next. A flow is backlogged when it wants to
+ * send and its own bucket allows it; the others lose their deficit, as an
+ * empty queue does in DRR. Called with the scheduler lock held.
+ * @param scheduler The scheduler.
+ * @return The flow whose turn it is, or NULL if no flow is backlogged.
+ */
+static struct flow *scheduler_pick(struct scheduler *scheduler) {
+  struct flow *flow = scheduler->current;
+
+  if (flow == NULL) {
+    return NULL;
+  }
+
+  // DRR_QUANTUM covers a whole chunk, so every backlogged flow can send
+  // after one top-up and a single lap of the ring is enough.
+  do {
+    if (flow->waiting > 0 &&
+        bucket_wait_ns(&flow->bucket, flow->waiting) == 0) {
+      if (flow->deficit < flow->waiting) {
+        flow->deficit += DRR_QUANTUM;
+      }
+      scheduler->current = flow;
+      return flow;
+    }
+
+    flow->deficit = 0;
+    flow = flow->next;
+  } while (flow != scheduler->current);
+
+  return NULL;
+}
+
+void scheduler_acquire(struct flow *flow, int bytes) {
+  struct scheduler *scheduler = flow->scheduler;
+
+  if (scheduler->total.rate == 0 && scheduler->flow_rate == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&scheduler->lock);
+  flow->waiting = bytes;
+
+  while (1) {
+    long long now = now_ns();
+    struct flow *turn;
+    long long wait_ns;
+
+    bucket_refill(&scheduler->total, now);
+    for (struct flow *other = flow->next; other != flow; other = other->next) {
+      bucket_refill(&other->bucket, now);
+    }
+    bucket_refill(&flow->bucket, now);
+
+    turn = scheduler_pick(scheduler);
+
+    if (turn == flow) {
+      wait_ns = bucket_wait_ns(&scheduler->total, bytes);
+      if (wait_ns == 0) {
+        break;
+      }
+    } else {
+      // Either another flow's turn, or our own bucket is empty: sleep until
+      // it refills, or until another flow sends and wakes us up.
+      wait_ns = bucket_wait_ns(&flow->bucket, bytes);
+      if (wait_ns == 0 || turn == NULL) {
+        wait_ns = bucket_wait_ns(&scheduler->total, bytes);
+      }
+      if (wait_ns == 0) {
+        wait_ns = 1000000;
+      }
+    }
+
+    long long deadline = now + wait_ns;
+    struct timespec until = {deadline / 1000000000LL, deadline % 1000000000LL};
+    pthread_cond_timedwait(&scheduler->cond, &scheduler->lock, &until);
+  }
+
+  if (scheduler->total.rate > 0) {
+    scheduler->total.tokens -= bytes;
+  }
+  if (flow->bucket.rate > 0) {
+    flow->bucket.tokens -= bytes;
+  }
+
+  flow->deficit -= bytes;
+  flow->waiting = 0;
+  if (flow->deficit <= 0) {
+    flow->deficit = 0;
+    scheduler->current = flow->next;
+  }
+
+  pthread_cond_broadcast(&scheduler->cond);
+  pthread_mutex_unlock(&scheduler->lock);
+}
+
+struct transfer_stats *stats_claim(const struct sockaddr_in *address) {
+  for (int i = 0; i < MAX_TRANSFERS; i++) {
+    struct transfer_stats *stats = &transfer_table[i];
+    int expected = 0;
+
+    if (!atomic_compare_exchange_strong(&stats->in_use, &expected, 1)) {
+      continue;
+    }
+
+    // A free slot's generation is odd (or 0 if never used), so readers skip
+    // it until the new transfer's details are in place.
+    unsigned int generation =
+        atomic_load_explicit(&stats->generation, memory_order_relaxed) | 1;
+    atomic_store_explicit(&stats->generation, generation,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &address->sin_addr, ip, sizeof(ip));
+    snprintf(stats->peer, sizeof(stats->peer), "%s:%d", ip,
+             ntohs(address->sin_port));
+    stats->file[0] = '\0';
+
+    long long now = now_ns();
+    atomic_store_explicit(&stats->start_ns, now, memory_order_relaxed);
+    atomic_store_explicit(&stats->size, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->offset, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->bytes, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->phase, PHASE_REQUEST, memory_order_relaxed);
+    atomic_store_explicit(&stats->phase_start_ns, now, memory_order_relaxed);
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      atomic_store_explicit(&stats->phase_ns[p], 0, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&stats->generation, generation + 1,
+                          memory_order_release);
+    return stats;
+  }
+
+  return NULL;
+}
+
+void stats_release(struct transfer_stats *stats) {
+  if (stats == NULL) {
+    return;
+  }
+
+  unsigned int generation =
+      atomic_load_explicit(&stats->generation, memory_order_relaxed);
+  atomic_store_explicit(&stats->generation, generation + 1,
+                        memory_order_release);
+  atomic_store_explicit(&stats->in_use, 0, memory_order_release);
+}
+
+void stats_set_file(struct transfer_stats *stats,
+                    const struct catalog_entry *entry) {
+  if (stats == NULL) {
+    return;
+  }
+
+  unsigned int generation =
+      atomic_load_explicit(&stats->generation, memory_order_relaxed);
+  atomic_store_explicit(&stats->generation, generation + 1,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  snprintf(stats->file, sizeof(stats->file), "%s", entry->name);
+  atomic_store_explicit(&stats->size, entry->size, memory_order_relaxed);
+
+  atomic_store_explicit(&stats->generation, generation + 2,
+                        memory_order_release);
+}
+
+void stats_set_phase(struct transfer_stats *stats, enum transfer_phase phase) {
+  if (stats == NULL) {
+    return;
+  }
+
+  long long now = now_ns();
+  int current = atomic_load_explicit(&stats->phase, memory_order_relaxed);
+  long long start =
+      atomic_load_explicit(&stats->phase_start_ns, memory_order_relaxed);
+  long long spent =
+      atomic_load_explicit(&stats->phase_ns[current], memory_order_relaxed);
+
+  atomic_store_explicit(&stats->phase_ns[current], spent + now - start,
+                        memory_order_relaxed);
+  atomic_store_explicit(&stats->phase_start_ns, now, memory_order_relaxed);
+  atomic_store_explicit(&stats->phase, phase, memory_order_relaxed);
+
+  // Every round starts again from the beginning of the file.
+  if (phase == PHASE_FIRST_HALF) {
+    atomic_store_explicit(&stats->offset, 0, memory_order_relaxed);
+  }
+}
+
+int control_open(const char *path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    printf("Error : Control socket path is too long.\n");
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  // Only a socket left behind by a previous run is removed, never a file.
+  struct stat info;
+  if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+    unlink(path);
+  }
+
+  int control_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (control_sock == -1) {
+    printf("Error : Control socket creation failed.\n");
+    return -1;
+  }
+
+  if (bind(control_sock, (struct sockaddr *)&address, sizeof(address)) ==
+      -1) {
+    printf("Error : Binding the control socket to %s failed.\n", path);
+    close(control_sock);
+    return -1;
+  }
+
+  if (listen(control_sock, 8) == -1) {
+    printf("Error : Listening on the control socket failed.\n");
+    close(control_sock);
+    return -1;
+  }
+
+  return control_sock;
+}
+
+void *control_loop(void *arg) {
+  int control_sock = (int)(intptr_t)arg;
+  static char report[MAX_TRANSFERS * 512];
+  static long long last_bytes[MAX_TRANSFERS];
+  static long long rates[MAX_TRANSFERS];
+  static long long starts[MAX_TRANSFERS];
+  long long last_sample = now_ns();
+
+  while (1) {
+    long long now = now_ns();
+    long long timeout =
+        CONTROL_SAMPLE_MS - (now - last_sample) / 1000000LL;
+    struct pollfd pfd = {control_sock, POLLIN, 0};
+
+    int ready = poll(&pfd, 1, timeout > 0 ? (int)timeout : 0);
+
+    now = now_ns();
+    if (now - last_sample >= CONTROL_SAMPLE_MS * 1000000LL) {
+      for (int i = 0; i < MAX_TRANSFERS; i++) {
+        struct transfer_stats *stats = &transfer_table[i];
+        long long start =
+            atomic_load_explicit(&stats->start_ns, memory_order_relaxed);
+        long long bytes =
+            atomic_load_explicit(&stats->bytes, memory_order_relaxed);
+
+        if (!atomic_load_explicit(&stats->in_use, memory_order_relaxed)) {
+          starts[i] = 0;
+          continue;
+        }
+
+        // A transfer seen for the first time has no previous sample; it
+        // gets its average until the next one.
+        if (start != starts[i]) {
+          starts[i] = start;
+          rates[i] = now > start ? (long long)(bytes * 1e9 / (now - start))
+                                 : 0;
+        } else {
+          rates[i] =
+              (long long)((bytes - last_bytes[i]) * 1e9 / (now - last_sample));
+        }
+        last_bytes[i] = bytes;
+      }
+      last_sample = now;
+    }
+
+    if (ready <= 0) {
+      continue;
+    }
+
+    int conn = accept(control_sock, NULL, NULL);
+    if (conn == -1) {
+      continue;
+    }
+
+    // A reader that doesn't drain the report must not stall the sampling.
+    struct timeval send_timeout = {1, 0};
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+               sizeof(send_timeout));
+
+    int len = control_report(report, sizeof(report), rates, starts);
+    send(conn, report, len, MSG_NOSIGNAL);
+    close(conn);
+  }
+
+  return NULL;
+}
+
+/**
+ * Appends to the report, truncating once it is full.
+ * @param out The report.
+ * @param len The size of out.
+ * @param used The length of the report so far, updated.
+ * @param format The printf() format.
+ */
+static void report_append(char *out, int len, int *used, const char *format,
+                          ...) {
+  va_list args;
+
+  if (*used >= len - 1) {
+    return;
+  }
+
+  va_start(args, format);
+  int written = vsnprintf(out + *used, len - *used, format, args);
+  va_end(args);
+
+  *used = written < len - *used ? *used + written : len - 1;
+}
+
+int control_report(char *out, int len, const long long *rates,
+                   const long long *starts) {
+  long long now = now_ns();
+  int used = 0;
+  int active = 0;
+
+  out[0] = '\0';
+
+  for (int i = 0; i < MAX_TRANSFERS; i++) {
+    struct transfer_stats *stats = &transfer_table[i];
+    char peer[sizeof(stats->peer)];
+    char file[sizeof(stats->file)];
+    long long phase_ns[PHASE_COUNT];
+
+    if (!atomic_load_explicit(&stats->in_use, memory_order_acquire)) {
+      continue;
+    }
+
+    // Seqlock read: retry-free, a slot changing under us is just skipped
+    // and shows up in the next report.
+    unsigned int generation =
+        atomic_load_explicit(&stats->generation, memory_order_acquire);
+    if (generation & 1) {
+      continue;
+    }
+
+    memcpy(peer, stats->peer, sizeof(peer));
+    memcpy(file, stats->file, sizeof(file));
+    long long start =
+        atomic_load_explicit(&stats->start_ns, memory_order_relaxed);
+    long long size = atomic_load_explicit(&stats->size, memory_order_relaxed);
+    long long offset =
+        atomic_load_explicit(&stats->offset, memory_order_relaxed);
+    long long bytes = atomic_load_explicit(&stats->bytes, memory_order_relaxed);
+    int phase = atomic_load_explicit(&stats->phase, memory_order_relaxed);
+    long long phase_start =
+        atomic_load_explicit(&stats->phase_start_ns, memory_order_relaxed);
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      phase_ns[p] =
+          atomic_load_explicit(&stats->phase_ns[p], memory_order_relaxed);
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&stats->generation, memory_order_relaxed) !=
+        generation) {
+      continue;
+    }
+
+    peer[sizeof(peer) - 1] = '\0';
+    file[sizeof(file) - 1] = '\0';
+    phase_ns[phase] += now - phase_start;
+
+    long long elapsed = now - start;
+    long long average =
+        elapsed > 0 ? (long long)(bytes * 1e9 / elapsed) : 0;
+    long long current = starts[i] == start ? rates[i] : average;
+
+    report_append(out, len, &used,
+                  "peer=%s file=%s phase=%s phase_ms=%lld bytes=%lld "
+                  "progress=%lld/%lld avg_Bps=%lld cur_Bps=%lld "
+                  "elapsed_ms=%lld",
+                  peer, file[0] != '\0' ? file : "-", phase_names[phase],
+                  (now - phase_start) / 1000000LL, bytes, offset, size,
+                  average, current, elapsed / 1000000LL);
+
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      report_append(out, len, &used, " %s_ms=%.1f", phase_names[p],
+                    phase_ns[p] / 1e6);
+    }
+    report_append(out, len, &used, "\n");
+    active++;
+  }
+
+  report_append(out, len, &used, "transfers=%d\n", active);
+
+  return used;
+}
+
+long long parse_rate(const char *text) {
+  char *end = NULL;
+  long long rate = strtoll(text, &end, 10);
+
+  if (end == text || rate < 0) {
+    return -1;
+  }
+
+  switch (*end) {
+  case '\0':
+    return rate;
+  case 'k':
+  case 'K':
+    rate *= 1000;
+    break;
+  case 'm':
+  case 'M':
+    rate *= 1000000;
+    break;
+  case 'g':
+  case 'G':
+    rate *= 1000000000;
+    break;
+  default:
+    return -1;
+  }
+
+  return end[1] == '\0' ? rate : -1;
+}
+
+/**
+ * Queues the packets a NACK asks for, skipping those already queued or
+ * repaired within the holdoff, which other receivers' NACKs asked for too.
+ * @param packet The NACK datagram.
+ * @param len Its length.
+ * @param session The session being sent.
+ * @param total The number of DATA packets.
+ * @param queue The FIFO of packets to repair, total slots.
+ * @param queue_tail Index where the next repair is queued.
+ * @param queued Per packet, whether it sits in the queue.
+ * @param repaired_ns Per packet, when it was last repaired.
+ * @param now The current time in nanoseconds.
+ * @return The number of packets queued, -1 if the datagram isn't a NACK for
+ * this session.
+ */
+static int mcast_queue_repairs(const char *packet, int len, uint32_t session,
+                               uint32_t total, uint32_t *queue,
+                               uint32_t *queue_tail, unsigned char *queued,
+                               const long long *repaired_ns, long long now) {
+  struct mcast_header header;
+
+  if (len < (int)sizeof(header)) {
+    return -1;
+  }
+
+  memcpy(&header, packet, sizeof(header));
+  if (ntohl(header.magic) != MCAST_MAGIC || header.type != MCAST_NACK ||
+      ntohl(header.session) != session ||
+      (int)(sizeof(header) + header.ranges * 2 * sizeof(uint32_t)) > len) {
+    return -1;
+  }
+
+  const uint32_t *ranges = (const uint32_t *)(packet + sizeof(header));
+  long long holdoff = MCAST_REPAIR_HOLDOFF_MS * 1000000LL;
+  int added = 0;
+
+  for (int i = 0; i < header.ranges; i++) {
+    uint32_t first = ntohl(ranges[2 * i]);
+    uint32_t count = ntohl(ranges[2 * i + 1]);
+
+    for (uint32_t seq = first; seq < total && seq - first < count; seq++) {
+      if (queued[seq] ||
+          (repaired_ns[seq] != 0 && now - repaired_ns[seq] < holdoff)) {
+        continue;
+      }
+
+      queued[seq] = 1;
+      queue[*queue_tail % total] = seq;
+      (*queue_tail)++;
+      added++;
+    }
+  }
+
+  return added;
+}
+
+int multicast_file(const struct catalog_entry *entry, const char *group,
+                   const char *iface, long long rate) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock == -1) {
+    printf("Error : Socket creation failed.\n");
+    return -1;
+  }
+
+  struct sockaddr_in group_address;
+  memset(&group_address, 0, sizeof(group_address));
+  group_address.sin_family = AF_INET;
+  group_address.sin_port = htons(MCAST_PORT);
+
+  struct ip_mreq membership;
+  memset(&membership, 0, sizeof(membership));
+  membership.imr_interface.s_addr = htonl(INADDR_ANY);
+
+  if (inet_pton(AF_INET, group, &group_address.sin_addr) <= 0 ||
+      (iface != NULL &&
+       inet_pton(AF_INET, iface, &membership.imr_interface) <= 0)) {
+    printf("Error: inet_pton() failed.\n");
+    close(sock);
+    return -1;
+  }
+  membership.imr_multiaddr = group_address.sin_addr;
+
+  // The sender joins the group too: receivers multicast their NACKs so they
+  // can hear and suppress each other's.
+  int reuse = 1;
+  unsigned char ttl = MCAST_TTL;
+  unsigned char loop = 1;
+  struct sockaddr_in bind_address = group_address;
+  bind_address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) ==
+          -1 ||
+      bind(sock, (struct sockaddr *)&bind_address, sizeof(bind_address)) ==
+          -1 ||
+      setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership,
+                 sizeof(membership)) == -1 ||
+      setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &membership.imr_interface,
+                 sizeof(membership.imr_interface)) == -1 ||
+      setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) ==
+          -1 ||
+      setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) ==
+          -1) {
+    printf("Error : Setting up multicast group %s failed: %s.\n", group,
+           strerror(errno));
+    close(sock);
+    return -1;
+  }
+
+  uint32_t total = (entry->size + MCAST_PAYLOAD - 1) / MCAST_PAYLOAD;
+  uint32_t session = (uint32_t)(getpid() ^ now_ns()) | 1;
+  uint32_t *queue = calloc(total + 1, sizeof(uint32_t));
+  unsigned char *queued = calloc(total + 1, 1);
+  long long *repaired_ns = calloc(total + 1, sizeof(long long));
+
+  if (queue == NULL || queued == NULL || repaired_ns == NULL) {
+    printf("Error : Allocating the repair state failed.\n");
+    free(queue);
+    free(queued);
+    free(repaired_ns);
+    close(sock);
+    return -1;
+  }
+
+  printf("Multicasting %s (%d bytes, %u packets) to %s:%d at %lld bytes/s, "
+         "session %08x...\n",
+         entry->name, entry->size, total, group, MCAST_PORT, rate, session);
+
+  struct token_bucket bucket;
+  bucket_init(&bucket, rate);
+
+  char packet[sizeof(struct mcast_header) + MCAST_PAYLOAD +
+              MCAST_MAX_RANGES * 2 * sizeof(uint32_t)];
+  struct mcast_header *header = (struct mcast_header *)packet;
+  uint32_t next_seq = 0;
+  uint32_t queue_head = 0;
+  uint32_t queue_tail = 0;
+  long long quiet_since_ns = 0; // Last NACK, or the first FIN.
+  long long next_fin_ns = 0;
+  long long data_sent = 0;
+  long long repairs_sent = 0;
+  long long nacks_heard = 0;
+  int result = 0;
+
+  while (1) {
+    long long now = now_ns();
+    int len;
+
+    // Our own DATA and FIN packets loop back here too and are ignored.
+    while ((len = (int)recv(sock, packet, sizeof(packet), MSG_DONTWAIT)) > 0) {
+      if (mcast_queue_repairs(packet, len, session, total, queue, &queue_tail,
+                              queued, repaired_ns, now) >= 0) {
+        nacks_heard++;
+        quiet_since_ns = now;
+      }
+    }
+
+    // Repairs go before new data, and a FIN only goes out once both are done.
+    int repair = queue_head != queue_tail;
+    int fin = !repair && next_seq == total;
+    long long wait_ns = 0;
+
+    if (fin) {
+      // Receivers can't be counted, so the transfer ends when they have
+      // all gone quiet for a while after the end of the file.
+      if (next_fin_ns != 0 &&
+          now - quiet_since_ns >= MCAST_LINGER_MS * 1000000LL) {
+        break;
+      }
+      wait_ns = next_fin_ns - now;
+    } else {
+      bucket_refill(&bucket, now);
+      wait_ns = bucket_wait_ns(&bucket, sizeof(struct mcast_header) +
+                                            MCAST_PAYLOAD);
+    }
+
+    if (wait_ns > 0) {
+      struct pollfd pfd = {sock, POLLIN, 0};
+      if (poll(&pfd, 1, (int)((wait_ns + 999999) / 1000000)) == -1 &&
+          errno != EINTR) {
+        printf("Error : poll() failed.\n");
+        result = -1;
+        break;
+      }
+      continue;
+    }
+
+    memset(header, 0, sizeof(struct mcast_header));
+    header->magic = htonl(MCAST_MAGIC);
+    header->session = htonl(session);
+    header->total = htonl(total);
+    header->size = htonl(entry->size);
+    header->checksum = htonl(entry->checksum);
+
+    if (fin) {
+      header->type = MCAST_FIN;
+      len = sizeof(struct mcast_header);
+      if (next_fin_ns == 0) {
+        quiet_since_ns = now;
+      }
+      next_fin_ns = now + MCAST_FIN_INTERVAL_MS * 1000000LL;
+    } else {
+      uint32_t seq;
+
+      if (repair) {
+        seq = queue[queue_head % total];
+        queue_head++;
+        queued[seq] = 0;
+        repaired_ns[seq] = now;
+        repairs_sent++;
+      } else {
+        seq = next_seq++;
+        data_sent++;
+      }
+
+      int offset = (int)(seq * MCAST_PAYLOAD);
+      int payload = min(MCAST_PAYLOAD, entry->size - offset);
+
+      if (pread(entry->fd, packet + sizeof(struct mcast_header), payload,
+                offset) != payload) {
+        printf("Error : Reading %s failed.\n", entry->name);
+        result = -1;
+        break;
+      }
+
+      header->type = MCAST_DATA;
+      header->seq = htonl(seq);
+      header->len = htons(payload);
+      len = (int)sizeof(struct mcast_header) + payload;
+      bucket.tokens -= len;
+    }
+
+    if (sendto(sock, packet, len, 0, (struct sockaddr *)&group_address,
+               sizeof(group_address)) != len &&
+        errno != ENOBUFS && errno != EAGAIN) {
+      printf("Error : Sending to the group failed: %s.\n", strerror(errno));
+      result = -1;
+      break;
+    }
+  }
+
+  printf("Multicast done: %lld data packets, %lld repairs, %lld NACKs "
+         "heard.\n",
+         data_sent, repairs_sent, nacks_heard);
+
+  free(queue);
+  free(queued);
+  free(repaired_ns);
+  close(sock);
+
+  return result;
+}
+
+int fec_send_file(const struct catalog_entry *entry, const char *destination,
+                  double ratio, long long rate) {
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(FEC_PORT);
+
+  char host[INET_ADDRSTRLEN] = {0};
+  const char *colon = strchr(destination, ':');
+  size_t host_len = colon != NULL ? (size_t)(colon - destination)
+                                  : strlen(destination);
+
+  if (host_len >= sizeof(host)) {
+    printf("Error: inet_pton() failed.\n");
+    return -1;
+  }
+  memcpy(host, destination, host_len);
+
+  if (colon != NULL) {
+    address.sin_port = htons((unsigned short)atoi(colon + 1));
+  }
+
+  if (inet_pton(AF_INET, host, &address.sin_addr) <= 0) {
+    printf("Error: inet_pton() failed.\n");
+    return -1;
+  }
+
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock == -1) {
+    printf("Error : Socket creation failed.\n");
+    return -1;
+  }
+
+  int block_k = FEC_BLOCK_K;
+  int m = (int)ceil(block_k * ratio);
+  if (block_k + m > FEC_MAX_SYMBOLS) {
+    m = FEC_MAX_SYMBOLS - block_k;
+  }
+
+  int block_bytes = block_k * FEC_SYMBOL_SIZE;
+  int blocks = (entry->size + block_bytes - 1) / block_bytes;
+  uint32_t session = (uint32_t)(getpid() ^ now_ns()) | 1;
+  int packet_len = (int)sizeof(struct fec_header) + FEC_SYMBOL_SIZE;
+
+  // The block's symbols are sent straight from here: data symbols first,
+  // then the repair symbols computed from them.
+  unsigned char *symbols = calloc(block_k + m, packet_len);
+  unsigned char *data[FEC_MAX_SYMBOLS];
+
+  if (symbols == NULL) {
+    printf("Error : Allocating the block buffer failed.\n");
+    close(sock);
+    return -1;
+  }
+
+  for (int j = 0; j < block_k + m; j++) {
+    data[j] = symbols + j * packet_len + sizeof(struct fec_header);
+  }
+
+  fec_init();
+
+  printf("Sending %s (%d bytes, %d blocks of %d symbols + %d repair) to "
+         "%s:%d at %lld bytes/s, session %08x...\n",
+         entry->name, entry->size, blocks, block_k, m, host,
+         ntohs(address.sin_port), rate, session);
+
+  struct token_bucket bucket;
+  bucket_init(&bucket, rate);
+  long long packets = 0;
+  int result = 0;
+
+  for (int block = 0; block < blocks && result == 0; block++) {
+    int offset = block * block_bytes;
+    int k = min(block_k, (entry->size - offset + FEC_SYMBOL_SIZE - 1) /
+                             FEC_SYMBOL_SIZE);
+
+    for (int j = 0; j < k; j++) {
+      int len =
+          min(FEC_SYMBOL_SIZE, entry->size - offset - j * FEC_SYMBOL_SIZE);
+
+      memset(data[j] + len, 0, FEC_SYMBOL_SIZE - len);
+      if (pread(entry->fd, data[j], len, offset + j * FEC_SYMBOL_SIZE) !=
+          len) {
+        printf("Error : Reading %s failed.\n", entry->name);
+        result = -1;
+        break;
+      }
+    }
+
+    for (int i = 0; i < m && result == 0; i++) {
+      fec_encode(k, data, i, data[k + i], FEC_SYMBOL_SIZE);
+    }
+
+    for (int esi = 0; esi < k + m && result == 0; esi++) {
+      unsigned char *packet = data[esi] - sizeof(struct fec_header);
+      struct fec_header header;
+
+      memset(&header, 0, sizeof(header));
+      header.magic = htonl(FEC_MAGIC);
+      header.session = htonl(session);
+      header.size = htonl(entry->size);
+      header.checksum = htonl(entry->checksum);
+      header.block = htonl(block);
+      header.esi = (uint8_t)esi;
+      header.k = (uint8_t)k;
+      header.block_k = (uint8_t)block_k;
+      header.m = (uint8_t)m;
+      header.symbol_size = htons(FEC_SYMBOL_SIZE);
+      memcpy(packet, &header, sizeof(header));
+
+      long long wait_ns;
+      bucket_refill(&bucket, now_ns());
+      while ((wait_ns = bucket_wait_ns(&bucket, packet_len)) > 0) {
+        struct timespec ts = {wait_ns / 1000000000LL, wait_ns % 1000000000LL};
+        nanosleep(&ts, NULL);
+        bucket_refill(&bucket, now_ns());
+      }
+      bucket.tokens -= packet_len;
+
+      if (sendto(sock, packet, packet_len, 0, (struct sockaddr *)&address,
+                 sizeof(address)) != packet_len &&
+          errno != ENOBUFS && errno != ECONNREFUSED) {
+        printf("Error : Sending failed: %s.\n", strerror(errno));
+        result = -1;
+      }
+      packets++;
+    }
+  }
+
+  printf("Sent %lld packets (%.0f%% repair overhead).\n", packets,
+         100.0 * m / block_k);
+
+  free(symbols);
+  close(sock);
+
+  return result;
+}
+
+void handle_sighup(int signum) {
+  (void)signum;
+  reload_catalog = 1;
+}
@@ -0,0 +1,214 @@
+#include "fec.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define GF_POLYNOMIAL 0x11d // x^8 + x^4 + x^3 + x^2 + 1
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+static unsigned char gf_mul_table[256][256];
+
+/**
+ * Multiplies two field elements.
+ * @param a First element.
+ * @param b Second element.
+ * @return a * b in GF(2^8).
+ */
+static unsigned char gf_mul(unsigned char a, unsigned char b) {
+  return gf_mul_table[a][b];
+}
+
+/**
+ * Inverts a non-zero field element.
+ * @param a The element.
+ * @return 1 / a in GF(2^8).
+ */
+static unsigned char gf_inv(unsigned char a) { return gf_exp[255 - gf_log[a]]; }
+
+/**
+ * Returns the coefficient of data symbol j in repair symbol i.
+ * @param i The repair symbol index.
+ * @param j The data symbol index.
+ * @return 1 / (x_i + y_j), with x_i = 255 - i and y_j = j.
+ */
+static unsigned char cauchy(int i, int j) {
+  return gf_inv((unsigned char)((255 - i) ^ j));
+}
+
+/**
+ * Adds c times src to dst, byte by byte.
+ * @param dst The destination region.
+ * @param src The source region.
+ * @param c The coefficient.
+ * @param len The length of both regions.
+ */
+static void region_mul_add(unsigned char *dst, const unsigned char *src,
+                           unsigned char c, int len) {
+  if (c == 0) {
+    return;
+  }
+
+  if (c == 1) {
+    for (int x = 0; x < len; x++) {
+      dst[x] ^= src[x];
+    }
+    return;
+  }
+
+  const unsigned char *row = gf_mul_table[c];
+  for (int x = 0; x < len; x++) {
+    dst[x] ^= row[src[x]];
+  }
+}
+
+void fec_init(void) {
+  int x = 1;
+
+  for (int i = 0; i < 255; i++) {
+    gf_exp[i] = (unsigned char)x;
+    gf_log[x] = (unsigned char)i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= GF_POLYNOMIAL;
+    }
+  }
+
+  // Doubling the exp table saves a modulo in every multiplication.
+  for (int i = 255; i < 512; i++) {
+    gf_exp[i] = gf_exp[i - 255];
+  }
+
+  for (int a = 1; a < 256; a++) {
+    for (int b = 1; b < 256; b++) {
+      gf_mul_table[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+    }
+  }
+}
+
+void fec_encode(int k, unsigned char *const *data, int repair_index,
+                unsigned char *out, int len) {
+  memset(out, 0, len);
+
+  for (int j = 0; j < k; j++) {
+    region_mul_add(out, data[j], cauchy(repair_index, j), len);
+  }
+}
+
+/**
+ * Inverts a k x k matrix in place with Gauss-Jordan elimination.
+ * @param matrix The matrix, row-major; replaced by its inverse.
+ * @param k Its dimension.
+ * @return 0 on success, -1 if the matrix is singular.
+ */
+static int invert_matrix(unsigned char *matrix, int k) {
+  unsigned char *inverse = calloc((size_t)k * k, 1);
+  if (inverse == NULL) {
+    return -1;
+  }
+
+  for (int i = 0; i < k; i++) {
+    inverse[i * k + i] = 1;
+  }
+
+  for (int col = 0; col < k; col++) {
+    int pivot = col;
+    while (pivot < k && matrix[pivot * k + col] == 0) {
+      pivot++;
+    }
+
+    if (pivot == k) {
+      free(inverse);
+      return -1;
+    }
+
+    if (pivot != col) {
+      for (int x = 0; x < k; x++) {
+        unsigned char tmp = matrix[col * k + x];
+        matrix[col * k + x] = matrix[pivot * k + x];
+        matrix[pivot * k + x] = tmp;
+
+        tmp = inverse[col * k + x];
+        inverse[col * k + x] = inverse[pivot * k + x];
+        inverse[pivot * k + x] = tmp;
+      }
+    }
+
+    unsigned char scale = gf_inv(matrix[col * k + col]);
+    for (int x = 0; x < k; x++) {
+      matrix[col * k + x] = gf_mul(matrix[col * k + x], scale);
+      inverse[col * k + x] = gf_mul(inverse[col * k + x], scale);
+    }
+
+    for (int row = 0; row < k; row++) {
+      unsigned char factor = matrix[row * k + col];
+
+      if (row != col && factor != 0) {
+        region_mul_add(matrix + row * k, matrix + col * k, factor, k);
+        region_mul_add(inverse + row * k, inverse + col * k, factor, k);
+      }
+    }
+  }
+
+  memcpy(matrix, inverse, (size_t)k * k);
+  free(inverse);
+
+  return 0;
+}
+
+int fec_decode(int k, const int *esis, unsigned char *const *symbols,
+               unsigned char *const *data, int len) {
+  unsigned char have[FEC_MAX_SYMBOLS] = {0};
+  int missing = 0;
+
+  for (int r = 0; r < k; r++) {
+    if (esis[r] < 0 || esis[r] >= FEC_MAX_SYMBOLS || have[esis[r]]) {
+      return -1;
+    }
+    have[esis[r]] = 1;
+  }
+
+  for (int j = 0; j < k; j++) {
+    missing += !have[j];
+  }
+
+  if (missing == 0) {
+    return 0;
+  }
+
+  // Row r expresses received symbol r in terms of the data symbols: a unit
+  // row for a data symbol, a Cauchy row for a repair symbol.
+  unsigned char *matrix = calloc((size_t)k * k, 1);
+  if (matrix == NULL) {
+    return -1;
+  }
+
+  for (int r = 0; r < k; r++) {
+    for (int j = 0; j < k; j++) {
+      matrix[r * k + j] =
+          esis[r] < k ? (esis[r] == j) : cauchy(esis[r] - k, j);
+    }
+  }
+
+  if (invert_matrix(matrix, k) == -1) {
+    free(matrix);
+    return -1;
+  }
+
+  // Only the missing data symbols need computing; the others are already
+  // among the symbols received.
+  for (int j = 0; j < k; j++) {
+    if (have[j]) {
+      continue;
+    }
+
+    memset(data[j], 0, len);
+    for (int r = 0; r < k; r++) {
+      region_mul_add(data[j], symbols[r], matrix[j * k + r], len);
+    }
+  }
+
+  free(matrix);
+  return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef FEC_H
+#define FEC_H
+
+/**
+ * Systematic Reed-Solomon erasure code over GF(2^8).
+ *
+ * A block of k data symbols is extended with repair symbols; the k data
+ * symbols can be rebuilt from any k of the data and repair symbols. Symbol
+ * IDs (ESIs) 0..k-1 are the data symbols themselves and ESI k+i is repair
+ * symbol i, the row of a Cauchy matrix 1 / (x_i + y_j) with x_i = 255 - i and
+ * y_j = j. Every square submatrix of a Cauchy matrix is invertible, so
+ * k + repair <= FEC_MAX_SYMBOLS symbols always decode.
+ */
+
+#define FEC_MAX_SYMBOLS 256
+
+/**
+ * Builds the GF(2^8) tables. Must be called once before anything else.
+ */
+void fec_init(void);
+
+/**
+ * Computes one repair symbol of a block.
+ * @param k The number of data symbols in the block.
+ * @param data The k data symbols, len bytes each.
+ * @param repair_index Which repair symbol to compute (0, 1, ...).
+ * @param out Where to write the repair symbol, len bytes.
+ * @param len The symbol size.
+ */
+void fec_encode(int k, unsigned char *const *data, int repair_index,
+                unsigned char *out, int len);
+
+/**
+ * Rebuilds the data symbols of a block from any k of its symbols.
+ * @param k The number of data symbols in the block.
+ * @param esis The ESIs of the k symbols received, all distinct.
+ * @param symbols The k symbols received, len bytes each.
+ * @param data Where to write the k data symbols, len bytes each. data[j] may
+ * be the same buffer as the symbols[r] whose ESI is j.
+ * @param len The symbol size.
+ * @return 0 on success, -1 if the ESIs are invalid.
+ */
+int fec_decode(int k, const int *esis, unsigned char *const *symbols,
+               unsigned char *const *data, int len);
+
+#endif
@@ -0,0 +1,219 @@
+#include "checksum.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86 1
+#endif
+
+
+#define SIMD_MIN_LEN 128 // Shorter buffers aren't worth the vector setup.
+#define SIMD_BLOCK 16384 // Vector iterations before 32-bit lanes overflow.
+
+/**
+ * Folds a 64-bit ones' complement sum down to 16 bits.
+ * @param sum The sum.
+ * @return The sum in 16 bits, end-around carries included.
+ */
+static uint16_t fold(uint64_t sum) {
+  sum = (sum >> 32) + (sum & 0xffffffff);
+  sum = (sum >> 32) + (sum & 0xffffffff);
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum = (sum >> 16) + (sum & 0xffff);
+
+  return (uint16_t)sum;
+}
+
+/**
+ * Adds a buffer to a ones' complement sum, 8 bytes at a time.
+ * @param data The buffer.
+ * @param len Its length.
+ * @param sum The sum so far.
+ * @return The new sum, not folded.
+ */
+static uint64_t sum_scalar(const unsigned char *data, size_t len,
+                           uint64_t sum) {
+  // Two independent accumulators keep the carries off the critical path.
+  uint64_t low = 0;
+  uint64_t high = 0;
+
+  for (; len >= 16; len -= 16, data += 16) {
+    uint64_t a, b;
+    memcpy(&a, data, 8);
+    memcpy(&b, data + 8, 8);
+
+    low += a;
+    low += low < a; // End-around carry.
+    high += b;
+    high += high < b;
+  }
+
+  sum += fold(low) + (uint64_t)fold(high);
+
+  for (; len >= 2; len -= 2, data += 2) {
+    uint16_t word;
+    memcpy(&word, data, 2);
+    sum += word;
+  }
+
+  if (len == 1) {
+    unsigned char last[2] = {data[0], 0};
+    uint16_t word;
+    memcpy(&word, last, 2);
+    sum += word;
+  }
+
+  return sum;
+}
+
+#ifdef CHECKSUM_X86
+
+/**
+ * Adds a buffer to a ones' complement sum, 16 bytes at a time with SSE2.
+ * Every 16-bit word is widened into a 32-bit lane, so no carry is lost.
+ * @param data The buffer.
+ * @param len Its length.
+ * @param sum The sum so far.
+ * @return The new sum, not folded.
+ */
+__attribute__((target("sse2"))) static uint64_t
+sum_sse2(const unsigned char *data, size_t len, uint64_t sum) {
+  const __m128i zero = _mm_setzero_si128();
+
+  while (len >= 16) {
+    __m128i acc = _mm_setzero_si128();
+    size_t blocks = len / 16 < SIMD_BLOCK ? len / 16 : SIMD_BLOCK;
+
+    for (size_t i = 0; i < blocks; i++, data += 16) {
+      __m128i words = _mm_loadu_si128((const __m128i *)data);
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(words, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(words, zero));
+    }
+    len -= blocks * 16;
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    for (int i = 0; i < 4; i++) {
+      sum += lanes[i];
+    }
+  }
+
+  return sum_scalar(data, len, sum);
+}
+
+/**
+ * Adds a buffer to a ones' complement sum, 32 bytes at a time with AVX2.
+ * @param data The buffer.
+ * @param len Its length.
+ * @param sum The sum so far.
+ * @return The new sum, not folded.
+ */
+__attribute__((target("avx2"))) static uint64_t
+sum_avx2(const unsigned char *data, size_t len, uint64_t sum) {
+  const __m256i zero = _mm256_setzero_si256();
+
+  while (len >= 32) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t blocks = len / 32 < SIMD_BLOCK ? len / 32 : SIMD_BLOCK;
+
+    for (size_t i = 0; i < blocks; i++, data += 32) {
+      __m256i words = _mm256_loadu_si256((const __m256i *)data);
+      acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(words, zero));
+      acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(words, zero));
+    }
+    len -= blocks * 32;
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    for (int i = 0; i < 8; i++) {
+      sum += lanes[i];
+    }
+  }
+
+  return sum_scalar(data, len, sum);
+}
+
+#endif
+
+/**
+ * Picks the fastest kernel the CPU supports. SSE2 isn't one of them: its
+ * 16 bytes, widened to 32-bit lanes, sum no faster than the scalar loop's two
+ * 64-bit adds, and checksum_test times it at well below scalar.
+ * @return The kernel.
+ */
+static enum checksum_kernel select_kernel(void) {
+#ifdef CHECKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return CHECKSUM_AVX2;
+  }
+#endif
+  return CHECKSUM_SCALAR;
+}
+
+uint16_t inet_checksum(const void *data, size_t len) {
+  static uint64_t (*kernel)(const unsigned char *, size_t, uint64_t) = NULL;
+
+  if (len < SIMD_MIN_LEN) {
+    return (uint16_t)~fold(sum_scalar(data, len, 0));
+  }
+
+  // Every thread picks the same kernel, so a race here is harmless.
+  if (kernel == NULL) {
+    kernel = sum_scalar;
+#ifdef CHECKSUM_X86
+    if (select_kernel() == CHECKSUM_AVX2) {
+      kernel = sum_avx2;
+    }
+#endif
+  }
+
+  return (uint16_t)~fold(kernel(data, len, 0));
+}
+
+int inet_checksum_kernel(enum checksum_kernel kernel, const void *data,
+                         size_t len) {
+  switch (kernel) {
+  case CHECKSUM_SCALAR:
+    return (uint16_t)~fold(sum_scalar(data, len, 0));
+#ifdef CHECKSUM_X86
+  case CHECKSUM_SSE2:
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+      return (uint16_t)~fold(sum_sse2(data, len, 0));
+    }
+    return -1;
+  case CHECKSUM_AVX2:
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return (uint16_t)~fold(sum_avx2(data, len, 0));
+    }
+    return -1;
+#endif
+  default:
+    return -1;
+  }
+}
+
+enum checksum_kernel inet_checksum_selected(void) {
+  return select_kernel();
+}
+
+uint16_t inet_checksum_update(uint16_t check, const void *old_data,
+                              const void *new_data, size_t len) {
+  const unsigned char *old_bytes = old_data;
+  const unsigned char *new_bytes = new_data;
+  uint64_t sum = (uint16_t)~check;
+
+  // HC' = ~(~HC + ~m + m') for every word m that became m'.
+  for (size_t i = 0; i + 1 < len; i += 2) {
+    uint16_t old_word, new_word;
+    memcpy(&old_word, old_bytes + i, 2);
+    memcpy(&new_word, new_bytes + i, 2);
+    sum += (uint16_t)~old_word;
+    sum += new_word;
+  }
+
+  return (uint16_t)~fold(sum);
+}
@@ -0,0 +1,73 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The Internet checksum (RFC 1071) of IP, ICMP, UDP and TCP headers.
+ *
+ * The checksum is the ones' complement of the ones' complement sum of the
+ * data as 16-bit words. That sum doesn't depend on byte order, so words are
+ * summed as they lie in memory and the result is stored into the packet as
+ * is, without htons().
+ *
+ * The sum is computed 8 bytes at a time into a 64-bit accumulator, or with
+ * AVX2 for longer buffers when the CPU has it; the kernel is picked on the
+ * first call.
+ */
+
+/**
+ * Computes the checksum of a buffer.
+ * @param data The buffer, with any alignment. Its checksum field must be 0,
+ * or hold the checksum when verifying.
+ * @param len Its length in bytes; an odd last byte is padded with a 0.
+ * @return The checksum to store in the packet, or 0 when verifying a buffer
+ * whose checksum is correct.
+ */
+uint16_t inet_checksum(const void *data, size_t len);
+
+/**
+ * Updates a checksum after part of the data changed (RFC 1624, eqn. 3),
+ * without summing the rest again.
+ * @param check The checksum as stored in the packet.
+ * @param old_data The bytes before the change.
+ * @param new_data The bytes after the change.
+ * @param len The number of bytes changed. Must be even, and the bytes must
+ * start at an even offset into the checksummed data.
+ * @return The new checksum to store in the packet.
+ */
+uint16_t inet_checksum_update(uint16_t check, const void *old_data,
+                              const void *new_data, size_t len);
+
+/**
+ * The summing kernels inet_checksum() picks from. SSE2 is never picked, as
+ * it is slower than the scalar one; it is kept to be timed against it.
+ */
+enum checksum_kernel {
+  CHECKSUM_SCALAR, // 8 bytes at a time, on every CPU.
+  CHECKSUM_SSE2,
+  CHECKSUM_AVX2,
+  CHECKSUM_KERNELS,
+};
+
+/**
+ * Computes the checksum of a buffer with one kernel in particular, whatever
+ * its length, so that the kernels can be tested and timed against each
+ * other.
+ * @param kernel The kernel.
+ * @param data The buffer, with any alignment.
+ * @param len Its length in bytes.
+ * @return The checksum, as inet_checksum() would return it, or -1 if the
+ * CPU doesn't have the kernel.
+ */
+int inet_checksum_kernel(enum checksum_kernel kernel, const void *data,
+                         size_t len);
+
+/**
+ * Tells which kernel inet_checksum() uses for long buffers on this CPU.
+ * @return The kernel.
+ */
+enum checksum_kernel inet_checksum_selected(void);
+
+#endif
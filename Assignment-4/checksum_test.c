@@ -0,0 +1,293 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "checksum.h"
+
+
+#define MAX_LEN (2 * 1024 * 1024) // Past the point where SIMD lanes flush.
+#define MAX_ALIGN 64
+#define RANDOM_ROUNDS 20000
+#define UPDATE_ROUNDS 20000
+#define CHECK_OFFSET 2 // Where the checksum field sits, as in ICMP.
+#define BENCH_NS 200000000LL // Each kernel is timed for this long.
+#define COMPARE_MIN_LEN 9000 // Below, timings are too close to tell apart.
+
+static const char *const kernel_names[CHECKSUM_KERNELS] = {"scalar", "sse2",
+                                                           "avx2"};
+
+/**
+ * The lengths timed: an echo request, an Ethernet frame, a jumbo frame and
+ * a large buffer.
+ */
+static const size_t bench_lens[] = {64, 1500, 9000, 65536};
+
+/**
+ * Draws a pseudo-random number (xorshift64*).
+ * @param state The generator's state, never 0.
+ * @return The number.
+ */
+uint64_t next_random(uint64_t *state);
+
+/**
+ * Computes the checksum the slow and obvious way, 16 bits at a time as RFC
+ * 1071 describes it: the reference every kernel is held to.
+ * @param data The buffer.
+ * @param len Its length.
+ * @return The checksum.
+ */
+uint16_t reference_checksum(const unsigned char *data, size_t len);
+
+/**
+ * Checks every kernel and inet_checksum() against the reference on one
+ * buffer.
+ * @param data The buffer.
+ * @param len Its length.
+ * @return The number of mismatches, each one printed.
+ */
+int check_kernels(const unsigned char *data, size_t len);
+
+/**
+ * Changes a random even stretch of a buffer, updates its checksum with
+ * inet_checksum_update() and checks the result against a full recompute and
+ * that the buffer still verifies.
+ * @param buffer The buffer, its checksum field set.
+ * @param len Its length.
+ * @param state The random generator.
+ * @return 0 if it matched, 1 if it didn't (printed).
+ */
+int check_update(unsigned char *buffer, size_t len, uint64_t *state);
+
+/**
+ * Prints the throughput of every kernel the CPU has on one length.
+ * @param data A buffer of at least len bytes.
+ * @param len The length.
+ * @param rates Set to each kernel's throughput in GB/s, 0 if the CPU doesn't
+ * have it.
+ */
+void bench(const unsigned char *data, size_t len,
+           double rates[CHECKSUM_KERNELS]);
+
+/**
+ * Reads the monotonic clock.
+ * @return The current time in nanoseconds.
+ */
+long long now_ns(void);
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 0) : (uint64_t)time(NULL);
+  uint64_t state = seed != 0 ? seed : 1;
+  unsigned char *buffer = malloc(MAX_LEN + MAX_ALIGN);
+  int failures = 0;
+  int checks = 0;
+
+  if (buffer == NULL) {
+    printf("Error : Buffer allocation failed.\n");
+    return -1;
+  }
+
+  printf("Seed %llu (pass it as the argument to replay).\n",
+         (unsigned long long)seed);
+  for (int k = 0; k < CHECKSUM_KERNELS; k++) {
+    if (inet_checksum_kernel(k, buffer, 0) == -1) {
+      printf("No %s on this CPU, not tested.\n", kernel_names[k]);
+    }
+  }
+
+  // Every short length at every alignment: all the odd tails, and the
+  // switch from the scalar loop to the vector ones.
+  for (size_t i = 0; i < MAX_LEN + MAX_ALIGN; i++) {
+    buffer[i] = (unsigned char)next_random(&state);
+  }
+  for (size_t len = 0; len <= 300; len++) {
+    for (size_t align = 0; align < MAX_ALIGN; align++) {
+      failures += check_kernels(buffer + align, len);
+      checks++;
+    }
+  }
+
+  // Random lengths and alignments, mostly short as packets are.
+  for (int round = 0; round < RANDOM_ROUNDS; round++) {
+    size_t limit = round % 100 == 0 ? MAX_LEN : 65536;
+    size_t len = next_random(&state) % (limit + 1);
+    size_t align = next_random(&state) % MAX_ALIGN;
+
+    failures += check_kernels(buffer + align, len);
+    checks++;
+  }
+
+  // All ones makes the most carries, and fills the vector lanes the
+  // fastest; all zeros folds to the other zero.
+  memset(buffer, 0xff, MAX_LEN + MAX_ALIGN);
+  for (size_t len = MAX_LEN - 3; len <= MAX_LEN; len++) {
+    failures += check_kernels(buffer + len % 2, len);
+    checks++;
+  }
+  memset(buffer, 0, MAX_LEN + MAX_ALIGN);
+  failures += check_kernels(buffer, MAX_LEN);
+  checks++;
+
+  // RFC 1624 updates, on packet-sized buffers with their checksum in.
+  for (int round = 0; round < UPDATE_ROUNDS; round++) {
+    size_t len = CHECK_OFFSET + 2 + 2 * (next_random(&state) % 750);
+
+    for (size_t i = 0; i < len; i++) {
+      buffer[i] = round % 100 == 0 ? 0xff : (unsigned char)next_random(&state);
+    }
+    memset(buffer + CHECK_OFFSET, 0, 2);
+    uint16_t check = inet_checksum(buffer, len);
+    memcpy(buffer + CHECK_OFFSET, &check, 2);
+
+    failures += check_update(buffer, len, &state);
+    checks++;
+  }
+
+  if (failures > 0) {
+    printf("%d of %d checks failed.\n", failures, checks);
+    free(buffer);
+    return 1;
+  }
+  printf("All %d checks passed.\n", checks);
+
+  for (size_t i = 0; i < MAX_LEN + MAX_ALIGN; i++) {
+    buffer[i] = (unsigned char)next_random(&state);
+  }
+  // The kernel inet_checksum() picks must be worth picking over scalar.
+  enum checksum_kernel selected = inet_checksum_selected();
+  int slower = 0;
+
+  printf("inet_checksum() uses %s.\n", kernel_names[selected]);
+  for (size_t i = 0; i < sizeof(bench_lens) / sizeof(bench_lens[0]); i++) {
+    double rates[CHECKSUM_KERNELS];
+
+    bench(buffer, bench_lens[i], rates);
+    if (bench_lens[i] >= COMPARE_MIN_LEN &&
+        rates[selected] < rates[CHECKSUM_SCALAR]) {
+      printf("Error : %s is slower than scalar on %zu bytes.\n",
+             kernel_names[selected], bench_lens[i]);
+      slower = 1;
+    }
+  }
+
+  free(buffer);
+  return slower;
+}
+
+// **THE FUNCTIONS** :
+
+uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dULL;
+}
+
+uint16_t reference_checksum(const unsigned char *data, size_t len) {
+  uint32_t sum = 0;
+
+  for (size_t i = 0; i < len; i += 2) {
+    uint16_t word;
+    unsigned char pair[2] = {data[i], i + 1 < len ? data[i + 1] : 0};
+
+    memcpy(&word, pair, 2);
+    sum += word;
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+
+  return (uint16_t)~sum;
+}
+
+int check_kernels(const unsigned char *data, size_t len) {
+  uint16_t expected = reference_checksum(data, len);
+  int failures = 0;
+
+  for (int k = 0; k < CHECKSUM_KERNELS; k++) {
+    int got = inet_checksum_kernel(k, data, len);
+
+    if (got != -1 && got != expected) {
+      printf("%s: %zu bytes at alignment %zu: %04x, expected %04x\n",
+             kernel_names[k], len, (size_t)((uintptr_t)data % MAX_ALIGN),
+             got, expected);
+      failures++;
+    }
+  }
+
+  if (inet_checksum(data, len) != expected) {
+    printf("inet_checksum: %zu bytes: %04x, expected %04x\n", len,
+           inet_checksum(data, len), expected);
+    failures++;
+  }
+
+  return failures;
+}
+
+int check_update(unsigned char *buffer, size_t len, uint64_t *state) {
+  uint16_t check;
+  memcpy(&check, buffer + CHECK_OFFSET, 2);
+
+  // Anything but the checksum field itself may change.
+  size_t words = (len - CHECK_OFFSET - 2) / 2;
+  if (words == 0) {
+    return 0;
+  }
+  size_t first = next_random(state) % words;
+  size_t count = 1 + next_random(state) % (words - first);
+  size_t offset = CHECK_OFFSET + 2 + 2 * first;
+  unsigned char old_bytes[1500];
+
+  memcpy(old_bytes, buffer + offset, 2 * count);
+  for (size_t i = 0; i < 2 * count; i++) {
+    buffer[offset + i] = (unsigned char)next_random(state);
+  }
+
+  uint16_t updated = inet_checksum_update(check, old_bytes, buffer + offset,
+                                          2 * count);
+  memset(buffer + CHECK_OFFSET, 0, 2);
+  uint16_t recomputed = inet_checksum(buffer, len);
+  memcpy(buffer + CHECK_OFFSET, &updated, 2);
+
+  if (updated != recomputed || inet_checksum(buffer, len) != 0) {
+    printf("update: %zu bytes, %zu changed at %zu: %04x, recomputed %04x\n",
+           len, 2 * count, offset, updated, recomputed);
+    return 1;
+  }
+
+  return 0;
+}
+
+void bench(const unsigned char *data, size_t len,
+           double rates[CHECKSUM_KERNELS]) {
+  printf("%6zu bytes:", len);
+
+  for (int k = 0; k < CHECKSUM_KERNELS; k++) {
+    rates[k] = 0;
+    if (inet_checksum_kernel(k, data, len) == -1) {
+      continue;
+    }
+
+    volatile int sink = 0; // Keeps the calls from being optimized away.
+    long long start = now_ns();
+    long long elapsed;
+    long long calls = 0;
+
+    do {
+      for (int i = 0; i < 1000; i++) {
+        sink += inet_checksum_kernel(k, data, len);
+      }
+      calls += 1000;
+      elapsed = now_ns() - start;
+    } while (elapsed < BENCH_NS);
+
+    rates[k] = (double)calls * len / elapsed;
+    printf("  %s %6.2f GB/s", kernel_names[k], rates[k]);
+  }
+  printf("\n");
+}
+
+long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
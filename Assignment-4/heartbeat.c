@@ -0,0 +1,151 @@
+#include "heartbeat.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+#define HEARTBEAT_BYTES (HEARTBEAT_SLOTS * sizeof(struct heartbeat_slot))
+
+/**
+ * Maps the shared memory object.
+ * @param flags The shm_open() flags.
+ * @return The slots, or NULL on error.
+ */
+static struct heartbeat_slot *map_slots(int flags) {
+  int fd = shm_open(HEARTBEAT_SHM, flags, 0600);
+  if (fd == -1) {
+    perror("shm_open");
+    return NULL;
+  }
+
+  // A new object is all zeroes: every slot starts out free and idle.
+  if ((flags & O_CREAT) && ftruncate(fd, HEARTBEAT_BYTES) == -1) {
+    perror("ftruncate");
+    close(fd);
+    return NULL;
+  }
+
+  void *slots = mmap(NULL, HEARTBEAT_BYTES, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+  close(fd);
+  if (slots == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  return slots;
+}
+
+/**
+ * Starts a write: makes the counter odd.
+ * @param slot The slot.
+ */
+static void write_begin(struct heartbeat_slot *slot) {
+  uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+  atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+  // The odd counter must be visible before any field changes.
+  atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * Ends a write: makes the counter even again, after the fields.
+ * @param slot The slot.
+ */
+static void write_end(struct heartbeat_slot *slot) {
+  uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+  atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+}
+
+struct heartbeat_slot *heartbeat_create(void) {
+  // Removing it first drops a stale object left by a crash, so that the
+  // new one is zeroed; clients still mapping the old one can't be helped.
+  shm_unlink(HEARTBEAT_SHM);
+
+  return map_slots(O_RDWR | O_CREAT | O_EXCL);
+}
+
+struct heartbeat_slot *heartbeat_attach(void) {
+  return map_slots(O_RDWR);
+}
+
+void heartbeat_detach(struct heartbeat_slot *slots) {
+  munmap(slots, HEARTBEAT_BYTES);
+}
+
+void heartbeat_destroy(struct heartbeat_slot *slots) {
+  heartbeat_detach(slots);
+  shm_unlink(HEARTBEAT_SHM);
+}
+
+void heartbeat_reset(struct heartbeat_slot *slot) {
+  write_begin(slot);
+  atomic_store_explicit(&slot->ping_ns, 0, memory_order_relaxed);
+  atomic_store_explicit(&slot->pong_ns, 0, memory_order_relaxed);
+  atomic_store_explicit(&slot->pings, 0, memory_order_relaxed);
+  atomic_store_explicit(&slot->pongs, 0, memory_order_relaxed);
+  atomic_store_explicit(&slot->srtt_ns, 0, memory_order_relaxed);
+  atomic_store_explicit(&slot->rttvar_ns, 0, memory_order_relaxed);
+  write_end(slot);
+}
+
+void heartbeat_ping(struct heartbeat_slot *slot, uint64_t now_ns) {
+  uint64_t pings = atomic_load_explicit(&slot->pings, memory_order_relaxed);
+
+  write_begin(slot);
+  if (atomic_load_explicit(&slot->ping_ns, memory_order_relaxed) == 0) {
+    atomic_store_explicit(&slot->ping_ns, now_ns, memory_order_relaxed);
+  }
+  atomic_store_explicit(&slot->pings, pings + 1, memory_order_relaxed);
+  write_end(slot);
+}
+
+void heartbeat_pong(struct heartbeat_slot *slot, uint64_t now_ns,
+                    uint64_t rtt_ns) {
+  uint64_t pongs = atomic_load_explicit(&slot->pongs, memory_order_relaxed);
+  uint64_t srtt = atomic_load_explicit(&slot->srtt_ns, memory_order_relaxed);
+  uint64_t rttvar =
+      atomic_load_explicit(&slot->rttvar_ns, memory_order_relaxed);
+
+  // RFC 6298: the first sample sets SRTT = R and RTTVAR = R / 2, then
+  // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R| and SRTT = 7/8 SRTT + 1/8 R.
+  if (rtt_ns > 0 && srtt == 0) {
+    srtt = rtt_ns;
+    rttvar = rtt_ns / 2;
+  } else if (rtt_ns > 0) {
+    uint64_t delta = srtt > rtt_ns ? srtt - rtt_ns : rtt_ns - srtt;
+    rttvar = rttvar - rttvar / 4 + delta / 4;
+    srtt = srtt - srtt / 8 + rtt_ns / 8;
+  }
+
+  write_begin(slot);
+  atomic_store_explicit(&slot->ping_ns, 0, memory_order_relaxed);
+  atomic_store_explicit(&slot->pong_ns, now_ns, memory_order_relaxed);
+  atomic_store_explicit(&slot->pongs, pongs + 1, memory_order_relaxed);
+  atomic_store_explicit(&slot->srtt_ns, srtt, memory_order_relaxed);
+  atomic_store_explicit(&slot->rttvar_ns, rttvar, memory_order_relaxed);
+  write_end(slot);
+}
+
+void heartbeat_read(const struct heartbeat_slot *slot,
+                    struct heartbeat *beat) {
+  uint32_t before, after;
+
+  do {
+    before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    beat->ping_ns = atomic_load_explicit(&slot->ping_ns, memory_order_relaxed);
+    beat->pong_ns = atomic_load_explicit(&slot->pong_ns, memory_order_relaxed);
+    beat->pings = atomic_load_explicit(&slot->pings, memory_order_relaxed);
+    beat->pongs = atomic_load_explicit(&slot->pongs, memory_order_relaxed);
+    beat->srtt_ns =
+        atomic_load_explicit(&slot->srtt_ns, memory_order_relaxed);
+    beat->rttvar_ns =
+        atomic_load_explicit(&slot->rttvar_ns, memory_order_relaxed);
+    // The fields must be read before the counter is checked again.
+    atomic_thread_fence(memory_order_acquire);
+    after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+  } while ((before & 1) || before != after);
+}
@@ -0,0 +1,109 @@
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * Shared-memory heartbeats between pingers and the watchdog.
+ *
+ * The watchdog creates an array of slots in a POSIX shared memory object
+ * and hands each client the index of its own slot when it connects. From
+ * then on the client records every probe and every reply in its slot with
+ * a few plain stores, no system call, and the watchdog reads the slot when
+ * the client's deadline comes up. The connection is left for the rare state
+ * changes: joining, timing out and leaving.
+ *
+ * Each slot has a single writer, its client, and is guarded by a sequence
+ * counter (seqlock): odd while a write is in progress, so a reader retries
+ * until it gets a copy no write overlapped.
+ *
+ * Every reply also feeds the client's RTT into a smoothed RTT and RTT
+ * variance (Jacobson/Karels, RFC 6298) kept in the slot. The watchdog only
+ * looks at a slot now and then, so the estimate is updated by the writer,
+ * which sees every sample.
+ */
+
+#define HEARTBEAT_SHM "/ping_watchdog"
+#define HEARTBEAT_SLOTS 131072 // Clients at once; untouched slots cost no RAM.
+
+/**
+ * One client's heartbeat, on a cache line of its own.
+ */
+struct heartbeat_slot {
+  _Atomic uint32_t seq;       // Odd while being written.
+  _Atomic uint64_t ping_ns;   // Oldest unanswered probe's send time, or 0.
+  _Atomic uint64_t pong_ns;   // Time of the last reply.
+  _Atomic uint64_t pings;     // Probes sent.
+  _Atomic uint64_t pongs;     // Replies received.
+  _Atomic uint64_t srtt_ns;   // Smoothed RTT, 0 before the first reply.
+  _Atomic uint64_t rttvar_ns; // RTT variance (mean deviation).
+} __attribute__((aligned(64)));
+
+/**
+ * A consistent copy of a slot.
+ */
+struct heartbeat {
+  uint64_t ping_ns;
+  uint64_t pong_ns;
+  uint64_t pings;
+  uint64_t pongs;
+  uint64_t srtt_ns;
+  uint64_t rttvar_ns;
+};
+
+/**
+ * Creates the slot array, replacing a stale one. Watchdog side.
+ * @return The HEARTBEAT_SLOTS slots, or NULL on error.
+ */
+struct heartbeat_slot *heartbeat_create(void);
+
+/**
+ * Maps the watchdog's slot array. Client side.
+ * @return The HEARTBEAT_SLOTS slots, or NULL on error.
+ */
+struct heartbeat_slot *heartbeat_attach(void);
+
+/**
+ * Unmaps the slot array.
+ * @param slots The slots.
+ */
+void heartbeat_detach(struct heartbeat_slot *slots);
+
+/**
+ * Unmaps the slot array and removes it. Watchdog side.
+ * @param slots The slots.
+ */
+void heartbeat_destroy(struct heartbeat_slot *slots);
+
+/**
+ * Clears a slot for a new client. Watchdog side, before handing it out.
+ * @param slot The slot.
+ */
+void heartbeat_reset(struct heartbeat_slot *slot);
+
+/**
+ * Records a probe sent. The oldest unanswered one is kept.
+ * @param slot The client's slot.
+ * @param now_ns Its send time, CLOCK_MONOTONIC.
+ */
+void heartbeat_ping(struct heartbeat_slot *slot, uint64_t now_ns);
+
+/**
+ * Records a reply, which answers every probe outstanding, and adds its RTT
+ * to the estimate.
+ * @param slot The client's slot.
+ * @param now_ns Its arrival time, CLOCK_MONOTONIC.
+ * @param rtt_ns The probe's RTT, or 0 if it wasn't measured.
+ */
+void heartbeat_pong(struct heartbeat_slot *slot, uint64_t now_ns,
+                    uint64_t rtt_ns);
+
+/**
+ * Copies a slot, retrying while its client writes it.
+ * @param slot The slot.
+ * @param beat Where to store the copy.
+ */
+void heartbeat_read(const struct heartbeat_slot *slot, struct heartbeat *beat);
+
+#endif
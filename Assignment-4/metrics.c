@@ -0,0 +1,386 @@
+#define _GNU_SOURCE // accept4() and pipe2().
+
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+#define DEFAULT_HOST "127.0.0.1"
+#define REQUEST_LEN 4096
+#define CLIENT_TIMEOUT_S 2 // A scraper this slow is dropped.
+#define OUTPUT_BUFFER (64 * 1024)
+
+/**
+ * Upper bounds of the histogram buckets, in nanoseconds, the last +Inf.
+ */
+static const long long bucket_ns[METRICS_BUCKETS - 1] = {
+    100000,    250000,    500000,     1000000,    2500000,
+    5000000,   10000000,  25000000,   50000000,   100000000,
+    250000000, 500000000, 1000000000, 2500000000, 5000000000,
+};
+
+/**
+ * A counter family: its name and help text.
+ */
+static const char *const counter_names[METRICS_COUNTERS][2] = {
+    {"ping_probes_sent_total", "Probes sent."},
+    {"ping_replies_total", "Replies received within the timeout."},
+    {"ping_late_replies_total", "Replies received after the timeout."},
+    {"ping_duplicate_replies_total", "Replies to a probe already answered."},
+    {"ping_reordered_replies_total",
+     "Replies received after one to a later probe."},
+    {"ping_skipped_probes_total",
+     "Probes not sent because too many were outstanding."},
+};
+
+/**
+ * Adds to a counter with a plain load and store: it has one writer, and
+ * readers only need to see each value whole.
+ * @param counter The counter.
+ * @param n What to add.
+ */
+static void add(_Atomic uint64_t *counter, uint64_t n) {
+  uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+  atomic_store_explicit(counter, value + n, memory_order_relaxed);
+}
+
+int metrics_init(struct metrics *metrics, int count) {
+  memset(metrics, 0, sizeof(struct metrics));
+  metrics->listener = -1;
+  metrics->wakeup[0] = metrics->wakeup[1] = -1;
+  metrics->count = count;
+  metrics->targets = aligned_alloc(
+      64, ((count * sizeof(struct metrics_target) + 63) / 64) * 64);
+
+  if (metrics->targets == NULL) {
+    printf("Error : Metrics allocation failed.\n");
+    return -1;
+  }
+
+  memset(metrics->targets, 0, count * sizeof(struct metrics_target));
+  return 0;
+}
+
+void metrics_count(struct metrics_target *target,
+                   enum metrics_counter counter) {
+  add(&target->counters[counter], 1);
+}
+
+void metrics_observe(struct metrics_target *target, long long rtt_ns) {
+  int bucket = 0;
+
+  while (bucket < METRICS_BUCKETS - 1 && rtt_ns > bucket_ns[bucket]) {
+    bucket++;
+  }
+
+  add(&target->buckets[bucket], 1);
+  add(&target->rtt_sum_ns, rtt_ns);
+}
+
+/**
+ * Writes a target's label, escaped as the text format wants.
+ * @param out The response.
+ * @param name The target's name.
+ */
+static void write_label(FILE *out, const char *name) {
+  fputs("target=\"", out);
+  for (; *name != '\0'; name++) {
+    if (*name == '\\' || *name == '"') {
+      fputc('\\', out);
+      fputc(*name, out);
+    } else if (*name == '\n') {
+      fputs("\\n", out);
+    } else {
+      fputc(*name, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/**
+ * Writes every metric, one family at a time as the format requires. Stops
+ * early once a write fails, as when the client hung up (EPIPE, ECONNRESET)
+ * or stopped reading.
+ * @param metrics The metrics.
+ * @param out The response.
+ */
+static void render(const struct metrics *metrics, FILE *out) {
+  for (int c = 0; c < METRICS_COUNTERS && !ferror(out); c++) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", counter_names[c][0],
+            counter_names[c][1], counter_names[c][0]);
+
+    for (int i = 0; i < metrics->count && !ferror(out); i++) {
+      const struct metrics_target *target = &metrics->targets[i];
+
+      fprintf(out, "%s{", counter_names[c][0]);
+      write_label(out, target->name);
+      fprintf(out, "} %llu\n",
+              (unsigned long long)atomic_load_explicit(
+                  &target->counters[c], memory_order_relaxed));
+    }
+  }
+
+  fputs("# HELP ping_rtt_seconds Round-trip time of the replies within the "
+        "timeout.\n# TYPE ping_rtt_seconds histogram\n",
+        out);
+
+  for (int i = 0; i < metrics->count && !ferror(out); i++) {
+    const struct metrics_target *target = &metrics->targets[i];
+    uint64_t cumulative = 0;
+
+    // The count is the +Inf bucket as read here, so the two always agree
+    // even while replies come in.
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+      cumulative +=
+          atomic_load_explicit(&target->buckets[b], memory_order_relaxed);
+
+      fputs("ping_rtt_seconds_bucket{", out);
+      write_label(out, target->name);
+      if (b < METRICS_BUCKETS - 1) {
+        fprintf(out, ",le=\"%g\"} %llu\n", bucket_ns[b] / 1e9,
+                (unsigned long long)cumulative);
+      } else {
+        fprintf(out, ",le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+      }
+    }
+
+    fputs("ping_rtt_seconds_sum{", out);
+    write_label(out, target->name);
+    fprintf(out, "} %.9f\n",
+            atomic_load_explicit(&target->rtt_sum_ns, memory_order_relaxed) /
+                1e9);
+    fputs("ping_rtt_seconds_count{", out);
+    write_label(out, target->name);
+    fprintf(out, "} %llu\n", (unsigned long long)cumulative);
+  }
+}
+
+/**
+ * Answers one HTTP request: the metrics for GET /metrics (or /), 404 for
+ * anything else. The connection is closed after the response.
+ * @param metrics The metrics.
+ * @param client The connection.
+ */
+static void serve_client(const struct metrics *metrics, int client) {
+  char request[REQUEST_LEN];
+  int have = 0;
+
+  struct timeval timeout = {CLIENT_TIMEOUT_S, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  // Only the request line matters, but the headers are read up to the end
+  // so that closing doesn't reset the connection under them.
+  while (have < REQUEST_LEN - 1) {
+    ssize_t got = recv(client, request + have, REQUEST_LEN - 1 - have, 0);
+    if (got <= 0) {
+      close(client);
+      return;
+    }
+    have += got;
+    request[have] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL ||
+        strstr(request, "\n\n") != NULL) {
+      break;
+    }
+  }
+
+  FILE *out = fdopen(client, "w");
+  if (out == NULL) {
+    close(client);
+    return;
+  }
+  setvbuf(out, NULL, _IOFBF, OUTPUT_BUFFER);
+
+  if (strncmp(request, "GET /metrics ", 13) == 0 ||
+      strncmp(request, "GET / ", 6) == 0) {
+    fputs("HTTP/1.1 200 OK\r\n"
+          "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+          "Connection: close\r\n\r\n",
+          out);
+    render(metrics, out);
+  } else {
+    fputs("HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+          "Connection: close\r\n\r\nTry /metrics.\n",
+          out);
+  }
+
+  fclose(out);
+}
+
+/**
+ * The server thread: accepts scrapes one at a time until woken through the
+ * pipe.
+ * @param arg The metrics.
+ * @return NULL.
+ */
+static void *metrics_thread(void *arg) {
+  const struct metrics *metrics = arg;
+  struct pollfd fds[2] = {{metrics->listener, POLLIN, 0},
+                          {metrics->wakeup[0], POLLIN, 0}};
+
+  while (fds[1].revents == 0) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[0].revents == 0) {
+      continue;
+    }
+
+    int client = accept4(metrics->listener, NULL, NULL, SOCK_CLOEXEC);
+    if (client != -1) {
+      serve_client(metrics, client);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Opens the listening socket of an address.
+ * @param metrics The metrics, where a Unix socket's path is kept.
+ * @param address As given to metrics_serve().
+ * @return The socket, or -1 on error.
+ */
+static int open_listener(struct metrics *metrics, const char *address) {
+  int sock;
+
+  if (address[0] == '/' || address[0] == '.') {
+    struct sockaddr_un local;
+    struct stat st;
+
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    if (strlen(address) >= sizeof(local.sun_path)) {
+      printf("Error : Socket path too long: %s\n", address);
+      return -1;
+    }
+    strcpy(local.sun_path, address);
+
+    // A socket left by an earlier run is replaced; any other file isn't.
+    if (stat(address, &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(address);
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 ||
+        bind(sock, (struct sockaddr *)&local, sizeof(local)) == -1) {
+      perror("metrics socket");
+      if (sock != -1) {
+        close(sock);
+      }
+      return -1;
+    }
+    metrics->unix_path = strdup(address);
+  } else {
+    struct sockaddr_in local;
+    char host[INET_ADDRSTRLEN] = DEFAULT_HOST;
+    const char *port = strrchr(address, ':');
+    int reuse = 1;
+
+    if (port != NULL) {
+      snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+      port++;
+    } else {
+      port = address;
+    }
+
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(atoi(port));
+    if (atoi(port) <= 0 || atoi(port) > 65535 ||
+        inet_pton(AF_INET, host, &local.sin_addr) != 1) {
+      printf("Error : Bad metrics address: %s\n", address);
+      return -1;
+    }
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock != -1) {
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+    if (sock == -1 ||
+        bind(sock, (struct sockaddr *)&local, sizeof(local)) == -1) {
+      perror("metrics socket");
+      if (sock != -1) {
+        close(sock);
+      }
+      return -1;
+    }
+  }
+
+  if (listen(sock, SOMAXCONN) == -1) {
+    perror("listen");
+    close(sock);
+    return -1;
+  }
+
+  return sock;
+}
+
+int metrics_serve(struct metrics *metrics, const char *address) {
+  metrics->listener = open_listener(metrics, address);
+  if (metrics->listener == -1) {
+    return -1;
+  }
+
+  if (pipe2(metrics->wakeup, O_CLOEXEC) == -1) {
+    perror("pipe");
+    return -1;
+  }
+
+  // SIGINT, SIGTERM and SIGQUIT must keep going to the main thread, whose
+  // epoll_wait() they interrupt; the server thread starts with them
+  // blocked.
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+  sigaddset(&block, SIGQUIT);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  int failed = pthread_create(&metrics->thread, NULL, metrics_thread,
+                              metrics);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (failed != 0) {
+    printf("Error : The metrics thread couldn't be started.\n");
+    close(metrics->wakeup[0]);
+    close(metrics->wakeup[1]);
+    metrics->wakeup[0] = metrics->wakeup[1] = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+void metrics_free(struct metrics *metrics) {
+  if (metrics->wakeup[1] != -1) {
+    write(metrics->wakeup[1], "", 1);
+    pthread_join(metrics->thread, NULL);
+    close(metrics->wakeup[0]);
+    close(metrics->wakeup[1]);
+  }
+  if (metrics->listener != -1) {
+    close(metrics->listener);
+  }
+  if (metrics->unix_path != NULL) {
+    unlink(metrics->unix_path);
+    free(metrics->unix_path);
+  }
+  free(metrics->targets);
+}
@@ -0,0 +1,88 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * Prometheus metrics of a pinger.
+ *
+ * Each target has its counters and RTT histogram in a block of atomics
+ * with a single writer, the probing loop, which updates them with plain
+ * stores: no lock and no system call on the probe path. A thread of its
+ * own serves them in the Prometheus text format over HTTP, on a local TCP
+ * port or a Unix socket, reading the atomics while probing goes on, so a
+ * scrape never delays a probe or a reply.
+ */
+
+#define METRICS_BUCKETS 16 // RTT histogram buckets, the last one +Inf.
+
+enum metrics_counter {
+  METRICS_SENT,       // Probes sent.
+  METRICS_RECEIVED,   // Replies within the timeout.
+  METRICS_LATE,       // Replies after it.
+  METRICS_DUPLICATES, // Replies to a probe already answered.
+  METRICS_REORDERED,  // Replies that came after one to a later probe.
+  METRICS_SKIPPED,    // Probes not sent: too many outstanding.
+  METRICS_COUNTERS,
+};
+
+/**
+ * One target's metrics.
+ */
+struct metrics_target {
+  const char *name; // Its label; must outlive the server.
+  _Atomic uint64_t counters[METRICS_COUNTERS];
+  _Atomic uint64_t rtt_sum_ns;
+  _Atomic uint64_t buckets[METRICS_BUCKETS]; // Not cumulative.
+} __attribute__((aligned(64)));
+
+struct metrics {
+  struct metrics_target *targets;
+  int count;
+  int listener;    // -1 until metrics_serve().
+  int wakeup[2];   // A pipe the server thread is stopped through.
+  pthread_t thread;
+  char *unix_path; // The Unix socket to remove at the end, or NULL.
+};
+
+/**
+ * Allocates the metrics of every target, all zero and unnamed.
+ * @param metrics The metrics.
+ * @param count The number of targets.
+ * @return 0 on success, -1 on error.
+ */
+int metrics_init(struct metrics *metrics, int count);
+
+/**
+ * Starts serving the metrics, once every target is named.
+ * @param metrics The metrics.
+ * @param address A Unix socket path (starting with '/' or '.'), or
+ * [host:]port, the host 127.0.0.1 by default.
+ * @return 0 on success, -1 on error.
+ */
+int metrics_serve(struct metrics *metrics, const char *address);
+
+/**
+ * Adds one to a counter. Only the target's writer may call this.
+ * @param target The target's metrics.
+ * @param counter The counter.
+ */
+void metrics_count(struct metrics_target *target,
+                   enum metrics_counter counter);
+
+/**
+ * Adds an RTT to the histogram. Only the target's writer may call this.
+ * @param target The target's metrics.
+ * @param rtt_ns The RTT in nanoseconds.
+ */
+void metrics_observe(struct metrics_target *target, long long rtt_ns);
+
+/**
+ * Stops the server, if it runs, and frees the metrics.
+ * @param metrics The metrics.
+ */
+void metrics_free(struct metrics *metrics);
+
+#endif
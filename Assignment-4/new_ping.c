@@ -9,10 +9,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "checksum.h"
+#include "heartbeat.h"
+#include "timestamps.h"
+
 
 // run 2 programs using fork + exec
 // command: make clean && make all && ./partb
@@ -21,39 +29,128 @@
 #define WATCHDOG_IP "127.0.0.1"
 #define WATCHDOG_PORT 3000
 #define TRUE 1
+#define CONTROL_LEN 512
+#define DEFAULT_INTERVAL_MS 1000
+#define DEFAULT_TIMEOUT_MS 1000
+#define MAX_CLIENT_ADDR_LEN 16
+#define DEFAULT_WATCHDOG_MS 10000
+#define STALL_AFTER 5        // With -t, the probe after which we go quiet...
+#define STALL_MARGIN_MS 2000 // ...and by how much past the watchdog timeout.
 
 /**
- * Calculates the checksum for the given data.
- * @param p_address Pointer to the data.
- * @param len Length of the data.
- * @return The calculated checksum.
+ * Sets a timerfd to fire at an absolute CLOCK_MONOTONIC time.
+ * @param timer The timerfd.
+ * @param deadline The time in nanoseconds, in the past to fire right away.
+ * @return 0 on success, -1 on error.
  */
-unsigned short calculate_checksum(unsigned short *p_address, int len) {
-  int sum = 0;
-  unsigned short *w = p_address;
-  unsigned short answer = 0;
+int arm_timer(int timer, long long deadline) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
 
-  for (; len > 1; len -= 2) {
-    sum += *w++;
-  }
-  if (len == 1) {
-    *((unsigned char *)&answer) = *((unsigned char *)w);
-    sum += answer;
+  // A zero it_value would disarm the timer instead.
+  if (deadline <= 0) {
+    deadline = 1;
   }
-  sum = (sum >> 16) + (sum & 0xffff);
-  sum += (sum >> 16);
-  answer = ~sum;
 
-  return answer;
+  spec.it_value.tv_sec = deadline / 1000000000LL;
+  spec.it_value.tv_nsec = deadline % 1000000000LL;
+
+  return timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/**
+ * Reads CLOCK_MONOTONIC.
+ * @return The current time in nanoseconds.
+ */
+long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Reads the packets waiting on the raw socket until the reply to a request
+ * turns up. The raw socket sees every ICMP packet, our own requests
+ * included on loopback; the others are dropped.
+ * @param sock The raw socket.
+ * @param packet Where to store the packet.
+ * @param size Its size.
+ * @param control Where to store its control data, CONTROL_LEN bytes.
+ * @param request The ICMP header of the request, or NULL to drop
+ * everything.
+ * @param msg Set up for timestamps_rx() on the reply.
+ * @return The length of the reply, or 0 if it hasn't come.
+ */
+int read_reply(int sock, char *packet, int size, char *control,
+               const struct icmp *request, struct msghdr *msg) {
+  struct iovec iov = {packet, size};
+
+  while (1) {
+    memset(msg, 0, sizeof(struct msghdr));
+    msg->msg_iov = &iov;
+    msg->msg_iovlen = 1;
+    msg->msg_control = control;
+    msg->msg_controllen = CONTROL_LEN;
+
+    int bytes = (int)recvmsg(sock, msg, MSG_DONTWAIT);
+    if (bytes <= 0) {
+      return 0;
+    }
+
+    struct ip *iphdr = (struct ip *)packet;
+    struct icmp *reply = (struct icmp *)(packet + iphdr->ip_hl * 4);
+    if (request != NULL && bytes >= iphdr->ip_hl * 4 + ICMP_HDRLEN &&
+        reply->icmp_type == ICMP_ECHOREPLY &&
+        reply->icmp_id == request->icmp_id &&
+        reply->icmp_seq == request->icmp_seq) {
+      return bytes;
+    }
+  }
 }
 
 int main(int argc, char *strings[]) {
-  if (argc != 2) {
-    printf("usage: %s <addr>\n", strings[0]);
+  long long interval_ms = DEFAULT_INTERVAL_MS;
+  long long timeout_ms = DEFAULT_TIMEOUT_MS;
+  const char *watchdog_ms = NULL;
+  int stall = 0;
+  int opt;
+
+  while ((opt = getopt(argc, strings, "i:W:T:t")) != -1) {
+    if (opt == 'i') {
+      interval_ms = atoll(optarg);
+    } else if (opt == 'W') {
+      timeout_ms = atoll(optarg);
+    } else if (opt == 'T') {
+      watchdog_ms = optarg;
+    } else if (opt == 't') {
+      stall = 1;
+    } else {
+      interval_ms = -1;
+    }
+  }
+
+  long long stall_ms =
+      (watchdog_ms != NULL ? atoll(watchdog_ms) : DEFAULT_WATCHDOG_MS) +
+      STALL_MARGIN_MS;
+
+  if (interval_ms <= 0 || timeout_ms <= 0 || stall_ms <= STALL_MARGIN_MS ||
+      argc - optind != 1) {
+    printf("usage: %s [-i interval_ms] [-W timeout_ms] [-T watchdog_ms] [-t] "
+           "<addr>\n"
+           "-T is the watchdog's timeout, %d ms by default.\n"
+           "-t goes quiet for %d ms past it after %d probes, to test the "
+           "watchdog.\n",
+           strings[0], DEFAULT_WATCHDOG_MS, STALL_MARGIN_MS, STALL_AFTER);
     exit(0);
   }
 
-  int tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
+  // The host is the only argument left, where the code below expects it.
+  strings[1] = strings[optind];
+
+  // Not inherited by the watchdog: it would keep the connection open after
+  // we close it, and the watchdog would never see us leave.
+  int tcp_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
   if (tcp_socket == -1) {
     printf("Socket not created: %d\n", errno);
   }
@@ -67,14 +164,24 @@ int main(int argc, char *strings[]) {
   if (ip_addr < 1)
     printf("inet_pton() failed %d: ", errno);
 
-  struct hostent *hname;
-  hname = gethostbyname(strings[1]);
+  struct addrinfo hints;
+  struct addrinfo *result = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_RAW;
+  hints.ai_protocol = IPPROTO_ICMP;
+
+  int status = getaddrinfo(strings[1], NULL, &hints, &result);
+  if (status != 0 || result == NULL) {
+    printf("Error : Couldn't resolve %s: %s\n", strings[1],
+           gai_strerror(status));
+    return -1;
+  }
 
   struct sockaddr_in dest_addr;
-  bzero(&dest_addr, sizeof(dest_addr));
-  dest_addr.sin_family = AF_INET;
+  memcpy(&dest_addr, result->ai_addr, sizeof(dest_addr));
   dest_addr.sin_port = 0;
-  dest_addr.sin_addr.s_addr = *(long *)hname->h_addr;
+  freeaddrinfo(result);
 
   int raw_socket = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
   if (raw_socket < 0) {
@@ -89,97 +196,212 @@ int main(int argc, char *strings[]) {
     return -1;
   }
 
-  char *args[2];
+  if (timestamps_enable(raw_socket, NULL) == -1) {
+    return -1;
+  }
+
+  // Probes go out on an absolute schedule and each reply has a deadline,
+  // both set on one timerfd watched along with the raw socket and the
+  // watchdog connection.
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (timer == -1 || epoll_fd == -1) {
+    perror("timerfd/epoll");
+    return -1;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = raw_socket;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, raw_socket, &event);
+  event.data.fd = timer;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer, &event);
+
+  char *args[4];
   args[0] = "./watchdog";
-  args[1] = NULL;
+  args[1] = watchdog_ms != NULL ? "-T" : NULL;
+  args[2] = (char *)watchdog_ms;
+  args[3] = NULL;
   int pid = fork();
 
   if (pid == 0) {
-    // printf("In child\n");
     execvp(args[0], args);
-  } else {
-    sleep(2);
-    int connection_status = connect(
-        tcp_socket, (struct sockaddr *)&watchdog_addr, sizeof(watchdog_addr));
-    if (connection_status == -1) {
-      printf("Socket not connected: %d", errno);
-    }
+    perror("execvp");
+    exit(1);
+  }
 
-    int flag = 0;
-    while (!flag) {
-      recv(tcp_socket, &flag, 1, 0);
+  sleep(2);
+  int connection_status = connect(
+      tcp_socket, (struct sockaddr *)&watchdog_addr, sizeof(watchdog_addr));
+  if (connection_status == -1) {
+    printf("Socket not connected: %d\n", errno);
+    return -1;
+  }
+
+  // The go-ahead byte, then the index of our heartbeat slot.
+  char hello[1 + sizeof(uint32_t)];
+  if (recv(tcp_socket, hello, sizeof(hello), MSG_WAITALL) !=
+      (ssize_t)sizeof(hello)) {
+    printf("Watchdog closed the connection.\n");
+    return -1;
+  }
+
+  uint32_t slot_index;
+  memcpy(&slot_index, hello + 1, sizeof(slot_index));
+  struct heartbeat_slot *slots = heartbeat_attach();
+  if (slots == NULL || slot_index >= HEARTBEAT_SLOTS) {
+    printf("Error : No heartbeat slot.\n");
+    return -1;
+  }
+  struct heartbeat_slot *slot = &slots[slot_index];
+
+  char dest_ip[MAX_CLIENT_ADDR_LEN];
+  memset(dest_ip, 0, sizeof(dest_ip));
+  inet_ntop(AF_INET, &dest_addr.sin_addr, dest_ip, sizeof(dest_ip));
+  send(tcp_socket, dest_ip, sizeof(dest_ip), 0);
+
+  // From here on probes and replies are recorded in the slot, with no
+  // system call; the watchdog only speaks up to say we timed out, or by
+  // closing the connection.
+  event.data.fd = tcp_socket;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tcp_socket, &event);
+
+  char data[] = "Ping.\n";
+  int data_length = (int)sizeof(data);
+  char packet[IP_MAXPACKET];
+  char control[CONTROL_LEN];
+  int seq = 0;
+
+  // The request is built once; each probe only changes its sequence
+  // number, and the checksum is updated for that alone.
+  struct icmp icmphdr;
+  char request[ICMP_HDRLEN + sizeof(data)];
+  memset(&icmphdr, 0, ICMP_HDRLEN);
+  icmphdr.icmp_type = ICMP_ECHO;
+  icmphdr.icmp_code = 0;
+  icmphdr.icmp_id = 18;
+  icmphdr.icmp_seq = 0;
+  icmphdr.icmp_cksum = 0;
+  memcpy(request, &icmphdr, ICMP_HDRLEN);
+  memcpy(request + ICMP_HDRLEN, data, data_length);
+  icmphdr.icmp_cksum = inet_checksum(request, sizeof(request));
+
+  // One probe is outstanding at a time; it is given up on at its reply
+  // deadline or when the next one is due, whichever comes first. Both are
+  // absolute times set on the timerfd, so nothing here ever blocks.
+  long long interval_ns = interval_ms * 1000000LL;
+  long long timeout_ns = timeout_ms * 1000000LL;
+  long long next_send = now_ns();
+  long long sent_ns = 0;
+  long long reply_deadline = 0; // 0: no probe outstanding.
+  struct timeval start, end;
+  int running = TRUE;
+
+  while (running) {
+    long long now = now_ns();
+
+    if (reply_deadline != 0 && (now >= reply_deadline || now >= next_send)) {
+      printf("Request timeout for Seq = %d\n", seq);
+      reply_deadline = 0;
     }
 
-    send(tcp_socket, strings[1], sizeof(strings[1]), 0);
-    char data[IP_MAXPACKET] = "Ping.\n";
-    int data_length = (int)strlen(data) + 1;
-    char packet[IP_MAXPACKET];
-    int seq = 0;
-    struct timeval start, end;
-    char ping_status[5];
-    // to check watchdog
-    int counter = 0;
-
-    while (TRUE) {
-      counter++;
-      struct icmp icmphdr;
-      icmphdr.icmp_type = ICMP_ECHO;
-      icmphdr.icmp_code = 0;
-      icmphdr.icmp_id = 18;
-      icmphdr.icmp_seq = seq++;
-      icmphdr.icmp_cksum = 0;
-
-      bzero(packet, IP_MAXPACKET);
-      memcpy((packet), &icmphdr, ICMP_HDRLEN);
-      memcpy(packet + ICMP_HDRLEN, data, data_length);
-      icmphdr.icmp_cksum = calculate_checksum((unsigned short *)(packet),
-                                              ICMP_HDRLEN + data_length);
-      memcpy((packet), &icmphdr, ICMP_HDRLEN);
+    if (now >= next_send) {
+      // Slots missed while stalled are skipped rather than sent in a burst.
+      while (next_send <= now) {
+        next_send += interval_ns;
+      }
+
+      uint16_t old_seq = icmphdr.icmp_seq;
+      icmphdr.icmp_seq = ++seq;
+      icmphdr.icmp_cksum = inet_checksum_update(
+          icmphdr.icmp_cksum, &old_seq, &icmphdr.icmp_seq, sizeof(old_seq));
+      memcpy(request, &icmphdr, ICMP_HDRLEN);
 
       gettimeofday(&start, 0);
-      sendto(raw_socket, packet, ICMP_HDRLEN + data_length, 0,
+      sent_ns = now;
+      sendto(raw_socket, request, sizeof(request), 0,
              (struct sockaddr *)&dest_addr, sizeof(dest_addr));
+      heartbeat_ping(slot, sent_ns);
+      reply_deadline = sent_ns + timeout_ns;
+
+      // To check the watchdog: go quiet long enough for it to notice.
+      if (stall && seq == STALL_AFTER) {
+        struct timespec quiet = {stall_ms / 1000, stall_ms % 1000 * 1000000};
+        nanosleep(&quiet, NULL);
+      }
+    }
+
+    arm_timer(timer, reply_deadline != 0 && reply_deadline < next_send
+                         ? reply_deadline
+                         : next_send);
 
-      strcpy(ping_status, "ping");
-      send(tcp_socket, ping_status, sizeof(ping_status), 0);
-
-      // to check watchdog
-      if (counter > 5)
-        sleep(10);
-      //
-      bzero(packet, IP_MAXPACKET);
-      int reply_pid = fork();
-
-      if (reply_pid == 0) {
-        recv(tcp_socket, &packet, sizeof(packet), 0);
-        if (strcmp("Timeout", packet) == 0) {
-          printf("Received timeout.\n");
-          int my_pid = getppid();
-          kill(my_pid, SIGTERM);
-          exit(0);
+    struct epoll_event events[3];
+    int ready = epoll_wait(epoll_fd, events, 3, -1);
+
+    for (int i = 0; i < ready; i++) {
+      int fd = events[i].data.fd;
+
+      if (fd == timer) {
+        uint64_t expirations;
+        read(timer, &expirations, sizeof(expirations));
+      } else if (fd == tcp_socket) {
+        char status[MAX_CLIENT_ADDR_LEN];
+        int bytes = (int)recv(tcp_socket, status, sizeof(status) - 1, 0);
+
+        if (bytes <= 0) {
+          printf("Watchdog closed the connection.\n");
+          running = 0;
+        } else {
+          status[bytes] = '\0';
+          if (strstr(status, "Timeout") != NULL) {
+            printf("Received timeout.\n");
+            running = 0;
+          }
         }
       } else {
-        socklen_t length = sizeof(dest_addr);
+        // Anything that isn't the reply to the outstanding probe is dropped.
+        struct msghdr msg;
         int bytes_received =
-            (int)recvfrom(raw_socket, packet, sizeof(packet), 0,
-                          (struct sockaddr *)&dest_addr, &length);
-        if (bytes_received > 0) {
-          gettimeofday(&end, 0);
-
-          strcpy(ping_status, "pong");
-          send(tcp_socket, ping_status, sizeof(ping_status), 0);
-
-          float time = (float)(end.tv_sec - start.tv_sec) * 1000.0f +
-                       (float)(end.tv_usec - start.tv_usec) / 1000.0f;
-          printf("Ping returned: %d bytes from IP = %s, Seq = %d, time = %.3f "
-                 "ms\n",
-                 bytes_received, strings[1], seq, time);
-          sleep(1);
+            read_reply(raw_socket, packet, sizeof(packet), control,
+                       reply_deadline != 0 ? &icmphdr : NULL, &msg);
+        if (bytes_received <= 0) {
+          continue;
         }
+
+        gettimeofday(&end, 0);
+        reply_deadline = 0;
+
+        // Kernel timestamps leave out our own scheduling delays; the
+        // request's TX stamp is the last one queued.
+        struct kernel_timestamp tx, rx, stamp;
+        unsigned int index;
+        memset(&tx, 0, sizeof(tx));
+        while (timestamps_tx(raw_socket, &index, &stamp) == 0) {
+          tx = stamp;
+        }
+        timestamps_rx(&msg, &rx);
+
+        long long rtt = timestamps_diff(&tx, &rx);
+        if (rtt < 0) {
+          rtt = (end.tv_sec - start.tv_sec) * 1000000000LL +
+                (end.tv_usec - start.tv_usec) * 1000LL;
+        }
+        heartbeat_pong(slot, now_ns(), rtt);
+
+        printf("Ping returned: %d bytes from IP = %s, Seq = %d, time = "
+               "%lld.%06lld ms\n",
+               bytes_received, strings[1], seq, rtt / 1000000,
+               rtt % 1000000);
       }
     }
-    close(tcp_socket);
-    close(raw_socket);
   }
+
+  close(epoll_fd);
+  close(timer);
+  heartbeat_detach(slots);
+  close(tcp_socket);
+  close(raw_socket);
+  waitpid(pid, NULL, 0);
+
   return 0;
-}
\ No newline at end of file
+}
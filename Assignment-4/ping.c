@@ -1,126 +1,2451 @@
+#define _GNU_SOURCE // sendmmsg() and recvmmsg().
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "checksum.h"
+#include "metrics.h"
+#include "resolver.h"
+#include "timestamps.h"
+#include "tsdb.h"
+
 
 #define ICMP_HDRLEN 8
 #define TRUE 1
+#define MAX_NAME_LEN 256
+#define DEFAULT_INTERVAL_MS 1000
+#define RECV_BUFFER_BYTES (4 * 1024 * 1024) // Room for replies of a round.
+#define TX_RING 4096 // Sends whose TX timestamp may still be unread.
+#define CONTROL_LEN 512
+#define SEND_BATCH 64   // Probes handed to the kernel per sendmmsg().
+#define RECV_BATCH 64   // Packets read per recvmmsg().
+#define RECV_SLOT 2048  // Bytes kept of each packet, unless sweeping sizes.
+#define PROBE_DATA "This is the ping.\n" // Repeated to fill larger probes.
+#define PROBE_SIZE (sizeof(struct probe_payload) + sizeof(PROBE_DATA))
+#define MAX_PAYLOAD (IP_MAXPACKET - sizeof(struct ip) - ICMP_HDRLEN)
+#define MAX_SWEEP_SIZES 4096
+#define MAX_HOPS 255 // Highest TTL a path discovery can probe.
+#define TTL_CONTROL_LEN CMSG_SPACE(sizeof(int))
+#define PROBE_MAGIC 0x50524f42  // "PROB"
+#define MAX_OUTSTANDING 65536   // Must be a power of two.
+#define DEFAULT_TIMEOUT_MS 2000 // After this a reply is late, the probe lost.
+#define DUP_WINDOW 64           // Probes per target checked for duplicates.
+#define RESOLVER_THREADS 32 // Name lookups in flight at once.
+#define DNS_TTL_S 300       // How long a resolved address is trusted.
+#define HISTORY_FLUSH_S 10  // Sealed history blocks wait at most this long.
+#define HIST_SUB_BITS 4 // 16 buckets per power of two: at most 6.25% error.
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 27 // RTTs up to 2^27 us (134 s); longer ones are capped.
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
 
 /**
- * Calculates the checksum for the given data.
- * @param p_address Pointer to the data.
- * @param len Length of the data.
- * @return The calculated checksum.
+ * Streaming RTT statistics of one target, in constant memory and updated in
+ * O(1) per reply. The histogram is log-linear like an HDR histogram: RTTs
+ * in microseconds, exact below HIST_SUB_BUCKETS and then HIST_SUB_BUCKETS
+ * equal buckets per power of two.
  */
-unsigned short calculate_checksum(unsigned short *p_address, int len) {
-  int sum = 0;
-  unsigned short *w = p_address;
-  unsigned short answer = 0;
+struct rtt_stats {
+  int samples;
+  long long min_ns;
+  long long max_ns;
+  double mean_ns;       // Welford's running mean...
+  double m2;            // ...and sum of squared deviations from it.
+  long long last_ns;    // RTT of the previous reply.
+  long long jitter_x16; // RFC 3550 interarrival jitter, times 16, in ns.
+  uint32_t histogram[HIST_BUCKETS];
+};
 
-  for (; len > 1; len -= 2) {
-    sum += *w++;
-  }
-  if (len == 1) {
-    *((unsigned char *)&answer) = *((unsigned char *)w);
-    sum += answer;
-  }
+/**
+ * What every echo request carries, and every genuine reply echoes back.
+ */
+struct probe_payload {
+  uint32_t magic;
+  uint32_t probe;  // ID of the probe, unique for the run.
+  int64_t sent_ns; // CLOCK_MONOTONIC time it was sent.
+  uint16_t seq;    // Its sequence number, where no ICMP header carries it.
+};
+
+/**
+ * The ICMP payload sizes probes cycle through, each target's probes taking
+ * them in turn: PROBE_SIZE alone normally, a range with -S.
+ */
+struct size_sweep {
+  int min;      // Bytes after the ICMP header, probe_payload included.
+  int step;
+  int count;    // Sizes min, min + step, ...
+  int fragment; // Oversized probes are fragmented rather than sent with DF.
+};
 
-  sum = (sum >> 16) + (sum & 0xffff);
-  sum += (sum >> 16);
-  answer = ~sum;
+/**
+ * The replies to the probes of one size in a sweep.
+ */
+struct size_stats {
+  int sent;
+  int received;
+  int rejected; // Refused by our own kernel (EMSGSIZE): over the known MTU.
+  struct rtt_stats stats;
+};
 
-  return answer;
-}
+/**
+ * What answered the probes sent with one TTL in a path discovery: a router's
+ * Time Exceeded, or the target's own reply once the TTL reaches it.
+ */
+struct hop {
+  struct in_addr address; // The last to answer, 0.0.0.0 if none has yet.
+  int changes;            // Answers from another address than the last.
+  int sent;
+  int received;
+  struct rtt_stats stats;
+};
+
+enum target_state {
+  TARGET_RESOLVING, // Its first lookup is running.
+  TARGET_RESOLVED,  // Being probed, in the address index.
+  TARGET_FAILED,    // Didn't resolve; looked up again now and then.
+  TARGET_DUPLICATE, // Same address as another target, not probed.
+};
+
+/**
+ * One host being pinged.
+ */
+struct target {
+  char name[MAX_NAME_LEN]; // As given on the command line or in the file.
+  enum target_state state;
+  long long expires_ns; // When to look the name up again, 0 for never.
+  int refreshing;       // A lookup is running.
+  struct sockaddr_in address;
+  uint16_t seq;      // Sequence number of the last probe sent.
+  uint64_t answered; // Bit i set: probe seq - i was answered.
+  int queued;        // Every probe sent, a path discovery's hops included.
+  int sent;          // Those aimed at the target, which its loss counts.
+  int received;
+  int late;       // Replies that came after the reply timeout.
+  int duplicates; // Replies to a probe already answered.
+  int skipped;    // Probes not sent because too many were outstanding.
+  int reordered;  // Replies that came after one to a later probe.
+  uint16_t highest_answered; // Latest probe answered so far.
+  struct rtt_stats stats;
+  struct size_stats *sizes; // Per size of a sweep, NULL if there is none.
+  struct hop *hops;         // Per TTL of a path discovery, NULL if none.
+  int ttl_limit;            // Highest TTL probed: the target's distance.
+  struct metrics_target *metrics; // Its exported counters and histogram.
+  int series; // Its series in the history store, if there is one.
+  int next; // Next target in the same hash bucket, -1 if none.
+};
+
+/**
+ * Every target, indexed by IPv4 address.
+ */
+struct target_table {
+  struct target *targets;
+  int count;
+  int capacity;
+  int resolved; // Targets in the index.
+  int *buckets; // First target of each bucket, -1 if none.
+  int mask;     // Number of buckets - 1, a power of two minus one.
+  struct size_sweep sweep;
+  int max_hops; // TTLs probed each round in a path discovery, 0 if none.
+  int protocol; // IPPROTO_ICMP (echo), IPPROTO_TCP (connect) or IPPROTO_UDP.
+  int port;     // The TCP or UDP port probed.
+  struct tsdb *history; // Where every probe's result goes, or NULL.
+  long long wall_offset_ns; // CLOCK_REALTIME - CLOCK_MONOTONIC, at start.
+};
+
+/**
+ * An echo request waiting for its reply.
+ */
+struct probe {
+  int target;                 // Index of the target, -1 if the slot is free.
+  uint16_t seq;               // Its ICMP sequence number.
+  uint32_t id;                // Its probe ID.
+  int size;                   // Index of its payload size in the sweep.
+  int ttl;                    // Its TTL in a path discovery, 0 otherwise.
+  int counted;                // In the target's sent; not a shorter TTL.
+  int fd;                     // Its socket if it is a TCP connect, or -1.
+  long long sent_ns;          // CLOCK_MONOTONIC time it was sent.
+  struct kernel_timestamp tx; // Kernel TX timestamp.
+  int next; // Next probe in the same hash bucket, -1 if none.
+};
+
+/**
+ * The outstanding probes, stored by probe ID modulo MAX_OUTSTANDING and
+ * indexed by (target, seq) for the replies. All probes share one timeout,
+ * so they expire in the order they were sent.
+ */
+struct probe_table {
+  struct probe *probes;
+  int *buckets;         // First probe of each bucket, -1 if none.
+  uint32_t next_id;     // ID of the next probe sent.
+  uint32_t oldest_id;   // No probe older than this is outstanding.
+  int outstanding;
+  long long timeout_ns; // How long a probe waits for its reply.
+  unsigned int sends;   // Packets sent, the index of the next TX stamp.
+  uint32_t *tx_ring;    // Probe ID of each of the last TX_RING sends.
+  void (*on_lost)(const struct probe *, void *); // Called on each loss...
+  void *lost_arg;                                // ...with this, if set.
+};
+
+/**
+ * Echo requests waiting to go out with one sendmmsg(). Every slot holds a
+ * complete request built once from the template; queuing a probe only
+ * patches its sequence number, probe ID and send time and updates the
+ * checksum incrementally.
+ */
+struct send_ring {
+  unsigned char *template; // With a 0 sequence number and payload.
+  uint16_t *cksums;        // Of the template cut to each size of the sweep.
+  int packet_len;          // Room for the largest request.
+  unsigned char *packets;  // SEND_BATCH requests, packet_len bytes apart.
+  char (*controls)[TTL_CONTROL_LEN]; // IP_TTL of each, in a path discovery.
+  struct iovec *iovs;
+  struct mmsghdr *msgs;
+  uint32_t *probe_ids; // Probe ID of each queued request.
+  int queued;
+};
+
+/**
+ * Buffers for reading up to RECV_BATCH packets with one recvmmsg().
+ */
+struct recv_ring {
+  int datagram; // Packets start at the ICMP header, the sender in names.
+  int slot;     // Room for each packet.
+  char *packets;
+  char (*controls)[CONTROL_LEN];
+  struct sockaddr_in *names;
+  struct iovec *iovs;
+  struct mmsghdr *msgs;
+};
+
+static volatile sig_atomic_t stop = 0;
+static volatile sig_atomic_t report = 0;
+
+/**
+ * Appends a host to the table. An address is used as is; a name is left
+ * for the resolver.
+ * @param table The table.
+ * @param name The host name or address.
+ * @return 0 on success, -1 on error.
+ */
+int target_add(struct target_table *table, const char *name);
+
+/**
+ * Reads targets from a file, one per line. Blank lines and lines starting
+ * with '#' are skipped.
+ * @param table The table.
+ * @param path The file, or "-" for stdin.
+ * @return 0 on success, -1 if the file can't be read.
+ */
+int target_load(struct target_table *table, const char *path);
+
+/**
+ * Builds the address index of the table, once every target was added, and
+ * adds the targets that already have an address to it. With a size sweep
+ * or a path discovery, also allocates each target's per-size or per-hop
+ * statistics.
+ * @param table The table.
+ * @return 0 on success, -1 on error.
+ */
+int target_index(struct target_table *table);
+
+/**
+ * Gives a target its (new) address and puts it in the index, unless
+ * another target already has that address.
+ * @param table The table.
+ * @param target The target, in the table.
+ * @param address The address.
+ */
+void target_set_address(struct target_table *table, struct target *target,
+                        struct in_addr address);
+
+/**
+ * Finds the target a reply came from.
+ * @param table The table.
+ * @param address The source address of the reply.
+ * @return The target, or NULL if the address isn't one of ours.
+ */
+struct target *target_find(const struct target_table *table,
+                           struct in_addr address);
+
+/**
+ * Allocates an empty probe table.
+ * @param probes The table.
+ * @param timeout_ms How long a probe waits for its reply.
+ * @return 0 on success, -1 on error.
+ */
+int probe_init(struct probe_table *probes, long long timeout_ms);
+
+/**
+ * Records a probe about to be sent, making room by giving up on the oldest
+ * probe if MAX_OUTSTANDING are already in flight.
+ * @param probes The table.
+ * @param target The index of the target.
+ * @param seq The probe's sequence number.
+ * @param now The current time in nanoseconds.
+ * @return The probe.
+ */
+struct probe *probe_add(struct probe_table *probes, int target, uint16_t seq,
+                        long long now);
+
+/**
+ * Finds the outstanding probe a reply answers.
+ * @param probes The table.
+ * @param target The index of the target the reply came from.
+ * @param seq The reply's sequence number.
+ * @return The probe, or NULL if none is outstanding.
+ */
+struct probe *probe_find(const struct probe_table *probes, int target,
+                         uint16_t seq);
+
+/**
+ * Removes a probe from the table, closing its socket if it has one.
+ * @param probes The table.
+ * @param probe The probe.
+ */
+void probe_remove(struct probe_table *probes, struct probe *probe);
+
+/**
+ * Gives up on every probe whose reply timeout has passed.
+ * @param probes The table.
+ * @param now The current time in nanoseconds.
+ * @return When the oldest remaining probe expires, or 0 if there is none.
+ */
+long long probe_expire(struct probe_table *probes, long long now);
+
+/**
+ * Stores a probe that went unanswered in the history, as a NaN RTT: the
+ * probe table's on_lost callback. Only probes counted as sent to the
+ * target count, not those of a path discovery's shorter TTLs.
+ * @param probe The probe, given up on.
+ * @param arg The targets.
+ */
+void record_loss(const struct probe *probe, void *arg);
+
+/**
+ * Applies the result of a name lookup to its target. A name that doesn't
+ * resolve the first time is reported; one that fails later keeps its
+ * address.
+ * @param table The targets.
+ * @param result The result, tagged with the index of the target.
+ */
+void handle_lookup(struct target_table *table,
+                   const struct resolver_result *result);
+
+/**
+ * Opens the socket probes are sent and replies read on.
+ *
+ * UDP probes go out on one datagram socket. TCP probes have a socket each,
+ * so an epoll instance watching them all stands in for the socket.
+ *
+ * A raw socket sees a copy of every ICMP packet the host receives, so a
+ * BPF filter is attached that lets only echo replies with our identifier,
+ * and Time Exceeded messages quoting one of our requests, through. A
+ * datagram ICMP socket ("ping socket") needs no privileges and is only
+ * handed the replies to its own requests: the kernel sets their identifier
+ * to the socket's port and demultiplexes on it.
+ * @param protocol IPPROTO_ICMP, IPPROTO_TCP or IPPROTO_UDP.
+ * @param datagram Open a datagram ICMP socket rather than a raw one.
+ * @param id Our ICMP identifier; for a datagram socket, the one to ask for,
+ * replaced by the one the kernel assigned.
+ * @return The socket, or -1 on error.
+ */
+int open_socket(int protocol, int datagram, uint16_t *id);
+
+/**
+ * Allocates the send and receive rings and builds the request template,
+ * large enough for every size of the sweep.
+ * @param ring The send ring.
+ * @param replies The receive ring.
+ * @param id Our ICMP identifier.
+ * @param datagram The socket is a datagram socket.
+ * @param sweep The payload sizes.
+ * @return 0 on success, -1 on error.
+ */
+int ring_init(struct send_ring *ring, struct recv_ring *replies, uint16_t id,
+              int datagram, const struct size_sweep *sweep);
+
+/**
+ * Queues the next echo request (or UDP request) to a target, with the next
+ * payload size of the sweep, sending the batch when full. A TCP probe's
+ * connection is started right away instead.
+ * @param sock The ICMP socket.
+ * @param ring The send ring.
+ * @param table The targets.
+ * @param probes The outstanding probes.
+ * @param target The target, in the table.
+ * @param ttl The TTL to send it with, or 0 for the socket's.
+ * @param now The current time in nanoseconds.
+ * @return 0 on success, -1 on error.
+ */
+int queue_probe(int sock, struct send_ring *ring, struct target_table *table,
+                struct probe_table *probes, struct target *target, int ttl,
+                long long now);
+
+/**
+ * Sends every queued echo request. A request the kernel refuses as larger
+ * than the MTU is counted as rejected and forgotten.
+ * @param sock The ICMP socket.
+ * @param ring The send ring.
+ * @param table The targets.
+ * @param probes The outstanding probes.
+ * @return 0 on success, -1 on error.
+ */
+int flush_probes(int sock, struct send_ring *ring, struct target_table *table,
+                 struct probe_table *probes);
+
+/**
+ * Reads and handles every packet waiting on the socket.
+ * @param sock The ICMP socket.
+ * @param replies The receive ring.
+ * @param table The targets.
+ * @param probes The outstanding probes.
+ * @param id Our ICMP identifier.
+ * @param quiet Don't print a line per reply.
+ */
+void read_replies(int sock, struct recv_ring *replies,
+                  struct target_table *table, struct probe_table *probes,
+                  uint16_t id, int quiet);
+
+/**
+ * Hands every TX timestamp waiting in the socket's error queue to the probe
+ * it belongs to.
+ * @param sock The ICMP socket.
+ * @param probes The outstanding probes.
+ */
+void collect_tx_timestamps(int sock, struct probe_table *probes);
+
+/**
+ * Validates a received packet and matches it to the probe it answers:
+ * it must be an intact echo reply with our identifier, from one of our
+ * targets, carrying our payload. A reply to an outstanding probe is timed
+ * with the kernel's timestamps when both ends have one of a kind and with
+ * CLOCK_MONOTONIC otherwise; late replies are timed from the send time in
+ * their payload, and duplicates are counted but not timed.
+ * @param table The targets.
+ * @param probes The outstanding probes.
+ * @param from Its source address.
+ * @param packet The ICMP message, without the IP header.
+ * @param len Its length.
+ * @param id Our ICMP identifier.
+ * @param now When it was received, in nanoseconds.
+ * @param rx The kernel's RX timestamps of the packet.
+ * @param quiet Don't print a line per reply.
+ * @return 0 if it was one of our replies, -1 otherwise.
+ */
+int handle_reply(struct target_table *table, struct probe_table *probes,
+                 struct in_addr from, const char *packet, int len,
+                 uint16_t id, long long now,
+                 const struct kernel_timestamp *rx, int quiet);
+
+/**
+ * Validates a UDP reply and matches it to the probe it answers: it must
+ * come from one of our targets' probed port and echo the whole request,
+ * whose payload gives the sequence number. It is then timed and counted as
+ * an echo reply is.
+ * @param table The targets.
+ * @param probes The outstanding probes.
+ * @param from Its source address and port.
+ * @param packet The UDP payload.
+ * @param len Its length.
+ * @param now When it was received, in nanoseconds.
+ * @param rx The kernel's RX timestamps of the packet.
+ * @param quiet Don't print a line per reply.
+ * @return 0 if it was one of our replies, -1 otherwise.
+ */
+int handle_datagram(struct target_table *table, struct probe_table *probes,
+                    const struct sockaddr_in *from, const char *packet,
+                    int len, long long now, const struct kernel_timestamp *rx,
+                    int quiet);
+
+/**
+ * Starts a TCP probe: a non-blocking connect() to the target's port, on a
+ * socket of the probe's own that the epoll instance watches.
+ * @param connects The epoll instance.
+ * @param target The target.
+ * @param probe The probe, which keeps the socket.
+ * @return 0 on success, -1 if the SYN couldn't be sent.
+ */
+int start_connect(int connects, struct target *target, struct probe *probe);
+
+/**
+ * Finishes every TCP probe whose handshake is over. A SYN-ACK is timed by
+ * the kernel's own RTT sample of the handshake (TCP_INFO), a reset
+ * (connection refused) from the send time; both count as replies, and any
+ * other error as a loss. The socket is then closed with a reset.
+ * @param connects The epoll instance.
+ * @param table The targets.
+ * @param probes The outstanding probes.
+ * @param quiet Don't print a line per reply.
+ */
+void read_connects(int connects, struct target_table *table,
+                   struct probe_table *probes, int quiet);
+
+/**
+ * Matches a Time Exceeded message to the probe whose TTL ran out, through
+ * the IP and ICMP headers of the request it quotes: the destination is the
+ * target, then our identifier and the sequence number give the probe. The
+ * router that sent it is that probe's hop, and the probe is timed like a
+ * reply.
+ * @param table The targets.
+ * @param probes The outstanding probes.
+ * @param from The router's address.
+ * @param packet The ICMP message, without the IP header.
+ * @param len Its length.
+ * @param id Our ICMP identifier.
+ * @param now When it was received, in nanoseconds.
+ * @param rx The kernel's RX timestamps of the packet.
+ * @param quiet Don't print a line per hop.
+ * @return 0 if it was about one of our probes, -1 otherwise.
+ */
+int handle_hop(struct target_table *table, struct probe_table *probes,
+               struct in_addr from, const char *packet, int len, uint16_t id,
+               long long now, const struct kernel_timestamp *rx, int quiet);
+
+/**
+ * Sets a timerfd to fire at an absolute CLOCK_MONOTONIC time.
+ * @param timer The timerfd.
+ * @param deadline The time in nanoseconds, in the past to fire right away.
+ * @return 0 on success, -1 on error.
+ */
+int arm_timer(int timer, long long deadline);
+
+/**
+ * Adds an RTT to a target's statistics.
+ * @param stats The statistics.
+ * @param rtt The RTT in nanoseconds.
+ */
+void stats_add(struct rtt_stats *stats, long long rtt);
+
+/**
+ * Estimates a quantile from the histogram.
+ * @param stats The statistics, with at least one sample.
+ * @param quantile The quantile, between 0 and 1.
+ * @return The RTT in nanoseconds, the middle of the bucket it falls in.
+ */
+long long stats_quantile(const struct rtt_stats *stats, double quantile);
+
+/**
+ * Prints, for each target, the probes sent and answered, the RTT minimum,
+ * mean, maximum, deviation, median and tail quantiles, the RFC 3550 jitter
+ * and the late, duplicate, reordered and skipped counts, followed by the
+ * sweep of a size sweep. In a path discovery, prints each target's path
+ * instead.
+ * @param table The table.
+ */
+void print_summary(const struct target_table *table);
+
+/**
+ * Prints a target's RTTs for each payload size, then what they say about
+ * the path: the cost of every extra byte from a least-squares fit of the
+ * minimum RTT against size, and the MTU cliff. With DF set that is the
+ * size from which nothing comes back, told apart into probes our kernel
+ * refused (a known MTU) and probes lost on the way (a black hole); when
+ * fragmenting, it is the largest step up in RTT between two sizes.
+ * @param target The target.
+ * @param sweep The payload sizes.
+ */
+void print_sweep(const struct target *target, const struct size_sweep *sweep);
+
+/**
+ * Prints a target's path, one line per TTL up to the target: the address
+ * that answered, the probes sent and answered and the RTT minimum, median
+ * and 99th percentile, and how often another address answered.
+ * @param target The target.
+ */
+void print_path(const struct target *target);
+
+/**
+ * Reads CLOCK_MONOTONIC.
+ * @return The current time in nanoseconds.
+ */
+long long now_ns(void);
+
+/**
+ * Signal handler: SIGINT and SIGTERM ask the main loop to print the
+ * summary and exit, writing out the history, SIGQUIT to print it and carry
+ * on.
+ * @param signum The signal number.
+ */
+void handle_signal(int signum);
 
 int main(int argc, char *strings[]) {
-  if (argc != 2) {
-    printf("usage: %s <addr>\n", strings[0]);
+  const char *target_file = NULL;
+  const char *hw_iface = NULL;
+  long long interval_ms = DEFAULT_INTERVAL_MS;
+  long long timeout_ms = DEFAULT_TIMEOUT_MS;
+  int max_outstanding = MAX_OUTSTANDING;
+  long long count = 0;
+  long long report_s = 0;
+  int quiet = 0;
+  int datagram = 0;
+  int sweep_max = PROBE_SIZE;
+  struct size_sweep sweep = {PROBE_SIZE, 1, 1, 0};
+  int max_hops = 0;
+  const char *metrics_address = NULL;
+  const char *history_dir = NULL;
+  int protocol = IPPROTO_ICMP;
+  int port = 0;
+  int opt;
+
+  while ((opt = getopt(argc, strings, "f:i:c:qdH:W:o:P:S:Fm:M:t:u:D:")) != -1) {
+    switch (opt) {
+    case 't':
+    case 'u':
+      protocol = opt == 't' ? IPPROTO_TCP : IPPROTO_UDP;
+      port = atoi(optarg);
+      if (port <= 0 || port > 65535) {
+        interval_ms = -1;
+      }
+      break;
+    case 'M':
+      metrics_address = optarg;
+      break;
+    case 'D':
+      history_dir = optarg;
+      break;
+    case 'm':
+      max_hops = atoi(optarg);
+      if (max_hops <= 0) {
+        max_hops = -1;
+      }
+      break;
+    case 'S':
+      sweep.step = 8;
+      if (sscanf(optarg, "%d:%d:%d", &sweep.min, &sweep_max, &sweep.step) <
+          2) {
+        sweep.step = 0;
+      }
+      break;
+    case 'F':
+      sweep.fragment = 1;
+      break;
+    case 'd':
+      datagram = 1;
+      break;
+    case 'P':
+      report_s = atoll(optarg);
+      break;
+    case 'W':
+      timeout_ms = atoll(optarg);
+      break;
+    case 'o':
+      max_outstanding = atoi(optarg);
+      break;
+    case 'H':
+      hw_iface = optarg;
+      break;
+    case 'f':
+      target_file = optarg;
+      break;
+    case 'i':
+      interval_ms = atoll(optarg);
+      break;
+    case 'c':
+      count = atoll(optarg);
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    default:
+      interval_ms = -1;
+      break;
+    }
+  }
+
+  if (sweep.step > 0) {
+    sweep.count = (sweep_max - sweep.min) / sweep.step + 1;
+  }
+
+  if (interval_ms <= 0 || count < 0 || timeout_ms <= 0 || report_s < 0 ||
+      max_outstanding <= 0 || max_outstanding > MAX_OUTSTANDING ||
+      sweep.step <= 0 || sweep.min < (int)sizeof(struct probe_payload) ||
+      sweep_max < sweep.min || sweep_max > (int)MAX_PAYLOAD ||
+      sweep.count > MAX_SWEEP_SIZES || max_hops < 0 || max_hops > MAX_HOPS ||
+      (max_hops > 0 && (datagram || sweep.count > 1)) ||
+      (protocol != IPPROTO_ICMP && (datagram || max_hops > 0)) ||
+      (protocol == IPPROTO_TCP && sweep.count > 1) ||
+      (target_file == NULL && optind == argc)) {
+    printf("usage: %s [-i interval_ms] [-W timeout_ms] [-o max_outstanding] "
+           "[-c count] [-P report_s] [-q] [-d] [-H interface] "
+           "[-M [host:]port|socket_path] [-D history_dir] [-t port | -u port] "
+           "[-S min:max[:step] [-F] | -m max_hops] <addr> [addr...]\n"
+           "       %s [-i interval_ms] [-W timeout_ms] [-o max_outstanding] "
+           "[-c count] [-P report_s] [-q] [-d] [-H interface] "
+           "[-M [host:]port|socket_path] [-D history_dir] [-t port | -u port] "
+           "[-S min:max[:step] [-F] | -m max_hops] -f targets_file "
+           "[addr...]\n"
+           "-d uses an unprivileged datagram ICMP socket instead of a raw "
+           "one.\n"
+           "-t times TCP handshakes (SYN to SYN-ACK or reset) to a port, -u "
+           "UDP requests\n"
+           "   to a port that echoes them back, instead of ICMP echoes.\n"
+           "-H switches on hardware timestamps on the interface.\n"
+           "-P prints the statistics every report_s seconds, SIGQUIT at "
+           "any time.\n"
+           "-M serves Prometheus metrics over HTTP on a TCP port (on "
+           "127.0.0.1 unless\n"
+           "   a host is given) or a Unix socket (a path starting with / "
+           "or .).\n"
+           "-D appends every probe's RTT (NaN if lost) to a compressed store "
+           "in history_dir,\n"
+           "   read back with tsdb_query.\n"
+           "-S sweeps the payload from min to max bytes (%d to %d) in steps "
+           "(8 by default),\n"
+           "   with DF set, or fragmenting with -F, and reports the cost per "
+           "byte and the\n"
+           "   MTU cliff.\n"
+           "-m traces the path to each target every round, sending TTLs 1 "
+           "to max_hops\n"
+           "   (at most %d) at once; not with -d.\n",
+           strings[0], strings[0], (int)sizeof(struct probe_payload),
+           (int)MAX_PAYLOAD, MAX_HOPS);
     exit(0);
   }
 
-  struct hostent *hname;
-  hname = gethostbyname(strings[1]);
+  struct target_table table;
+  memset(&table, 0, sizeof(table));
+  table.sweep = sweep;
+  table.max_hops = max_hops;
+  table.protocol = protocol;
+  table.port = port;
+
+  if (target_file != NULL && target_load(&table, target_file) == -1) {
+    return -1;
+  }
+
+  for (int i = optind; i < argc; i++) {
+    target_add(&table, strings[i]);
+  }
+
+  if (table.count == 0) {
+    printf("Error : No target given.\n");
+    return -1;
+  }
+
+  struct probe_table probes;
+  if (target_index(&table) == -1 || probe_init(&probes, timeout_ms) == -1) {
+    return -1;
+  }
+
+  // The table is final: its names can be the metrics' labels.
+  struct metrics metrics;
+  if (metrics_init(&metrics, table.count) == -1) {
+    return -1;
+  }
+  for (int i = 0; i < table.count; i++) {
+    metrics.targets[i].name = table.targets[i].name;
+    table.targets[i].metrics = &metrics.targets[i];
+  }
+  // A scraper that hangs up before reading the whole response mustn't kill
+  // us; the server thread drops it on EPIPE instead.
+  signal(SIGPIPE, SIG_IGN);
+  if (metrics_address != NULL && metrics_serve(&metrics, metrics_address)) {
+    metrics_free(&metrics);
+    return -1;
+  }
+
+  // Samples are stamped with the wall clock, as their send times moved
+  // from the monotonic clock by an offset taken once.
+  if (history_dir != NULL) {
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    table.wall_offset_ns = wall.tv_sec * 1000000000LL + wall.tv_nsec - now_ns();
+
+    if ((table.history = tsdb_open(history_dir)) == NULL) {
+      metrics_free(&metrics);
+      return -1;
+    }
+    for (int i = 0; i < table.count; i++) {
+      table.targets[i].series = tsdb_series(table.history,
+                                            table.targets[i].name);
+      if (table.targets[i].series == -1) {
+        tsdb_close(table.history);
+        metrics_free(&metrics);
+        return -1;
+      }
+    }
+    probes.on_lost = record_loss;
+    probes.lost_arg = &table;
+  }
+
+  // Names are resolved in the background; each target is probed from its
+  // first slot after its address arrives.
+  struct resolver *resolver = NULL;
+  int lookups = 0;
 
-  struct sockaddr_in dest_addr;
-  bzero(&dest_addr, sizeof(dest_addr));
-  dest_addr.sin_family = AF_INET;
-  dest_addr.sin_port = 0;
-  dest_addr.sin_addr.s_addr = *(long *)hname->h_addr;
+  for (int i = 0; i < table.count; i++) {
+    if (table.targets[i].state != TARGET_RESOLVING) {
+      continue;
+    }
+    if (resolver == NULL &&
+        (resolver = resolver_create(RESOLVER_THREADS, DNS_TTL_S)) == NULL) {
+      return -1;
+    }
+    if (resolver_submit(resolver, table.targets[i].name, i) == -1) {
+      return -1;
+    }
+    lookups++;
+  }
 
-  int my_socket = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+  uint16_t id = (uint16_t)getpid();
+  int my_socket = open_socket(protocol, datagram, &id);
   if (my_socket < 0) {
-    perror("socket");
     return -1;
   }
 
-  int ttl = 255;
-  int sockopt = setsockopt(my_socket, SOL_IP, IP_TTL, &ttl, sizeof(ttl));
-  if (sockopt != 0) {
-    perror("setsockopt");
+  // TCP probes have sockets of their own, and the kernel times them.
+  if (protocol == IPPROTO_TCP) {
+    printf("Measuring RTTs of TCP handshakes to port %d.\n", port);
+  } else {
+    int ttl = 255;
+    int sockopt = setsockopt(my_socket, SOL_IP, IP_TTL, &ttl, sizeof(ttl));
+    if (sockopt != 0) {
+      perror("setsockopt");
+      return -1;
+    }
+
+    // A sweep sets DF and lets the kernel refuse what it knows won't fit
+    // (EMSGSIZE), or clears it so that oversized probes are fragmented.
+    if (sweep.count > 1) {
+      int pmtu = sweep.fragment ? IP_PMTUDISC_DONT : IP_PMTUDISC_DO;
+      if (setsockopt(my_socket, SOL_IP, IP_MTU_DISCOVER, &pmtu,
+                     sizeof(pmtu)) != 0) {
+        perror("setsockopt IP_MTU_DISCOVER");
+        close(my_socket);
+        return -1;
+      }
+    }
+
+    // A round's replies can arrive nearly at once, so the default buffer
+    // would drop some with thousands of targets.
+    int rcvbuf = RECV_BUFFER_BYTES;
+    setsockopt(my_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    int hardware = timestamps_enable(my_socket, hw_iface);
+    if (hardware == -1) {
+      close(my_socket);
+      return -1;
+    }
+    printf("Measuring RTTs with %s timestamps.\n",
+           hardware ? "hardware" : "kernel software");
+  }
+
+  // Every deadline (next probe, next reply timeout) is absolute and set on
+  // one timerfd, watched along with the socket.
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (timer == -1 || epoll_fd == -1) {
+    perror("timerfd/epoll");
+    close(my_socket);
+    return -1;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = my_socket;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, my_socket, &event);
+  event.data.fd = timer;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer, &event);
+  if (resolver != NULL) {
+    event.data.fd = resolver_fd(resolver);
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event);
+  }
+
+  // SIGINT, SIGTERM and SIGQUIT must interrupt epoll_wait() so the summary
+  // is printed, hence sigaction() without SA_RESTART. SIGTERM ends the run
+  // as SIGINT does, so a service manager stopping it doesn't lose history.
+  struct sigaction int_action;
+  memset(&int_action, 0, sizeof(int_action));
+  int_action.sa_handler = handle_signal;
+  sigaction(SIGINT, &int_action, NULL);
+  sigaction(SIGTERM, &int_action, NULL);
+  sigaction(SIGQUIT, &int_action, NULL);
+
+  struct send_ring ring;
+  struct recv_ring replies;
+  if (ring_init(&ring, &replies, id, datagram || protocol == IPPROTO_UDP,
+                &table.sweep) == -1) {
+    close(my_socket);
     return -1;
   }
 
-  char data[IP_MAXPACKET] = "This is the ping.\n";
-  int data_length = (int)strlen(data) + 1;
+  // Probes are spread evenly over the interval: target i of round r goes out
+  // at start + r * interval + i * interval / count, all absolute times so
+  // the schedule doesn't drift. Nothing waits for replies, so the interval
+  // may be shorter than the RTT.
+  long long interval_ns = interval_ms * 1000000LL;
+  long long start = now_ns();
+  long long round = 0;
+  int next = 0;
+  long long next_send = start;
+  long long report_ns = report_s * 1000000000LL;
+  long long next_report = start + report_ns;
+  long long flush_ns = HISTORY_FLUSH_S * 1000000000LL;
+  long long next_flush = start + flush_ns;
+  int sending = TRUE;
+
+  while (!stop) {
+    long long now = now_ns();
+
+    if (report || (report_ns > 0 && next_report <= now)) {
+      report = 0;
+      while (report_ns > 0 && next_report <= now) {
+        next_report += report_ns;
+      }
+      print_summary(&table);
+    }
+
+    // Full blocks reach the disk within HISTORY_FLUSH_S, however slowly
+    // they pile up.
+    if (table.history != NULL && next_flush <= now) {
+      next_flush = now + flush_ns;
+      tsdb_flush(table.history);
+    }
 
-  char packet[IP_MAXPACKET];
+    while (sending && next_send <= now) {
+      struct target *target = &table.targets[next];
 
-  struct timeval start, end;
+      // A name past its TTL is looked up again; the old address is used
+      // until the answer comes.
+      if (target->expires_ns != 0 && target->expires_ns <= now &&
+          !target->refreshing &&
+          resolver_submit(resolver, target->name, next) == 0) {
+        target->refreshing = 1;
+        lookups++;
+      }
 
-  int seq = 0;
+      // Past the cap the slot is skipped, not delayed, so the schedule holds.
+      // Targets without an address of their own leave their slot unused.
+      // A path discovery sends one probe per TTL, all in the same slot.
+      int first = table.max_hops > 0 ? 1 : 0;
+      int last = table.max_hops > 0 ? target->ttl_limit : 0;
 
-  while (TRUE) {
+      for (int ttl = first; ttl <= last; ttl++) {
+        if (target->state != TARGET_RESOLVED) {
+          break;
+        } else if (probes.outstanding >= max_outstanding) {
+          if (ttl == last) {
+            target->skipped++;
+            metrics_count(target->metrics, METRICS_SKIPPED);
+          }
+        } else if (queue_probe(my_socket, &ring, &table, &probes, target, ttl,
+                               now) == -1) {
+          close(my_socket);
+          return -1;
+        }
+      }
 
-    struct icmp icmphdr;
-    icmphdr.icmp_type = ICMP_ECHO;
-    icmphdr.icmp_code = 0;
-    icmphdr.icmp_id = 18;
-    icmphdr.icmp_seq = seq++;
-    icmphdr.icmp_cksum = 0;
+      if (++next == table.count) {
+        next = 0;
+        round++;
+      }
 
-    bzero(packet, IP_MAXPACKET);
-    memcpy((packet), &icmphdr, ICMP_HDRLEN);
-    memcpy(packet + ICMP_HDRLEN, data, data_length);
-    icmphdr.icmp_cksum = calculate_checksum((unsigned short *)(packet),
-                                            ICMP_HDRLEN + data_length);
-    memcpy((packet), &icmphdr, ICMP_HDRLEN);
+      next_send = start + round * interval_ns +
+                  interval_ns * next / table.count;
 
-    gettimeofday(&start, 0);
+      if (count > 0 && round == count) {
+        sending = 0;
+      }
+    }
 
-    int bytes_sent =
-        (int)sendto(my_socket, packet, ICMP_HDRLEN + data_length, 0,
-                    (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-    if (bytes_sent == -1) {
-      perror("sendto");
+    if (flush_probes(my_socket, &ring, &table, &probes) == -1) {
+      close(my_socket);
       return -1;
     }
 
-    bzero(packet, IP_MAXPACKET);
-    socklen_t len = sizeof(dest_addr);
-    ssize_t bytes_received;
-    while ((bytes_received = recvfrom(my_socket, packet, sizeof(packet), 0,
-                                      (struct sockaddr *)&dest_addr, &len))) {
-      if (bytes_received > 0) {
-        gettimeofday(&end, 0);
-        float time = (float)(end.tv_sec - start.tv_sec) * 1000.0f +
-                     (float)(end.tv_usec - start.tv_usec) / 1000.0f;
-        printf(
-            "Ping returned: %ld bytes from IP = %s, Seq = %d, time = %.3f ms\n",
-            bytes_received, strings[1], seq, time);
-        break;
+    long long wake = probe_expire(&probes, now);
+    if (!sending && probes.outstanding == 0) {
+      break;
+    }
+    if (sending && (wake == 0 || next_send < wake)) {
+      wake = next_send;
+    }
+    if (report_ns > 0 && next_report < wake) {
+      wake = next_report;
+    }
+    if (table.history != NULL && (wake == 0 || next_flush < wake)) {
+      wake = next_flush;
+    }
+
+    struct epoll_event events[3];
+    int socket_ready = 0;
+
+    arm_timer(timer, wake);
+    int ready = epoll_wait(epoll_fd, events, 3, -1);
+
+    for (int i = 0; i < ready; i++) {
+      if (events[i].data.fd == timer) {
+        uint64_t expirations;
+        read(timer, &expirations, sizeof(expirations));
+      } else if (events[i].data.fd == my_socket) {
+        socket_ready = 1;
+      } else {
+        struct resolver_result result;
+        while (resolver_next(resolver, &result)) {
+          handle_lookup(&table, &result);
+          lookups--;
+        }
       }
     }
-    sleep(1);
+
+    if (lookups == 0 && table.resolved == 0) {
+      printf("Error : No target could be resolved.\n");
+      break;
+    }
+
+    if (!socket_ready) {
+      continue;
+    }
+
+    if (protocol == IPPROTO_TCP) {
+      read_connects(my_socket, &table, &probes, quiet);
+      continue;
+    }
+
+    // TX timestamps first: a reply may already be queued behind its
+    // request's stamp. Then drain everything before sending again.
+    collect_tx_timestamps(my_socket, &probes);
+    read_replies(my_socket, &replies, &table, &probes, id, quiet);
+  }
+
+  print_summary(&table);
+
+  if (table.history != NULL && tsdb_close(table.history) == -1) {
+    printf("Error : Some of the history couldn't be written.\n");
+  }
+  metrics_free(&metrics);
+  if (resolver != NULL) {
+    resolver_destroy(resolver);
   }
+  close(epoll_fd);
+  close(timer);
   close(my_socket);
+  for (int i = 0; i < table.count; i++) {
+    free(table.targets[i].sizes);
+    free(table.targets[i].hops);
+  }
+  free(table.targets);
+  free(table.buckets);
+  free(probes.probes);
+  free(probes.buckets);
+  free(probes.tx_ring);
+  free(ring.template);
+  free(ring.cksums);
+  free(ring.packets);
+  free(ring.controls);
+  free(ring.iovs);
+  free(ring.msgs);
+  free(ring.probe_ids);
+  free(replies.packets);
+  free(replies.controls);
+  free(replies.names);
+  free(replies.iovs);
+  free(replies.msgs);
+
+  return table.resolved > 0 ? 0 : -1;
+}
+
+// **THE FUNCTIONS** :
+
+int target_add(struct target_table *table, const char *name) {
+  if (table->count == table->capacity) {
+    int capacity = table->capacity ? table->capacity * 2 : 64;
+    struct target *targets =
+        realloc(table->targets, capacity * sizeof(struct target));
+
+    if (targets == NULL) {
+      printf("Error : Target allocation failed.\n");
+      return -1;
+    }
+
+    table->targets = targets;
+    table->capacity = capacity;
+  }
+
+  struct target *target = &table->targets[table->count++];
+  memset(target, 0, sizeof(struct target));
+  snprintf(target->name, sizeof(target->name), "%s", name);
+  target->address.sin_family = AF_INET;
+  target->address.sin_port = htons(table->port);
+  target->state = TARGET_RESOLVING;
+  target->next = -1;
+
+  return 0;
+}
+
+int target_load(struct target_table *table, const char *path) {
+  FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  char line[MAX_NAME_LEN];
+
+  if (file == NULL) {
+    printf("Error : Couldn't open %s.\n", path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char *name = line + strspn(line, " \t");
+    name[strcspn(name, " \t\r\n")] = '\0';
+
+    if (name[0] != '\0' && name[0] != '#') {
+      target_add(table, name);
+    }
+  }
+
+  if (file != stdin) {
+    fclose(file);
+  }
 
   return 0;
-}
\ No newline at end of file
+}
+
+int target_index(struct target_table *table) {
+  int buckets = 1;
+  while (buckets < table->count * 2) {
+    buckets <<= 1;
+  }
+
+  table->buckets = malloc(buckets * sizeof(int));
+  if (table->buckets == NULL) {
+    printf("Error : Target index allocation failed.\n");
+    return -1;
+  }
+
+  table->mask = buckets - 1;
+  memset(table->buckets, -1, buckets * sizeof(int));
+
+  for (int i = 0; i < table->count && table->sweep.count > 1; i++) {
+    table->targets[i].sizes =
+        calloc(table->sweep.count, sizeof(struct size_stats));
+    if (table->targets[i].sizes == NULL) {
+      printf("Error : Sweep allocation failed.\n");
+      return -1;
+    }
+  }
+
+  // A path is probed up to max_hops until the target itself answers.
+  for (int i = 0; i < table->count && table->max_hops > 0; i++) {
+    table->targets[i].hops = calloc(table->max_hops, sizeof(struct hop));
+    table->targets[i].ttl_limit = table->max_hops;
+    if (table->targets[i].hops == NULL) {
+      printf("Error : Path allocation failed.\n");
+      return -1;
+    }
+  }
+
+  // Addresses need no lookup, and never expire.
+  for (int i = 0; i < table->count; i++) {
+    struct in_addr address;
+
+    if (inet_pton(AF_INET, table->targets[i].name, &address) == 1) {
+      target_set_address(table, &table->targets[i], address);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Hashes an address into the target index.
+ * @param table The table.
+ * @param address The address.
+ * @return Its bucket.
+ */
+static int target_bucket(const struct target_table *table,
+                         struct in_addr address) {
+  uint32_t hash = address.s_addr * 2654435761u;
+  return (int)(hash >> 7) & table->mask;
+}
+
+void target_set_address(struct target_table *table, struct target *target,
+                        struct in_addr address) {
+  int index = (int)(target - table->targets);
+
+  if (target->state == TARGET_RESOLVED) {
+    if (target->address.sin_addr.s_addr == address.s_addr) {
+      return;
+    }
+
+    int *link = &table->buckets[target_bucket(table,
+                                              target->address.sin_addr)];
+    while (*link != index) {
+      link = &table->targets[*link].next;
+    }
+    *link = target->next;
+    table->resolved--;
+  }
+
+  target->address.sin_addr = address;
+
+  struct target *existing = target_find(table, address);
+  if (existing != NULL) {
+    if (target->state != TARGET_DUPLICATE) {
+      printf("%s is the same address as %s, skipping it.\n", target->name,
+             existing->name);
+    }
+    target->state = TARGET_DUPLICATE;
+    return;
+  }
+
+  int bucket = target_bucket(table, address);
+  target->next = table->buckets[bucket];
+  table->buckets[bucket] = index;
+  target->state = TARGET_RESOLVED;
+  table->resolved++;
+}
+
+struct target *target_find(const struct target_table *table,
+                           struct in_addr address) {
+  int i = table->buckets[target_bucket(table, address)];
+
+  for (; i != -1; i = table->targets[i].next) {
+    if (table->targets[i].address.sin_addr.s_addr == address.s_addr) {
+      return &table->targets[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Hashes the key of a probe.
+ * @param target The index of the target.
+ * @param seq The sequence number.
+ * @return The bucket of the probe.
+ */
+static int probe_bucket(int target, uint16_t seq) {
+  uint32_t hash = ((uint32_t)target << 16 | seq) * 2654435761u;
+  return (int)(hash >> 8) & (MAX_OUTSTANDING - 1);
+}
+
+int probe_init(struct probe_table *probes, long long timeout_ms) {
+  memset(probes, 0, sizeof(struct probe_table));
+  probes->timeout_ns = timeout_ms * 1000000LL;
+  probes->probes = malloc(MAX_OUTSTANDING * sizeof(struct probe));
+  probes->buckets = malloc(MAX_OUTSTANDING * sizeof(int));
+  probes->tx_ring = calloc(TX_RING, sizeof(uint32_t));
+
+  if (probes->probes == NULL || probes->buckets == NULL ||
+      probes->tx_ring == NULL) {
+    printf("Error : Probe table allocation failed.\n");
+    return -1;
+  }
+
+  for (int i = 0; i < MAX_OUTSTANDING; i++) {
+    probes->probes[i].target = -1;
+    probes->buckets[i] = -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Forgets the oldest probe, answered or not. One still in the table was
+ * never answered: it is lost.
+ * @param probes The table.
+ */
+static void probe_retire_oldest(struct probe_table *probes) {
+  struct probe *probe =
+      &probes->probes[probes->oldest_id & (MAX_OUTSTANDING - 1)];
+
+  if (probe->target != -1 && probe->id == probes->oldest_id) {
+    if (probes->on_lost != NULL) {
+      probes->on_lost(probe, probes->lost_arg);
+    }
+    probe_remove(probes, probe);
+  }
+  probes->oldest_id++;
+}
+
+struct probe *probe_add(struct probe_table *probes, int target, uint16_t seq,
+                        long long now) {
+  while (probes->next_id - probes->oldest_id >= MAX_OUTSTANDING) {
+    probe_retire_oldest(probes);
+  }
+
+  uint32_t id = probes->next_id++;
+  int slot = id & (MAX_OUTSTANDING - 1);
+  int bucket = probe_bucket(target, seq);
+  struct probe *probe = &probes->probes[slot];
+
+  probe->target = target;
+  probe->seq = seq;
+  probe->id = id;
+  probe->sent_ns = now;
+  probe->fd = -1;
+  memset(&probe->tx, 0, sizeof(probe->tx));
+  probe->next = probes->buckets[bucket];
+  probes->buckets[bucket] = slot;
+  probes->outstanding++;
+
+  return probe;
+}
+
+struct probe *probe_find(const struct probe_table *probes, int target,
+                         uint16_t seq) {
+  int i = probes->buckets[probe_bucket(target, seq)];
+
+  for (; i != -1; i = probes->probes[i].next) {
+    struct probe *probe = &probes->probes[i];
+
+    if (probe->target == target && probe->seq == seq) {
+      return probe;
+    }
+  }
+
+  return NULL;
+}
+
+void probe_remove(struct probe_table *probes, struct probe *probe) {
+  int slot = (int)(probe - probes->probes);
+  int *link = &probes->buckets[probe_bucket(probe->target, probe->seq)];
+
+  while (*link != slot) {
+    link = &probes->probes[*link].next;
+  }
+
+  *link = probe->next;
+  probe->target = -1;
+  probes->outstanding--;
+
+  if (probe->fd != -1) {
+    close(probe->fd);
+    probe->fd = -1;
+  }
+}
+
+long long probe_expire(struct probe_table *probes, long long now) {
+  long long timeout = probes->timeout_ns;
+
+  while (probes->oldest_id != probes->next_id) {
+    struct probe *probe =
+        &probes->probes[probes->oldest_id & (MAX_OUTSTANDING - 1)];
+
+    if (probe->target != -1 && probe->id == probes->oldest_id &&
+        probe->sent_ns + timeout > now) {
+      return probe->sent_ns + timeout;
+    }
+
+    probe_retire_oldest(probes);
+  }
+
+  return 0;
+}
+
+/**
+ * Attaches a classic BPF filter to a raw ICMP socket that drops everything
+ * but echo replies carrying our identifier and Time Exceeded messages
+ * quoting an echo request with it, before they are queued. Our requests
+ * carry no IP options, so the quoted IP header is 20 bytes long.
+ * @param sock The raw socket.
+ * @param id Our ICMP identifier.
+ * @return 0 on success, -1 on error.
+ */
+static int attach_reply_filter(int sock, uint16_t id) {
+  const int quoted = ICMP_HDRLEN + sizeof(struct ip);
+  struct sock_filter code[] = {
+      // X = length of the IP header.
+      BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+      // An echo reply's identifier is checked right away.
+      BPF_STMT(BPF_LD | BPF_B | BPF_IND, offsetof(struct icmp, icmp_type)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 2),
+      BPF_STMT(BPF_LD | BPF_H | BPF_IND, offsetof(struct icmp, icmp_id)),
+      BPF_STMT(BPF_JMP | BPF_JA, 6),
+      // A Time Exceeded must quote an ICMP echo request...
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIMXCEED, 0, 7),
+      BPF_STMT(BPF_LD | BPF_B | BPF_IND,
+               ICMP_HDRLEN + offsetof(struct ip, ip_p)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, 5),
+      BPF_STMT(BPF_LD | BPF_B | BPF_IND,
+               quoted + offsetof(struct icmp, icmp_type)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHO, 0, 3),
+      BPF_STMT(BPF_LD | BPF_H | BPF_IND,
+               quoted + offsetof(struct icmp, icmp_id)),
+      // ...with our identifier; BPF loads are in network byte order.
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, id, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, 0xffff),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog filter = {sizeof(code) / sizeof(code[0]), code};
+
+  if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &filter,
+                 sizeof(filter)) == -1) {
+    perror("setsockopt SO_ATTACH_FILTER");
+    return -1;
+  }
+
+  return 0;
+}
+
+void handle_lookup(struct target_table *table,
+                   const struct resolver_result *result) {
+  struct target *target = &table->targets[result->tag];
+
+  target->refreshing = 0;
+  target->expires_ns = result->expires_ns;
+
+  if (result->status == 0) {
+    target_set_address(table, target, result->address);
+  } else if (target->state == TARGET_RESOLVING) {
+    printf("Error : Couldn't resolve %s: %s\n", target->name,
+           gai_strerror(result->status));
+    target->state = TARGET_FAILED;
+  }
+}
+
+int open_socket(int protocol, int datagram, uint16_t *id) {
+  if (protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) {
+    int sock = protocol == IPPROTO_TCP
+                   ? epoll_create1(EPOLL_CLOEXEC)
+                   : socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+      perror("socket");
+    }
+    return sock;
+  }
+
+  int sock = socket(AF_INET, datagram ? SOCK_DGRAM : SOCK_RAW, IPPROTO_ICMP);
+  if (sock < 0) {
+    perror("socket");
+    if (datagram && (errno == EACCES || errno == EPERM)) {
+      printf("Is the group in net.ipv4.ping_group_range?\n");
+    }
+    return -1;
+  }
+
+  if (!datagram) {
+    if (attach_reply_filter(sock, *id) == -1) {
+      close(sock);
+      return -1;
+    }
+    return sock;
+  }
+
+  // The socket's port is the identifier of its requests. Ask for ours, and
+  // take whatever the kernel picks if another socket already has it.
+  struct sockaddr_in local;
+  socklen_t local_len = sizeof(local);
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(*id);
+
+  if (bind(sock, (struct sockaddr *)&local, sizeof(local)) == -1) {
+    local.sin_port = 0;
+    if (bind(sock, (struct sockaddr *)&local, sizeof(local)) == -1) {
+      perror("bind");
+      close(sock);
+      return -1;
+    }
+  }
+
+  if (getsockname(sock, (struct sockaddr *)&local, &local_len) == -1) {
+    perror("getsockname");
+    close(sock);
+    return -1;
+  }
+  *id = ntohs(local.sin_port);
+
+  return sock;
+}
+
+int ring_init(struct send_ring *ring, struct recv_ring *replies, uint16_t id,
+              int datagram, const struct size_sweep *sweep) {
+  memset(ring, 0, sizeof(struct send_ring));
+  memset(replies, 0, sizeof(struct recv_ring));
+  replies->datagram = datagram;
+
+  int max_size = sweep->min + (sweep->count - 1) * sweep->step;
+  ring->packet_len = ICMP_HDRLEN + max_size;
+  replies->slot = RECV_SLOT;
+  if (replies->slot < ring->packet_len + 60) {
+    replies->slot = ring->packet_len + 60; // Room for IP options too.
+  }
+
+  ring->template = malloc(ring->packet_len);
+  ring->cksums = malloc(sweep->count * sizeof(uint16_t));
+  ring->packets = malloc((size_t)SEND_BATCH * ring->packet_len);
+  ring->controls = calloc(SEND_BATCH, sizeof(*ring->controls));
+  ring->iovs = calloc(SEND_BATCH, sizeof(struct iovec));
+  ring->msgs = calloc(SEND_BATCH, sizeof(struct mmsghdr));
+  ring->probe_ids = calloc(SEND_BATCH, sizeof(uint32_t));
+  replies->packets = malloc((size_t)RECV_BATCH * replies->slot);
+  replies->controls = malloc(RECV_BATCH * sizeof(*replies->controls));
+  replies->names = calloc(RECV_BATCH, sizeof(struct sockaddr_in));
+  replies->iovs = calloc(RECV_BATCH, sizeof(struct iovec));
+  replies->msgs = calloc(RECV_BATCH, sizeof(struct mmsghdr));
+
+  if (ring->template == NULL || ring->cksums == NULL ||
+      ring->packets == NULL || ring->controls == NULL || ring->iovs == NULL ||
+      ring->msgs == NULL ||
+      ring->probe_ids == NULL || replies->packets == NULL ||
+      replies->controls == NULL || replies->names == NULL ||
+      replies->iovs == NULL ||
+      replies->msgs == NULL) {
+    printf("Error : Ring allocation failed.\n");
+    return -1;
+  }
+
+  struct icmp icmphdr;
+  struct probe_payload payload;
+  memset(&icmphdr, 0, ICMP_HDRLEN);
+  memset(&payload, 0, sizeof(payload));
+  icmphdr.icmp_type = ICMP_ECHO;
+  icmphdr.icmp_code = 0;
+  icmphdr.icmp_id = htons(id);
+  payload.magic = PROBE_MAGIC;
+
+  memcpy(ring->template, &icmphdr, ICMP_HDRLEN);
+  memcpy(ring->template + ICMP_HDRLEN, &payload, sizeof(payload));
+  for (int i = ICMP_HDRLEN + sizeof(payload); i < ring->packet_len; i++) {
+    ring->template[i] =
+        PROBE_DATA[(i - ICMP_HDRLEN - sizeof(payload)) % sizeof(PROBE_DATA)];
+  }
+
+  // Every size is a prefix of the same template, with a checksum of its
+  // own to be updated per probe; the template itself keeps a 0 checksum.
+  for (int i = 0; i < sweep->count; i++) {
+    ring->cksums[i] = inet_checksum(ring->template,
+                                    ICMP_HDRLEN + sweep->min + i * sweep->step);
+  }
+
+  for (int i = 0; i < SEND_BATCH; i++) {
+    unsigned char *packet = ring->packets + (size_t)i * ring->packet_len;
+
+    memcpy(packet, ring->template, ring->packet_len);
+    ring->iovs[i].iov_base = packet;
+    ring->msgs[i].msg_hdr.msg_iov = &ring->iovs[i];
+    ring->msgs[i].msg_hdr.msg_iovlen = 1;
+    ring->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+    // Only the TTL itself changes from probe to probe.
+    struct msghdr control = {.msg_control = ring->controls[i],
+                             .msg_controllen = TTL_CONTROL_LEN};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&control);
+    cmsg->cmsg_level = SOL_IP;
+    cmsg->cmsg_type = IP_TTL;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  }
+
+  for (int i = 0; i < RECV_BATCH; i++) {
+    replies->iovs[i].iov_base = replies->packets + (size_t)i * replies->slot;
+    replies->iovs[i].iov_len = replies->slot;
+    replies->msgs[i].msg_hdr.msg_iov = &replies->iovs[i];
+    replies->msgs[i].msg_hdr.msg_iovlen = 1;
+    replies->msgs[i].msg_hdr.msg_name = &replies->names[i];
+  }
+
+  return 0;
+}
+
+int queue_probe(int sock, struct send_ring *ring, struct target_table *table,
+                struct probe_table *probes, struct target *target, int ttl,
+                long long now) {
+  const struct size_sweep *sweep = &table->sweep;
+  int size = target->sent % sweep->count;
+
+  // Of a path discovery's probes, only the one with the target's distance
+  // as its TTL is meant to reach it: the others are the hops' own, and
+  // would count as the target's losses.
+  int counted = ttl == 0 || ttl == target->ttl_limit;
+
+  target->seq++;
+  target->answered <<= 1;
+  target->queued++;
+  if (counted) {
+    target->sent++;
+    metrics_count(target->metrics, METRICS_SENT);
+  }
+  if (target->sizes != NULL) {
+    target->sizes[size].sent++;
+  }
+
+  struct probe *probe =
+      probe_add(probes, (int)(target - table->targets), target->seq, now);
+  probe->size = size;
+  probe->ttl = ttl;
+  probe->counted = counted;
+  if (ttl > 0) {
+    target->hops[ttl - 1].sent++;
+  }
+
+  // A connect that can't even start is a lost probe.
+  if (table->protocol == IPPROTO_TCP) {
+    if (start_connect(sock, target, probe) == -1) {
+      probe_remove(probes, probe);
+    }
+    return 0;
+  }
+
+  // Only the sequence number and the payload's probe ID and send time
+  // differ from the template; the checksum follows from those alone.
+  unsigned char *packet =
+      ring->packets + (size_t)ring->queued * ring->packet_len;
+  uint16_t seq = htons(target->seq);
+  struct probe_payload payload;
+  memset(&payload, 0, sizeof(payload));
+  payload.magic = PROBE_MAGIC;
+  payload.probe = probe->id;
+  payload.sent_ns = now;
+  payload.seq = target->seq;
+
+  memcpy(packet + offsetof(struct icmp, icmp_seq), &seq, sizeof(seq));
+  memcpy(packet + ICMP_HDRLEN, &payload, sizeof(payload));
+
+  int from = offsetof(struct icmp, icmp_id);
+  int to = ICMP_HDRLEN + sizeof(payload);
+  uint16_t cksum = inet_checksum_update(
+      ring->cksums[size], ring->template + from, packet + from, to - from);
+  memcpy(packet + offsetof(struct icmp, icmp_cksum), &cksum, sizeof(cksum));
+
+  // A UDP request is the same payload without the ICMP header.
+  int header = table->protocol == IPPROTO_UDP ? 0 : ICMP_HDRLEN;
+  ring->iovs[ring->queued].iov_base = packet + ICMP_HDRLEN - header;
+  ring->iovs[ring->queued].iov_len = header + sweep->min + size * sweep->step;
+  ring->msgs[ring->queued].msg_hdr.msg_name = &target->address;
+  ring->probe_ids[ring->queued] = probe->id;
+
+  struct msghdr *msg = &ring->msgs[ring->queued].msg_hdr;
+  if (ttl > 0) {
+    msg->msg_control = ring->controls[ring->queued];
+    msg->msg_controllen = TTL_CONTROL_LEN;
+    memcpy(CMSG_DATA(CMSG_FIRSTHDR(msg)), &ttl, sizeof(ttl));
+  } else {
+    msg->msg_control = NULL;
+    msg->msg_controllen = 0;
+  }
+
+  if (++ring->queued == SEND_BATCH) {
+    return flush_probes(sock, ring, table, probes);
+  }
+
+  return 0;
+}
+
+int flush_probes(int sock, struct send_ring *ring, struct target_table *table,
+                 struct probe_table *probes) {
+  int done = 0;
+
+  while (done < ring->queued) {
+    int sent = sendmmsg(sock, ring->msgs + done, ring->queued - done, 0);
+
+    // A probe over the MTU the kernel knows of, with DF set, is refused
+    // outright; that is a result of the sweep, not a loss.
+    if (sent == -1 && errno == EMSGSIZE) {
+      uint32_t id = ring->probe_ids[done];
+      struct probe *probe = &probes->probes[id & (MAX_OUTSTANDING - 1)];
+
+      if (probe->target != -1 && probe->id == id) {
+        struct target *target = &table->targets[probe->target];
+        if (target->sizes != NULL) {
+          target->sizes[probe->size].rejected++;
+        }
+        probe_remove(probes, probe);
+      }
+      done++;
+      continue;
+    }
+
+    // sendmmsg() stops at the first failure and reports it only when
+    // nothing was sent. A host that is unreachable right now doesn't stop
+    // the others; its probe simply times out.
+    if (sent == -1) {
+      if (errno != EHOSTUNREACH && errno != ENETUNREACH && errno != ENOBUFS &&
+          errno != EAGAIN && errno != EINTR) {
+        perror("sendmmsg");
+        ring->queued = 0;
+        return -1;
+      }
+      if (errno != EINTR) {
+        done++;
+      }
+      continue;
+    }
+
+    // The kernel numbers its TX timestamps by packet actually sent.
+    for (int i = done; i < done + sent; i++) {
+      probes->tx_ring[probes->sends++ % TX_RING] = ring->probe_ids[i];
+    }
+    done += sent;
+  }
+
+  ring->queued = 0;
+  return 0;
+}
+
+void read_replies(int sock, struct recv_ring *replies,
+                  struct target_table *table, struct probe_table *probes,
+                  uint16_t id, int quiet) {
+  int received;
+
+  do {
+    for (int i = 0; i < RECV_BATCH; i++) {
+      replies->msgs[i].msg_hdr.msg_control = replies->controls[i];
+      replies->msgs[i].msg_hdr.msg_controllen = CONTROL_LEN;
+      replies->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    received = recvmmsg(sock, replies->msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+    long long now = now_ns();
+
+    for (int i = 0; i < received; i++) {
+      const char *packet = replies->packets + (size_t)i * replies->slot;
+      int len = (int)replies->msgs[i].msg_len;
+      struct in_addr from = replies->names[i].sin_addr;
+
+      // A raw socket hands over the IP header too.
+      if (!replies->datagram) {
+        const struct ip *iphdr = (const struct ip *)packet;
+
+        if (len < (int)sizeof(struct ip) || iphdr->ip_hl < 5 ||
+            len < iphdr->ip_hl * 4) {
+          continue;
+        }
+        from = iphdr->ip_src;
+        packet += iphdr->ip_hl * 4;
+        len -= iphdr->ip_hl * 4;
+      }
+
+      struct kernel_timestamp rx;
+      timestamps_rx(&replies->msgs[i].msg_hdr, &rx);
+      if (table->protocol == IPPROTO_UDP) {
+        handle_datagram(table, probes, &replies->names[i], packet, len, now,
+                        &rx, quiet);
+      } else if (len > 0 && (unsigned char)packet[0] == ICMP_TIMXCEED) {
+        handle_hop(table, probes, from, packet, len, id, now, &rx, quiet);
+      } else {
+        handle_reply(table, probes, from, packet, len, id, now, &rx, quiet);
+      }
+    }
+  } while (received == RECV_BATCH);
+}
+
+void collect_tx_timestamps(int sock, struct probe_table *probes) {
+  unsigned int index;
+  struct kernel_timestamp ts;
+
+  while (timestamps_tx(sock, &index, &ts) == 0) {
+    // A stamp older than the ring is for a probe long given up on.
+    if (probes->sends - index > TX_RING) {
+      continue;
+    }
+
+    uint32_t id = probes->tx_ring[index % TX_RING];
+    struct probe *probe = &probes->probes[id & (MAX_OUTSTANDING - 1)];
+
+    if (probe->target != -1 && probe->id == id) {
+      probe->tx = ts;
+    }
+  }
+}
+
+/**
+ * Appends a probe's result to its target's series: its RTT in whole
+ * microseconds, which compresses far better than nanoseconds, or NaN.
+ * @param table The targets.
+ * @param target The target.
+ * @param sent_ns When the probe was sent, on the monotonic clock.
+ * @param rtt_ns Its RTT, or -1 if it was lost.
+ */
+static void record_sample(const struct target_table *table,
+                          const struct target *target, long long sent_ns,
+                          long long rtt_ns) {
+  int64_t time_ms = (sent_ns + table->wall_offset_ns) / 1000000;
+  double value = rtt_ns < 0 ? NAN : (double)(rtt_ns / 1000);
+
+  tsdb_append(table->history, target->series, time_ms, value);
+}
+
+void record_loss(const struct probe *probe, void *arg) {
+  const struct target_table *table = arg;
+
+  if (probe->counted) {
+    record_sample(table, &table->targets[probe->target], probe->sent_ns, -1);
+  }
+}
+
+/**
+ * Counts a reply to one of a target's probes, however it came: timed if
+ * its probe was still outstanding, as a duplicate if that probe was already
+ * answered, and as late otherwise.
+ * @param table The targets.
+ * @param probes The outstanding probes.
+ * @param target The target it came from.
+ * @param probe The probe it answers, or NULL if none is outstanding.
+ * @param seq Its sequence number.
+ * @param rtt Its RTT; for a late reply, the time since the send time it
+ * carries.
+ * @param len The bytes received.
+ * @param note Appended to the line printed, e.g. " (refused)".
+ * @param quiet Don't print a line per reply.
+ * @return 0 if it was counted, -1 if its sequence number was never sent.
+ */
+static int count_reply(struct target_table *table, struct probe_table *probes,
+                       struct target *target, struct probe *probe,
+                       uint16_t seq, long long rtt, int len, const char *note,
+                       int quiet) {
+  uint16_t age = target->seq - seq; // Probes sent to it since this one.
+  if (age >= target->queued) {
+    return -1;
+  }
+
+  // A path discovery's shorter TTL that reached the target anyway counts
+  // for its hop only, as it wasn't counted as sent to the target.
+  int counted = probe == NULL || probe->counted;
+
+  if (probe != NULL) {
+    if (counted) {
+      target->received++;
+      stats_add(&target->stats, rtt);
+      metrics_count(target->metrics, METRICS_RECEIVED);
+      metrics_observe(target->metrics, rtt);
+      if (table->history != NULL) {
+        record_sample(table, target, probe->sent_ns, rtt);
+      }
+    }
+    if (target->sizes != NULL) {
+      target->sizes[probe->size].received++;
+      stats_add(&target->sizes[probe->size].stats, rtt);
+    }
+
+    // The target is as far as the lowest TTL that reaches it; later rounds
+    // stop there.
+    if (probe->ttl > 0) {
+      struct hop *hop = &target->hops[probe->ttl - 1];
+
+      if (hop->received > 0 &&
+          hop->address.s_addr != target->address.sin_addr.s_addr) {
+        hop->changes++;
+      }
+      hop->address = target->address.sin_addr;
+      hop->received++;
+      stats_add(&hop->stats, rtt);
+      if (probe->ttl < target->ttl_limit) {
+        target->ttl_limit = probe->ttl;
+      }
+    }
+    probe_remove(probes, probe);
+  } else if (age < DUP_WINDOW && (target->answered >> age & 1)) {
+    target->duplicates++;
+    metrics_count(target->metrics, METRICS_DUPLICATES);
+
+    if (!quiet) {
+      printf("Ping returned: %d bytes from IP = %s, Seq = %d (DUP!)\n", len,
+             target->name, seq);
+    }
+    return 0;
+  } else {
+    // Given up on already: only the payload still knows when it was sent.
+    target->late++;
+    metrics_count(target->metrics, METRICS_LATE);
+    note = " (late)";
+  }
+
+  if (age < DUP_WINDOW) {
+    target->answered |= 1ULL << age;
+  }
+
+  // Replies normally come back in the order their probes went out.
+  if (counted && target->received + target->late > 1 &&
+      (int16_t)(seq - target->highest_answered) < 0) {
+    target->reordered++;
+    metrics_count(target->metrics, METRICS_REORDERED);
+  } else if (counted) {
+    target->highest_answered = seq;
+  }
+
+  if (!quiet && table->protocol == IPPROTO_TCP) {
+    printf("Port %d answered: IP = %s, Seq = %d, time = %lld.%06lld ms%s\n",
+           table->port, target->name, seq, rtt / 1000000, rtt % 1000000,
+           note);
+  } else if (!quiet) {
+    printf("Ping returned: %d bytes from IP = %s, Seq = %d, time = "
+           "%lld.%06lld ms%s\n",
+           len, target->name, seq, rtt / 1000000, rtt % 1000000, note);
+  }
+
+  return 0;
+}
+
+int handle_reply(struct target_table *table, struct probe_table *probes,
+                 struct in_addr from, const char *packet, int len,
+                 uint16_t id, long long now,
+                 const struct kernel_timestamp *rx, int quiet) {
+  int icmp_len = len;
+  if (icmp_len < ICMP_HDRLEN + (int)sizeof(struct probe_payload)) {
+    return -1;
+  }
+
+  const struct icmp *icmphdr = (const struct icmp *)packet;
+  if (icmphdr->icmp_type != ICMP_ECHOREPLY || icmphdr->icmp_code != 0 ||
+      ntohs(icmphdr->icmp_id) != id || inet_checksum(packet, icmp_len) != 0) {
+    return -1;
+  }
+
+  struct probe_payload payload;
+  memcpy(&payload, packet + ICMP_HDRLEN, sizeof(payload));
+  if (payload.magic != PROBE_MAGIC) {
+    return -1;
+  }
+
+  struct target *target = target_find(table, from);
+  if (target == NULL) {
+    return -1;
+  }
+
+  uint16_t seq = ntohs(icmphdr->icmp_seq);
+  struct probe *probe =
+      probe_find(probes, (int)(target - table->targets), seq);
+
+  // The payload must be the one this probe carried, all of it.
+  if (probe != NULL &&
+      (payload.probe != probe->id || payload.sent_ns != probe->sent_ns ||
+       icmp_len != ICMP_HDRLEN + table->sweep.min +
+                       probe->size * table->sweep.step)) {
+    return -1;
+  }
+
+  long long rtt = now - payload.sent_ns;
+  if (probe != NULL && (rtt = timestamps_diff(&probe->tx, rx)) < 0) {
+    rtt = now - probe->sent_ns;
+  }
+
+  return count_reply(table, probes, target, probe, seq, rtt, icmp_len, "",
+                     quiet);
+}
+
+int handle_datagram(struct target_table *table, struct probe_table *probes,
+                    const struct sockaddr_in *from, const char *packet,
+                    int len, long long now, const struct kernel_timestamp *rx,
+                    int quiet) {
+  struct probe_payload payload;
+
+  if (len < (int)sizeof(payload) || from->sin_port != htons(table->port)) {
+    return -1;
+  }
+
+  memcpy(&payload, packet, sizeof(payload));
+  if (payload.magic != PROBE_MAGIC) {
+    return -1;
+  }
+
+  struct target *target = target_find(table, from->sin_addr);
+  if (target == NULL) {
+    return -1;
+  }
+
+  struct probe *probe =
+      probe_find(probes, (int)(target - table->targets), payload.seq);
+
+  // The whole request must come back, as sent.
+  if (probe != NULL &&
+      (payload.probe != probe->id || payload.sent_ns != probe->sent_ns ||
+       len != table->sweep.min + probe->size * table->sweep.step)) {
+    return -1;
+  }
+
+  long long rtt = now - payload.sent_ns;
+  if (probe != NULL && (rtt = timestamps_diff(&probe->tx, rx)) < 0) {
+    rtt = now - probe->sent_ns;
+  }
+
+  return count_reply(table, probes, target, probe, payload.seq, rtt, len, "",
+                     quiet);
+}
+
+int start_connect(int connects, struct target *target, struct probe *probe) {
+  struct linger linger = {1, 0};
+  int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if (sock == -1) {
+    return -1;
+  }
+
+  // Closing with a reset right after the handshake leaves no TIME_WAIT
+  // behind, however fast probes go out.
+  setsockopt(sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  probe->fd = sock;
+
+  // Even a local host's answer comes after connect() returns; anything
+  // else is a failure to send (no route, no local port left).
+  if (connect(sock, (const struct sockaddr *)&target->address,
+              sizeof(target->address)) == 0 ||
+      errno != EINPROGRESS) {
+    return -1;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLOUT;
+  event.data.u32 = probe->id;
+  if (epoll_ctl(connects, EPOLL_CTL_ADD, sock, &event) == -1) {
+    return -1;
+  }
+
+  return 0;
+}
+
+void read_connects(int connects, struct target_table *table,
+                   struct probe_table *probes, int quiet) {
+  struct epoll_event events[RECV_BATCH];
+  int ready;
+
+  do {
+    ready = epoll_wait(connects, events, RECV_BATCH, 0);
+    long long now = now_ns();
+
+    for (int i = 0; i < ready; i++) {
+      uint32_t id = events[i].data.u32;
+      struct probe *probe = &probes->probes[id & (MAX_OUTSTANDING - 1)];
+
+      // Its socket may have been closed since, by an earlier event.
+      if (probe->target == -1 || probe->id != id || probe->fd == -1) {
+        continue;
+      }
+
+      struct target *target = &table->targets[probe->target];
+      int error = 0;
+      socklen_t error_len = sizeof(error);
+      getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+
+      long long rtt = now - probe->sent_ns;
+      const char *note = "";
+
+      // The kernel timed the SYN-ACK against its SYN; a reset (refused)
+      // answers the SYN just as well, but only we timed it.
+      if (error == 0) {
+        struct tcp_info info;
+        socklen_t info_len = sizeof(info);
+
+        if (getsockopt(probe->fd, IPPROTO_TCP, TCP_INFO, &info,
+                       &info_len) == 0 &&
+            info.tcpi_rtt > 0) {
+          rtt = info.tcpi_rtt * 1000LL;
+        }
+      } else if (error == ECONNREFUSED) {
+        note = " (refused)";
+      } else {
+        // Unreachable: no answer to time, the probe counts as lost.
+        probe_remove(probes, probe);
+        continue;
+      }
+
+      count_reply(table, probes, target, probe, probe->seq, rtt, 0, note,
+                  quiet);
+    }
+  } while (ready == RECV_BATCH);
+}
+
+int handle_hop(struct target_table *table, struct probe_table *probes,
+               struct in_addr from, const char *packet, int len, uint16_t id,
+               long long now, const struct kernel_timestamp *rx, int quiet) {
+  // The router quotes our IP header and at least 8 bytes after it: the
+  // ICMP header, with the identifier and sequence number.
+  if (len < ICMP_HDRLEN + (int)sizeof(struct ip) + ICMP_HDRLEN ||
+      inet_checksum(packet, len) != 0) {
+    return -1;
+  }
+
+  const struct icmp *icmphdr = (const struct icmp *)packet;
+  const struct ip *quoted_ip = (const struct ip *)(packet + ICMP_HDRLEN);
+  int quoted_hl = quoted_ip->ip_hl * 4;
+
+  if (icmphdr->icmp_type != ICMP_TIMXCEED ||
+      icmphdr->icmp_code != ICMP_TIMXCEED_INTRANS ||
+      quoted_ip->ip_p != IPPROTO_ICMP || quoted_hl < (int)sizeof(struct ip) ||
+      len < ICMP_HDRLEN + quoted_hl + ICMP_HDRLEN) {
+    return -1;
+  }
+
+  const char *quoted = packet + ICMP_HDRLEN + quoted_hl;
+  const struct icmp *quoted_icmp = (const struct icmp *)quoted;
+  if (quoted_icmp->icmp_type != ICMP_ECHO ||
+      ntohs(quoted_icmp->icmp_id) != id) {
+    return -1;
+  }
+
+  struct target *target = target_find(table, quoted_ip->ip_dst);
+  if (target == NULL) {
+    return -1;
+  }
+
+  uint16_t seq = ntohs(quoted_icmp->icmp_seq);
+  struct probe *probe =
+      probe_find(probes, (int)(target - table->targets), seq);
+
+  // One given up on already is left out of the hop's RTTs.
+  if (probe == NULL || probe->ttl == 0) {
+    return -1;
+  }
+
+  // Routers that quote more than 8 bytes quote our payload too.
+  struct probe_payload payload;
+  if (len >= ICMP_HDRLEN + quoted_hl + ICMP_HDRLEN + (int)sizeof(payload)) {
+    memcpy(&payload, quoted + ICMP_HDRLEN, sizeof(payload));
+    if (payload.magic != PROBE_MAGIC || payload.probe != probe->id) {
+      return -1;
+    }
+  }
+
+  long long rtt = timestamps_diff(&probe->tx, rx);
+  if (rtt < 0) {
+    rtt = now - probe->sent_ns;
+  }
+
+  int ttl = probe->ttl;
+  struct hop *hop = &target->hops[ttl - 1];
+
+  if (hop->received > 0 && hop->address.s_addr != from.s_addr) {
+    hop->changes++;
+  }
+  hop->address = from;
+  hop->received++;
+  stats_add(&hop->stats, rtt);
+  probe_remove(probes, probe);
+
+  // The last TTL probed expired on the way: the path got longer, so the
+  // next rounds go out to max_hops again until the target answers.
+  if (ttl == target->ttl_limit) {
+    target->ttl_limit = table->max_hops;
+  }
+
+  if (!quiet) {
+    char router[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from, router, sizeof(router));
+    printf("Hop %d to %s: %s, Seq = %d, time = %lld.%06lld ms\n", ttl,
+           target->name, router, seq, rtt / 1000000, rtt % 1000000);
+  }
+
+  return 0;
+}
+
+int arm_timer(int timer, long long deadline) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+
+  // A zero it_value would disarm the timer instead.
+  if (deadline <= 0) {
+    deadline = 1;
+  }
+
+  spec.it_value.tv_sec = deadline / 1000000000LL;
+  spec.it_value.tv_nsec = deadline % 1000000000LL;
+
+  return timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/**
+ * Finds the histogram bucket of an RTT.
+ * @param us The RTT in microseconds.
+ * @return The bucket.
+ */
+static int histogram_bucket(long long us) {
+  if (us >= 1LL << HIST_MAX_BITS) {
+    us = (1LL << HIST_MAX_BITS) - 1;
+  }
+
+  if (us < HIST_SUB_BUCKETS) {
+    return (int)us;
+  }
+
+  int msb = 63 - __builtin_clzll((unsigned long long)us);
+  int shift = msb - HIST_SUB_BITS;
+
+  return ((shift + 1) << HIST_SUB_BITS) +
+         (int)((us >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+void stats_add(struct rtt_stats *stats, long long rtt) {
+  if (stats->samples == 0 || rtt < stats->min_ns) {
+    stats->min_ns = rtt;
+  }
+  if (rtt > stats->max_ns) {
+    stats->max_ns = rtt;
+  }
+
+  stats->samples++;
+  double delta = rtt - stats->mean_ns;
+  stats->mean_ns += delta / stats->samples;
+  stats->m2 += delta * (rtt - stats->mean_ns);
+
+  // RFC 3550 6.4.1: J += (|D| - J) / 16, D the change in transit time
+  // between consecutive packets, kept scaled by 16 to stay in integers.
+  if (stats->samples > 1) {
+    long long d = rtt - stats->last_ns;
+    if (d < 0) {
+      d = -d;
+    }
+    stats->jitter_x16 += d - ((stats->jitter_x16 + 8) >> 4);
+  }
+  stats->last_ns = rtt;
+
+  stats->histogram[histogram_bucket(rtt / 1000)]++;
+}
+
+long long stats_quantile(const struct rtt_stats *stats, double quantile) {
+  long long rank = (long long)(quantile * stats->samples + 0.5);
+  long long seen = 0;
+
+  if (rank < 1) {
+    rank = 1;
+  }
+
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += stats->histogram[b];
+    if (seen < rank) {
+      continue;
+    }
+
+    // Bucket b covers [low, low + width) microseconds.
+    long long low = b;
+    long long width = 1;
+    if (b >= HIST_SUB_BUCKETS) {
+      int shift = (b >> HIST_SUB_BITS) - 1;
+      low = (long long)(HIST_SUB_BUCKETS + (b & (HIST_SUB_BUCKETS - 1)))
+            << shift;
+      width = 1LL << shift;
+    }
+
+    long long rtt = low * 1000 + width * 500;
+    if (rtt < stats->min_ns) {
+      rtt = stats->min_ns;
+    }
+    if (rtt > stats->max_ns) {
+      rtt = stats->max_ns;
+    }
+    return rtt;
+  }
+
+  return stats->max_ns;
+}
+
+void print_summary(const struct target_table *table) {
+  printf("\n");
+
+  for (int i = 0; i < table->count; i++) {
+    const struct target *target = &table->targets[i];
+    const struct rtt_stats *stats = &target->stats;
+    char ip[INET_ADDRSTRLEN];
+
+    if (target->state == TARGET_DUPLICATE) {
+      continue;
+    }
+    if (target->sent == 0 && target->state != TARGET_RESOLVED) {
+      printf("%s : not resolved\n", target->name);
+      continue;
+    }
+    if (target->hops != NULL) {
+      print_path(target);
+      continue;
+    }
+    int loss = target->sent > 0
+                   ? (target->sent - target->received) * 100 / target->sent
+                   : 0;
+
+    inet_ntop(AF_INET, &target->address.sin_addr, ip, sizeof(ip));
+    printf("%s (%s) : xmt/rcv/%%loss = %d/%d/%d%%", target->name, ip,
+           target->sent, target->received, loss);
+
+    if (stats->samples > 0) {
+      printf(", min/avg/max/mdev = %.3f/%.3f/%.3f/%.3f ms, "
+             "p50/p99/p99.9 = %.3f/%.3f/%.3f ms, jitter = %.3f ms",
+             stats->min_ns / 1e6, stats->mean_ns / 1e6, stats->max_ns / 1e6,
+             sqrt(stats->m2 / stats->samples) / 1e6,
+             stats_quantile(stats, 0.5) / 1e6,
+             stats_quantile(stats, 0.99) / 1e6,
+             stats_quantile(stats, 0.999) / 1e6, stats->jitter_x16 / 16e6);
+    }
+
+    if (target->late > 0 || target->duplicates > 0 || target->reordered > 0) {
+      printf(", late = %d, dup = %d, reordered = %d", target->late,
+             target->duplicates, target->reordered);
+    }
+    if (target->skipped > 0) {
+      printf(", skipped = %d", target->skipped);
+    }
+    printf("\n");
+
+    if (target->sizes != NULL) {
+      print_sweep(target, &table->sweep);
+    }
+  }
+
+  fflush(stdout);
+}
+
+void print_path(const struct target *target) {
+  char ip[INET_ADDRSTRLEN];
+  int last = target->ttl_limit;
+  int reached =
+      target->hops[last - 1].address.s_addr == target->address.sin_addr.s_addr;
+
+  // A target that never answered: its path as far as routers answer.
+  while (!reached && last > 1 && target->hops[last - 1].received == 0) {
+    last--;
+  }
+
+  inet_ntop(AF_INET, &target->address.sin_addr, ip, sizeof(ip));
+  if (reached) {
+    printf("%s (%s) : %d hops\n", target->name, ip, last);
+  } else {
+    printf("%s (%s) : not reached within %d hops\n", target->name, ip,
+           target->ttl_limit);
+  }
+
+  printf("  %3s %-15s %7s %7s %5s %11s %11s %11s\n", "ttl", "address", "xmt",
+         "rcv", "loss", "min ms", "p50 ms", "p99 ms");
+
+  for (int ttl = 1; ttl <= last; ttl++) {
+    const struct hop *hop = &target->hops[ttl - 1];
+    int loss = hop->sent > 0 ? (hop->sent - hop->received) * 100 / hop->sent
+                             : 0;
+
+    if (hop->received == 0) {
+      printf("  %3d %-15s %7d %7d %4d%%\n", ttl, "*", hop->sent, 0, loss);
+      continue;
+    }
+
+    inet_ntop(AF_INET, &hop->address, ip, sizeof(ip));
+    printf("  %3d %-15s %7d %7d %4d%% %11.3f %11.3f %11.3f", ttl, ip,
+           hop->sent, hop->received, loss, hop->stats.min_ns / 1e6,
+           stats_quantile(&hop->stats, 0.5) / 1e6,
+           stats_quantile(&hop->stats, 0.99) / 1e6);
+    if (hop->changes > 0) {
+      printf("  (address changed %d times)", hop->changes);
+    }
+    printf("\n");
+  }
+}
+
+void print_sweep(const struct target *target, const struct size_sweep *sweep) {
+  int answered = -1; // Largest size with a reply.
+  int step_at = -1;  // Size after the largest rise in minimum RTT.
+  long long step_ns = 0;
+  int previous = -1;
+  int rejected = 0, lost = 0;
+
+  printf("  %6s %7s %7s %7s %11s %11s %11s\n", "bytes", "xmt", "rcv",
+         "refused", "min ms", "p50 ms", "p99 ms");
+
+  for (int i = 0; i < sweep->count; i++) {
+    const struct size_stats *size = &target->sizes[i];
+
+    printf("  %6d %7d %7d %7d", sweep->min + i * sweep->step, size->sent,
+           size->received, size->rejected);
+    if (size->received == 0) {
+      printf("\n");
+      continue;
+    }
+    printf(" %11.3f %11.3f %11.3f\n", size->stats.min_ns / 1e6,
+           stats_quantile(&size->stats, 0.5) / 1e6,
+           stats_quantile(&size->stats, 0.99) / 1e6);
+
+    if (previous != -1 &&
+        size->stats.min_ns - target->sizes[previous].stats.min_ns > step_ns) {
+      step_ns = size->stats.min_ns - target->sizes[previous].stats.min_ns;
+      step_at = i;
+    }
+    previous = i;
+    answered = i;
+  }
+
+  if (answered == -1) {
+    printf("  No size got a reply.\n");
+    return;
+  }
+
+  // With DF, the cliff is where replies stop for good. The fit is over the
+  // sizes below it, and when fragmenting, below the largest step.
+  int fit_end = answered;
+  if (sweep->fragment && step_at > 0) {
+    fit_end = step_at - 1;
+  }
+
+  double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (int i = 0; i <= fit_end; i++) {
+    if (target->sizes[i].received == 0) {
+      continue;
+    }
+    double x = sweep->min + i * sweep->step;
+    double y = target->sizes[i].stats.min_ns;
+    n++;
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+  }
+
+  if (n >= 2 && n * sxx - sx * sx > 0) {
+    double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx); // ns per byte
+
+    // Each byte crosses the path twice, in the request and in the reply.
+    if (slope > 0) {
+      printf("  Cost per byte : %.3f ns round trip, as if serialized at "
+             "%.1f Mbit/s each way.\n",
+             slope, 16e3 / slope);
+    } else {
+      printf("  Cost per byte : too small to measure.\n");
+    }
+  }
+
+  if (sweep->fragment) {
+    if (step_at > 0) {
+      printf("  Largest step : +%.3f ms from %d to %d bytes.\n",
+             step_ns / 1e6, sweep->min + (step_at - 1) * sweep->step,
+             sweep->min + step_at * sweep->step);
+    }
+    return;
+  }
+
+  for (int i = answered + 1; i < sweep->count; i++) {
+    rejected += target->sizes[i].rejected;
+    lost += target->sizes[i].sent - target->sizes[i].rejected;
+  }
+
+  if (answered == sweep->count - 1) {
+    printf("  MTU cliff : none, every size up to %d bytes (%d-byte packets) "
+           "got through.\n",
+           sweep->min + answered * sweep->step,
+           (int)(sweep->min + answered * sweep->step + ICMP_HDRLEN +
+                 sizeof(struct ip)));
+  } else {
+    int last = sweep->min + answered * sweep->step;
+    printf("  MTU cliff : replies stop after %d bytes (%d-byte packets); "
+           "above it %d probes were refused locally (known MTU) and %d "
+           "lost%s.\n",
+           last, (int)(last + ICMP_HDRLEN + sizeof(struct ip)), rejected,
+           lost, lost > 0 ? " (a black hole, if they weren't just dropped)"
+                          : "");
+  }
+}
+
+long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void handle_signal(int signum) {
+  if (signum == SIGQUIT) {
+    report = 1;
+  } else {
+    stop = 1;
+  }
+}
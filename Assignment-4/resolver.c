@@ -0,0 +1,401 @@
+#include "resolver.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define MAX_NAME_LEN 256
+
+/**
+ * A cached name: its last result, or the lookup running for it.
+ */
+struct entry {
+  char name[MAX_NAME_LEN];
+  int pending; // A lookup is queued or running.
+  int status;
+  struct in_addr address;
+  long long expires_ns;
+  int *waiters; // Tags of the submissions waiting for the lookup.
+  int waiting;
+  int waiters_capacity;
+  int next;     // Next entry in the same hash bucket, -1 if none.
+  int next_job; // Next entry to look up, -1 if none.
+};
+
+struct resolver {
+  pthread_mutex_t lock;
+  pthread_cond_t work; // Signalled when a lookup is queued or on shutdown.
+  pthread_t *threads;
+  int thread_count;
+  int quit;
+  int event_fd;
+  long long ttl_ns;
+
+  // Entries are referred to by index: the array moves when it grows.
+  struct entry *entries;
+  int count;
+  int capacity;
+  int *buckets; // First entry of each bucket, -1 if none.
+  int mask;     // Number of buckets - 1.
+
+  int first_job; // Lookups waiting for a thread, oldest first.
+  int last_job;
+
+  struct resolver_result *results; // Waiting for resolver_next().
+  int results_head;
+  int results_count;
+  int results_capacity;
+};
+
+/**
+ * Reads CLOCK_MONOTONIC.
+ * @return The time in nanoseconds.
+ */
+static long long monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Hashes a name (FNV-1a).
+ * @param name The name.
+ * @return Its hash.
+ */
+static uint32_t hash_name(const char *name) {
+  uint32_t hash = 2166136261u;
+
+  for (; *name != '\0'; name++) {
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+  }
+
+  return hash;
+}
+
+/**
+ * Queues the result of an entry for a tag. Called with the lock held.
+ * @param resolver The resolver.
+ * @param entry The entry.
+ * @param tag The tag.
+ * @return 0 on success, -1 on error.
+ */
+static int push_result(struct resolver *resolver, const struct entry *entry,
+                       int tag) {
+  if (resolver->results_count == resolver->results_capacity) {
+    int capacity =
+        resolver->results_capacity ? resolver->results_capacity * 2 : 64;
+    struct resolver_result *results =
+        malloc(capacity * sizeof(struct resolver_result));
+
+    if (results == NULL) {
+      return -1;
+    }
+
+    // Unwrap the ring into the new array.
+    for (int i = 0; i < resolver->results_count; i++) {
+      results[i] = resolver->results[(resolver->results_head + i) %
+                                     resolver->results_capacity];
+    }
+
+    free(resolver->results);
+    resolver->results = results;
+    resolver->results_head = 0;
+    resolver->results_capacity = capacity;
+  }
+
+  struct resolver_result *result =
+      &resolver->results[(resolver->results_head + resolver->results_count) %
+                         resolver->results_capacity];
+  result->tag = tag;
+  result->status = entry->status;
+  result->address = entry->address;
+  result->expires_ns = entry->expires_ns;
+  resolver->results_count++;
+
+  return 0;
+}
+
+/**
+ * Finds the entry of a name, adding an empty one if there is none. Called
+ * with the lock held.
+ * @param resolver The resolver.
+ * @param name The name.
+ * @return The index of the entry, or -1 on error.
+ */
+static int find_entry(struct resolver *resolver, const char *name) {
+  uint32_t hash = hash_name(name);
+
+  for (int i = resolver->buckets[hash & resolver->mask]; i != -1;
+       i = resolver->entries[i].next) {
+    if (strcmp(resolver->entries[i].name, name) == 0) {
+      return i;
+    }
+  }
+
+  if (resolver->count == resolver->capacity) {
+    int capacity = resolver->capacity * 2;
+    struct entry *entries =
+        realloc(resolver->entries, capacity * sizeof(struct entry));
+    int *buckets = malloc(capacity * 2 * sizeof(int));
+
+    if (entries == NULL || buckets == NULL) {
+      if (entries != NULL) {
+        resolver->entries = entries;
+      }
+      free(buckets);
+      return -1;
+    }
+
+    // Twice as many buckets as entries, rehashed.
+    resolver->entries = entries;
+    resolver->capacity = capacity;
+    free(resolver->buckets);
+    resolver->buckets = buckets;
+    resolver->mask = capacity * 2 - 1;
+    memset(buckets, -1, capacity * 2 * sizeof(int));
+
+    for (int i = 0; i < resolver->count; i++) {
+      int bucket = hash_name(entries[i].name) & resolver->mask;
+      entries[i].next = buckets[bucket];
+      buckets[bucket] = i;
+    }
+  }
+
+  int index = resolver->count++;
+  int bucket = hash & resolver->mask;
+  struct entry *entry = &resolver->entries[index];
+
+  memset(entry, 0, sizeof(struct entry));
+  snprintf(entry->name, sizeof(entry->name), "%s", name);
+  entry->next = resolver->buckets[bucket];
+  entry->next_job = -1;
+  resolver->buckets[bucket] = index;
+
+  return index;
+}
+
+/**
+ * Looks up queued names until the resolver is destroyed.
+ * @param arg The resolver.
+ * @return NULL.
+ */
+static void *resolver_thread(void *arg) {
+  struct resolver *resolver = arg;
+  char name[MAX_NAME_LEN];
+
+  pthread_mutex_lock(&resolver->lock);
+
+  while (1) {
+    while (!resolver->quit && resolver->first_job == -1) {
+      pthread_cond_wait(&resolver->work, &resolver->lock);
+    }
+    if (resolver->quit) {
+      break;
+    }
+
+    int index = resolver->first_job;
+    resolver->first_job = resolver->entries[index].next_job;
+    if (resolver->first_job == -1) {
+      resolver->last_job = -1;
+    }
+    memcpy(name, resolver->entries[index].name, sizeof(name));
+    pthread_mutex_unlock(&resolver->lock);
+
+    struct addrinfo hints;
+    struct addrinfo *info = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_RAW;
+    hints.ai_protocol = IPPROTO_ICMP;
+
+    int status = getaddrinfo(name, NULL, &hints, &info);
+    if (status == 0 && info == NULL) {
+      status = EAI_NONAME;
+    }
+
+    pthread_mutex_lock(&resolver->lock);
+    struct entry *entry = &resolver->entries[index];
+
+    entry->pending = 0;
+    entry->status = status;
+    if (status == 0) {
+      entry->address = ((struct sockaddr_in *)info->ai_addr)->sin_addr;
+      entry->expires_ns = monotonic_ns() + resolver->ttl_ns;
+      freeaddrinfo(info);
+    } else {
+      entry->expires_ns =
+          monotonic_ns() + RESOLVER_NEGATIVE_TTL_S * 1000000000LL;
+    }
+
+    for (int i = 0; i < entry->waiting; i++) {
+      push_result(resolver, entry, entry->waiters[i]);
+    }
+    entry->waiting = 0;
+
+    uint64_t one = 1;
+    write(resolver->event_fd, &one, sizeof(one));
+  }
+
+  pthread_mutex_unlock(&resolver->lock);
+  return NULL;
+}
+
+struct resolver *resolver_create(int threads, int ttl_s) {
+  struct resolver *resolver = calloc(1, sizeof(struct resolver));
+  if (resolver == NULL) {
+    return NULL;
+  }
+
+  resolver->ttl_ns = ttl_s * 1000000000LL;
+  resolver->first_job = -1;
+  resolver->last_job = -1;
+  resolver->capacity = 64;
+  resolver->mask = 127;
+  resolver->entries = malloc(resolver->capacity * sizeof(struct entry));
+  resolver->buckets = malloc((resolver->mask + 1) * sizeof(int));
+  resolver->threads = calloc(threads, sizeof(pthread_t));
+  resolver->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (resolver->entries == NULL || resolver->buckets == NULL ||
+      resolver->threads == NULL || resolver->event_fd == -1) {
+    printf("Error : Resolver allocation failed.\n");
+    if (resolver->event_fd != -1) {
+      close(resolver->event_fd);
+    }
+    free(resolver->entries);
+    free(resolver->buckets);
+    free(resolver->threads);
+    free(resolver);
+    return NULL;
+  }
+
+  memset(resolver->buckets, -1, (resolver->mask + 1) * sizeof(int));
+  pthread_mutex_init(&resolver->lock, NULL);
+  pthread_cond_init(&resolver->work, NULL);
+
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&resolver->threads[i], NULL, resolver_thread,
+                       resolver) != 0) {
+      break;
+    }
+    resolver->thread_count++;
+  }
+
+  if (resolver->thread_count == 0) {
+    printf("Error : No resolver thread could be started.\n");
+    resolver_destroy(resolver);
+    return NULL;
+  }
+
+  return resolver;
+}
+
+int resolver_fd(const struct resolver *resolver) {
+  return resolver->event_fd;
+}
+
+int resolver_submit(struct resolver *resolver, const char *name, int tag) {
+  pthread_mutex_lock(&resolver->lock);
+
+  int index = find_entry(resolver, name);
+  if (index == -1) {
+    pthread_mutex_unlock(&resolver->lock);
+    printf("Error : Resolver allocation failed.\n");
+    return -1;
+  }
+
+  struct entry *entry = &resolver->entries[index];
+
+  // Still fresh: answer from the cache.
+  if (!entry->pending && entry->expires_ns > monotonic_ns()) {
+    int status = push_result(resolver, entry, tag);
+    pthread_mutex_unlock(&resolver->lock);
+
+    uint64_t one = 1;
+    write(resolver->event_fd, &one, sizeof(one));
+    return status;
+  }
+
+  if (entry->waiting == entry->waiters_capacity) {
+    int capacity = entry->waiters_capacity ? entry->waiters_capacity * 2 : 1;
+    int *waiters = realloc(entry->waiters, capacity * sizeof(int));
+
+    if (waiters == NULL) {
+      pthread_mutex_unlock(&resolver->lock);
+      printf("Error : Resolver allocation failed.\n");
+      return -1;
+    }
+
+    entry->waiters = waiters;
+    entry->waiters_capacity = capacity;
+  }
+  entry->waiters[entry->waiting++] = tag;
+
+  if (!entry->pending) {
+    entry->pending = 1;
+    entry->next_job = -1;
+    if (resolver->last_job == -1) {
+      resolver->first_job = index;
+    } else {
+      resolver->entries[resolver->last_job].next_job = index;
+    }
+    resolver->last_job = index;
+    pthread_cond_signal(&resolver->work);
+  }
+
+  pthread_mutex_unlock(&resolver->lock);
+  return 0;
+}
+
+int resolver_next(struct resolver *resolver, struct resolver_result *result) {
+  uint64_t events;
+  int found = 0;
+
+  // Reset the eventfd first: a result queued after this wakes epoll again.
+  read(resolver->event_fd, &events, sizeof(events));
+
+  pthread_mutex_lock(&resolver->lock);
+
+  if (resolver->results_count > 0) {
+    *result = resolver->results[resolver->results_head];
+    resolver->results_head =
+        (resolver->results_head + 1) % resolver->results_capacity;
+    resolver->results_count--;
+    found = 1;
+  }
+
+  pthread_mutex_unlock(&resolver->lock);
+  return found;
+}
+
+void resolver_destroy(struct resolver *resolver) {
+  pthread_mutex_lock(&resolver->lock);
+  resolver->quit = 1;
+  pthread_cond_broadcast(&resolver->work);
+  pthread_mutex_unlock(&resolver->lock);
+
+  for (int i = 0; i < resolver->thread_count; i++) {
+    pthread_join(resolver->threads[i], NULL);
+  }
+
+  for (int i = 0; i < resolver->count; i++) {
+    free(resolver->entries[i].waiters);
+  }
+
+  pthread_mutex_destroy(&resolver->lock);
+  pthread_cond_destroy(&resolver->work);
+  close(resolver->event_fd);
+  free(resolver->entries);
+  free(resolver->buckets);
+  free(resolver->threads);
+  free(resolver->results);
+  free(resolver);
+}
@@ -0,0 +1,73 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <netinet/in.h>
+
+/**
+ * Concurrent IPv4 name resolution with an in-process cache.
+ *
+ * Names are resolved with getaddrinfo() by a pool of threads, so thousands
+ * of lookups are in flight at once and the caller never blocks. Each result
+ * is queued along with the tag it was submitted with, and an eventfd
+ * becomes readable, ready for an epoll loop.
+ *
+ * Results are cached by name. getaddrinfo() doesn't report the records'
+ * TTLs, so an address is kept for the TTL given at creation and a failure
+ * for RESOLVER_NEGATIVE_TTL_S; a name submitted again after that is looked
+ * up again, and one submitted while its lookup is running waits for it.
+ */
+
+#define RESOLVER_NEGATIVE_TTL_S 5
+
+/**
+ * The outcome of one lookup.
+ */
+struct resolver_result {
+  int tag;                // As given to resolver_submit().
+  int status;             // 0, or the getaddrinfo() error.
+  struct in_addr address; // The first address, if status is 0.
+  long long expires_ns;   // CLOCK_MONOTONIC time the cache forgets it.
+};
+
+struct resolver;
+
+/**
+ * Starts a resolver.
+ * @param threads The number of lookups run at once.
+ * @param ttl_s How long an address stays cached, in seconds.
+ * @return The resolver, or NULL on error.
+ */
+struct resolver *resolver_create(int threads, int ttl_s);
+
+/**
+ * Returns the descriptor that becomes readable when results are queued.
+ * @param resolver The resolver.
+ * @return The eventfd.
+ */
+int resolver_fd(const struct resolver *resolver);
+
+/**
+ * Asks for a name to be resolved. A result is queued for every call, at
+ * once if the name is cached.
+ * @param resolver The resolver.
+ * @param name The host name.
+ * @param tag Returned with the result.
+ * @return 0 on success, -1 on error.
+ */
+int resolver_submit(struct resolver *resolver, const char *name, int tag);
+
+/**
+ * Takes the next queued result, without blocking.
+ * @param resolver The resolver.
+ * @param result Where to store it.
+ * @return 1 if there was one, 0 otherwise.
+ */
+int resolver_next(struct resolver *resolver, struct resolver_result *result);
+
+/**
+ * Stops the threads, waiting for running lookups, and frees the resolver.
+ * @param resolver The resolver.
+ */
+void resolver_destroy(struct resolver *resolver);
+
+#endif
@@ -0,0 +1,252 @@
+#include "timer_wheel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+#define MAX_DELTA ((1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/**
+ * Links an armed timer into the slot its expiry falls in, seen from the
+ * wheel's current tick.
+ * @param wheel The wheel.
+ * @param id The timer.
+ */
+static void link_timer(struct timer_wheel *wheel, int id) {
+  struct wheel_timer *timer = &wheel->timers[id];
+  long long delta = timer->expires - wheel->tick;
+  int level = 0;
+
+  if (delta < 0) {
+    timer->expires = wheel->tick;
+    delta = 0;
+  } else if (delta > MAX_DELTA) {
+    timer->expires = wheel->tick + MAX_DELTA;
+    delta = MAX_DELTA;
+  }
+
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= 1LL << (WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+
+  int slot = (int)(timer->expires >> (WHEEL_BITS * level)) & SLOT_MASK;
+
+  timer->level = level;
+  timer->slot = slot;
+  timer->prev = -1;
+  timer->next = wheel->heads[level][slot];
+  if (timer->next != -1) {
+    wheel->timers[timer->next].prev = id;
+  }
+  wheel->heads[level][slot] = id;
+  wheel->occupied[level][slot / 64] |= 1ULL << (slot % 64);
+  wheel->counts[level]++;
+}
+
+/**
+ * Unlinks a timer from its slot.
+ * @param wheel The wheel.
+ * @param id The timer.
+ */
+static void unlink_timer(struct timer_wheel *wheel, int id) {
+  struct wheel_timer *timer = &wheel->timers[id];
+  int expiring = timer->level == WHEEL_LEVELS;
+
+  if (timer->prev != -1) {
+    wheel->timers[timer->prev].next = timer->next;
+  } else if (expiring) {
+    wheel->expiring = timer->next;
+  } else {
+    wheel->heads[timer->level][timer->slot] = timer->next;
+  }
+  if (timer->next != -1) {
+    wheel->timers[timer->next].prev = timer->prev;
+  }
+
+  if (expiring) {
+    return;
+  }
+
+  if (wheel->heads[timer->level][timer->slot] == -1) {
+    wheel->occupied[timer->level][timer->slot / 64] &=
+        ~(1ULL << (timer->slot % 64));
+  }
+  wheel->counts[timer->level]--;
+}
+
+/**
+ * Finds the first non-empty slot of a level, going round from a slot.
+ * @param wheel The wheel.
+ * @param level The level.
+ * @param from The slot to start at.
+ * @return How many slots after from it is, or -1 if the level is empty.
+ */
+static int next_occupied(const struct timer_wheel *wheel, int level,
+                         int from) {
+  const uint64_t *bits = wheel->occupied[level];
+
+  for (int i = 0; i <= WHEEL_SLOTS / 64; i++) {
+    int word = (from / 64 + i) % (WHEEL_SLOTS / 64);
+    uint64_t mask = bits[word];
+
+    // The first word is looked at twice: from 'from' on, then below it.
+    if (i == 0) {
+      mask &= ~0ULL << (from % 64);
+    } else if (i == WHEEL_SLOTS / 64) {
+      mask &= (1ULL << (from % 64)) - 1;
+    }
+
+    if (mask != 0) {
+      int slot = word * 64 + __builtin_ctzll(mask);
+      return (slot - from + WHEEL_SLOTS) & SLOT_MASK;
+    }
+  }
+
+  return -1;
+}
+
+int wheel_init(struct timer_wheel *wheel, int capacity, long long now) {
+  memset(wheel, 0, sizeof(struct timer_wheel));
+  memset(wheel->heads, -1, sizeof(wheel->heads));
+  wheel->expiring = -1;
+  wheel->tick = now;
+
+  return wheel_grow(wheel, capacity);
+}
+
+int wheel_grow(struct timer_wheel *wheel, int capacity) {
+  if (capacity <= wheel->capacity) {
+    return 0;
+  }
+
+  struct wheel_timer *timers =
+      realloc(wheel->timers, capacity * sizeof(struct wheel_timer));
+  if (timers == NULL) {
+    return -1;
+  }
+
+  memset(timers + wheel->capacity, 0,
+         (capacity - wheel->capacity) * sizeof(struct wheel_timer));
+  wheel->timers = timers;
+  wheel->capacity = capacity;
+
+  return 0;
+}
+
+void wheel_arm(struct timer_wheel *wheel, int id, long long expires) {
+  struct wheel_timer *timer = &wheel->timers[id];
+
+  if (timer->armed) {
+    unlink_timer(wheel, id);
+  }
+
+  timer->armed = 1;
+  timer->expires = expires;
+  link_timer(wheel, id);
+}
+
+void wheel_cancel(struct timer_wheel *wheel, int id) {
+  struct wheel_timer *timer = &wheel->timers[id];
+
+  if (timer->armed) {
+    unlink_timer(wheel, id);
+    timer->armed = 0;
+  }
+}
+
+long long wheel_next(const struct timer_wheel *wheel) {
+  long long next = -1;
+
+  // Slot s of level l comes up at the first multiple of SLOTS^l, from the
+  // current tick on, whose level-l index is s.
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    if (wheel->counts[level] == 0) {
+      continue;
+    }
+
+    int shift = WHEEL_BITS * level;
+    long long base = (wheel->tick + (1LL << shift) - 1) >> shift;
+    int distance = next_occupied(wheel, level, (int)(base & SLOT_MASK));
+    long long at = (base + distance) << shift;
+
+    if (next == -1 || at < next) {
+      next = at;
+    }
+  }
+
+  return next;
+}
+
+/**
+ * Moves every timer of a slot down to where it now belongs.
+ * @param wheel The wheel.
+ * @param level The level.
+ * @param slot The slot.
+ */
+static void cascade(struct timer_wheel *wheel, int level, int slot) {
+  int id = wheel->heads[level][slot];
+
+  wheel->heads[level][slot] = -1;
+  wheel->occupied[level][slot / 64] &= ~(1ULL << (slot % 64));
+
+  while (id != -1) {
+    int next = wheel->timers[id].next;
+    wheel->counts[level]--;
+    link_timer(wheel, id);
+    id = next;
+  }
+}
+
+void wheel_advance(struct timer_wheel *wheel, long long now,
+                   void (*expire)(int id, void *arg), void *arg) {
+  while (wheel->tick <= now) {
+    long long next = wheel_next(wheel);
+
+    // Ticks with nothing to do are skipped over.
+    if (next == -1 || next > now) {
+      wheel->tick = now + 1;
+      return;
+    }
+    wheel->tick = next;
+
+    // Entering a new range of a level brings its slot down first.
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+      int shift = WHEEL_BITS * level;
+
+      if ((wheel->tick & ((1LL << shift) - 1)) != 0) {
+        break;
+      }
+      cascade(wheel, level, (int)(wheel->tick >> shift) & SLOT_MASK);
+    }
+
+    // The slot's timers move to the expiring list, where expire() can
+    // still cancel them; timers it re-arms go to later slots.
+    int slot = (int)wheel->tick & SLOT_MASK;
+
+    wheel->expiring = wheel->heads[0][slot];
+    wheel->heads[0][slot] = -1;
+    wheel->occupied[0][slot / 64] &= ~(1ULL << (slot % 64));
+    wheel->tick++;
+
+    for (int id = wheel->expiring; id != -1; id = wheel->timers[id].next) {
+      wheel->timers[id].level = WHEEL_LEVELS;
+      wheel->counts[0]--;
+    }
+
+    while (wheel->expiring != -1) {
+      int id = wheel->expiring;
+
+      unlink_timer(wheel, id);
+      wheel->timers[id].armed = 0;
+      expire(id, arg);
+    }
+  }
+}
+
+void wheel_free(struct timer_wheel *wheel) {
+  free(wheel->timers);
+  wheel->timers = NULL;
+  wheel->capacity = 0;
+}
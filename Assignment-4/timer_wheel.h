@@ -0,0 +1,102 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/**
+ * Hierarchical timing wheel.
+ *
+ * Time is counted in ticks. Level 0 has one slot per tick for the next
+ * WHEEL_SLOTS ticks, and every level above covers WHEEL_SLOTS times more
+ * time per slot. A timer goes into the lowest level whose range reaches its
+ * expiry, and is moved down a level when its slot comes up, so arming,
+ * cancelling and expiring a timer are all O(1).
+ *
+ * Timers are identified by small integers (e.g. a client's slot), each
+ * armed at most once at a time.
+ */
+
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 2^32 ticks ahead at most; later ones are capped.
+
+/**
+ * One timer, linked into the slot it waits in.
+ */
+struct wheel_timer {
+  long long expires; // Tick it expires at.
+  int armed;
+  int prev; // Neighbours in the slot, -1 if none.
+  int next;
+  int level; // Where it is linked; WHEEL_LEVELS while it expires.
+  int slot;
+};
+
+struct timer_wheel {
+  long long tick; // Next tick to process.
+  struct wheel_timer *timers;
+  int capacity;
+  int heads[WHEEL_LEVELS][WHEEL_SLOTS]; // First timer of each slot, or -1.
+  uint64_t occupied[WHEEL_LEVELS][WHEEL_SLOTS / 64]; // Non-empty slots.
+  int counts[WHEEL_LEVELS]; // Timers linked in each level.
+  int expiring;             // Timers being expired, -1 if none.
+};
+
+/**
+ * Sets up an empty wheel.
+ * @param wheel The wheel.
+ * @param capacity The number of timers, ids 0 to capacity - 1.
+ * @param now The current tick.
+ * @return 0 on success, -1 on error.
+ */
+int wheel_init(struct timer_wheel *wheel, int capacity, long long now);
+
+/**
+ * Makes room for more timers.
+ * @param wheel The wheel.
+ * @param capacity The new number of timers, at least the old one.
+ * @return 0 on success, -1 on error.
+ */
+int wheel_grow(struct timer_wheel *wheel, int capacity);
+
+/**
+ * Arms a timer, re-arming it if it already is.
+ * @param wheel The wheel.
+ * @param id The timer.
+ * @param expires The tick it expires at; one already past expires on the
+ * next wheel_advance().
+ */
+void wheel_arm(struct timer_wheel *wheel, int id, long long expires);
+
+/**
+ * Disarms a timer, if it is armed.
+ * @param wheel The wheel.
+ * @param id The timer.
+ */
+void wheel_cancel(struct timer_wheel *wheel, int id);
+
+/**
+ * Finds the next tick at which wheel_advance() has work to do: a timer
+ * expiring, or timers to move down a level.
+ * @param wheel The wheel.
+ * @return The tick, or -1 if no timer is armed.
+ */
+long long wheel_next(const struct timer_wheel *wheel);
+
+/**
+ * Expires every timer due up to a tick, disarming them first.
+ * @param wheel The wheel.
+ * @param now The current tick.
+ * @param expire Called with each expired timer, which it may re-arm.
+ * @param arg Passed to expire.
+ */
+void wheel_advance(struct timer_wheel *wheel, long long now,
+                   void (*expire)(int id, void *arg), void *arg);
+
+/**
+ * Frees the wheel's timers.
+ * @param wheel The wheel.
+ */
+void wheel_free(struct timer_wheel *wheel);
+
+#endif
@@ -0,0 +1,132 @@
+#include "timestamps.h"
+
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+
+#define CONTROL_LEN 512
+
+/**
+ * Converts a timespec to nanoseconds.
+ * @param ts The timespec.
+ * @return Its value in nanoseconds.
+ */
+static long long timespec_ns(const struct timespec *ts) {
+  return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+int timestamps_enable(int sock, const char *iface) {
+  int hardware = 0;
+
+  if (iface != NULL) {
+    struct hwtstamp_config config;
+    struct ifreq request;
+
+    memset(&config, 0, sizeof(config));
+    config.tx_type = HWTSTAMP_TX_ON;
+    config.rx_filter = HWTSTAMP_FILTER_ALL;
+
+    memset(&request, 0, sizeof(request));
+    snprintf(request.ifr_name, sizeof(request.ifr_name), "%s", iface);
+    request.ifr_data = (char *)&config;
+
+    if (ioctl(sock, SIOCSHWTSTAMP, &request) == 0) {
+      hardware = 1;
+    } else {
+      printf("%s has no hardware timestamping, using software ones.\n",
+             iface);
+    }
+  }
+
+  // OPT_ID tags every TX timestamp with the index of its send, and
+  // OPT_TSONLY keeps the kernel from looping the whole packet back with it.
+  int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+              SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE |
+              SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+              SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+  if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) ==
+      -1) {
+    perror("setsockopt SO_TIMESTAMPING");
+    return -1;
+  }
+
+  return hardware;
+}
+
+void timestamps_rx(struct msghdr *msg, struct kernel_timestamp *ts) {
+  memset(ts, 0, sizeof(struct kernel_timestamp));
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SO_TIMESTAMPING) {
+      struct scm_timestamping stamps;
+      memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+
+      // ts[1] is deprecated; ts[0] is software and ts[2] raw hardware.
+      ts->software_ns = timespec_ns(&stamps.ts[0]);
+      ts->hardware_ns = timespec_ns(&stamps.ts[2]);
+    }
+  }
+}
+
+int timestamps_tx(int sock, unsigned int *index, struct kernel_timestamp *ts) {
+  char control[CONTROL_LEN];
+  char data[64];
+  struct iovec iov = {data, sizeof(data)};
+  struct msghdr msg;
+
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      return -1;
+    }
+
+    int found = 0;
+    timestamps_rx(&msg, ts);
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) {
+        struct sock_extended_err err;
+        memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+
+        if (err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+          *index = err.ee_data;
+          found = 1;
+        }
+      }
+    }
+
+    // Anything else in the error queue (ICMP errors) isn't ours to handle.
+    if (found) {
+      return 0;
+    }
+  }
+}
+
+long long timestamps_diff(const struct kernel_timestamp *tx,
+                          const struct kernel_timestamp *rx) {
+  if (tx->hardware_ns != 0 && rx->hardware_ns != 0) {
+    return rx->hardware_ns - tx->hardware_ns;
+  }
+
+  if (tx->software_ns != 0 && rx->software_ns != 0) {
+    return rx->software_ns - tx->software_ns;
+  }
+
+  return -1;
+}
@@ -0,0 +1,64 @@
+#ifndef TIMESTAMPS_H
+#define TIMESTAMPS_H
+
+#include <sys/socket.h>
+
+/**
+ * Kernel packet timestamps (SO_TIMESTAMPING) for RTT measurement.
+ *
+ * The kernel stamps every packet the socket sends as it is handed to the
+ * device (software) or leaves the NIC (hardware), and every packet it
+ * receives as it arrives. RX timestamps come with the packet; TX timestamps
+ * are read back from the socket's error queue, each tagged with the index
+ * of the send it belongs to, counted from 0 for each socket.
+ *
+ * Software timestamps are CLOCK_REALTIME, hardware ones the NIC's PTP clock,
+ * so only timestamps of the same kind may be subtracted.
+ */
+
+/**
+ * The timestamps the kernel attached to one packet, in nanoseconds.
+ */
+struct kernel_timestamp {
+  long long software_ns; // 0 if there is none.
+  long long hardware_ns; // 0 if there is none.
+};
+
+/**
+ * Asks the kernel to timestamp the socket's packets.
+ * @param sock The socket.
+ * @param iface An interface to switch hardware timestamping on for, or NULL
+ * for software timestamps only. Hardware timestamps are still reported if
+ * something else (e.g. ptp4l) already switched them on.
+ * @return 1 if hardware timestamping was switched on, 0 if only software
+ * timestamps are available, -1 on error.
+ */
+int timestamps_enable(int sock, const char *iface);
+
+/**
+ * Extracts the RX timestamps of a packet received with recvmsg().
+ * @param msg The message, with its control data.
+ * @param ts Where to store the timestamps.
+ */
+void timestamps_rx(struct msghdr *msg, struct kernel_timestamp *ts);
+
+/**
+ * Reads one TX timestamp from the socket's error queue, without blocking.
+ * @param sock The socket.
+ * @param index Where to store the index of the send it belongs to.
+ * @param ts Where to store the timestamps.
+ * @return 0 on success, -1 if the queue is empty.
+ */
+int timestamps_tx(int sock, unsigned int *index, struct kernel_timestamp *ts);
+
+/**
+ * Computes the time between two timestamps, preferring hardware ones.
+ * @param tx The earlier timestamps.
+ * @param rx The later timestamps.
+ * @return The difference in nanoseconds, or -1 if the two have no kind of
+ * timestamp in common.
+ */
+long long timestamps_diff(const struct kernel_timestamp *tx,
+                          const struct kernel_timestamp *rx);
+
+#endif
@@ -0,0 +1,616 @@
+#include "tsdb.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define STREAM_BITS ((TSDB_BLOCK_SIZE - sizeof(struct tsdb_block_header)) * 8)
+#define MAX_SAMPLE_BITS (4 + 32 + 2 + 5 + 6 + 64) // The worst case.
+#define PENDING_BLOCKS 16 // Blocks written to the data file at once.
+#define MAX_NAME_LEN 256
+#define NO_WINDOW 65 // No value was XOR-encoded yet.
+
+/**
+ * A series being appended to, and its block being filled.
+ */
+struct series {
+  char name[MAX_NAME_LEN];
+  unsigned char *block; // NULL until its first sample.
+  int bits;             // Of the stream used.
+  uint32_t count;
+  int64_t last_ms;
+  int64_t last_delta;
+  uint64_t last_value; // The previous value's bits.
+  int leading;         // Zeros around the previous XOR's meaningful bits.
+  int trailing;
+  int64_t min_ms;
+  int64_t max_ms;
+  int next; // Next series in the same hash bucket, -1 if none.
+};
+
+struct tsdb {
+  char dir[MAX_NAME_LEN];
+  int data_fd;
+  int names_fd;
+  uint32_t blocks; // In the data file, those pending included.
+  struct series *series;
+  int count;
+  int capacity;
+  int *buckets; // First series of each bucket, -1 if none.
+  int mask;
+  unsigned char *pending; // Sealed blocks not written yet...
+  struct tsdb_entry entries[PENDING_BLOCKS]; // ...their index entries...
+  int owners[PENDING_BLOCKS];                // ...and series.
+  int pending_count;
+};
+
+/**
+ * Appends bits to a stream, most significant first.
+ * @param stream The stream, zeroed beyond what was written.
+ * @param bits The bits written so far, advanced.
+ * @param value The bits, in its low n bits.
+ * @param n How many, up to 64.
+ */
+static void put_bits(unsigned char *stream, int *bits, uint64_t value, int n) {
+  while (n > 0) {
+    int room = 8 - (*bits & 7);
+    int take = n < room ? n : room;
+    unsigned int chunk =
+        (unsigned int)(value >> (n - take)) & ((1u << take) - 1);
+
+    stream[*bits >> 3] |= chunk << (room - take);
+    *bits += take;
+    n -= take;
+  }
+}
+
+/**
+ * Reads bits back from a stream.
+ * @param stream The stream.
+ * @param bits The bits read so far, advanced.
+ * @param limit The bits in the stream.
+ * @param n How many to read, up to 64.
+ * @param value Where to store them.
+ * @return 0, or -1 if the stream ends first.
+ */
+static int get_bits(const unsigned char *stream, int *bits, int limit, int n,
+                    uint64_t *value) {
+  if (*bits + n > limit) {
+    return -1;
+  }
+
+  *value = 0;
+  while (n > 0) {
+    int room = 8 - (*bits & 7);
+    int take = n < room ? n : room;
+    unsigned int chunk =
+        (stream[*bits >> 3] >> (room - take)) & ((1u << take) - 1);
+
+    *value = *value << take | chunk;
+    *bits += take;
+    n -= take;
+  }
+
+  return 0;
+}
+
+/**
+ * Reads the wall clock.
+ * @return The time in milliseconds since the epoch.
+ */
+static int64_t wall_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Writes all of a buffer, however many calls it takes.
+ * @param fd The file.
+ * @param buffer The buffer.
+ * @param len Its length.
+ * @return 0 on success, -1 on error.
+ */
+static int write_all(int fd, const void *buffer, size_t len) {
+  const char *data = buffer;
+
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      perror("tsdb write");
+      return -1;
+    }
+    data += written;
+    len -= written;
+  }
+
+  return 0;
+}
+
+/**
+ * Writes the pending blocks, then their index entries.
+ * @param db The store.
+ * @return 0 on success, -1 on error.
+ */
+static int flush_pending(struct tsdb *db) {
+  int status = 0;
+
+  if (db->pending_count == 0) {
+    return 0;
+  }
+
+  if (write_all(db->data_fd, db->pending,
+                (size_t)db->pending_count * TSDB_BLOCK_SIZE) == -1) {
+    status = -1;
+  }
+
+  for (int i = 0; i < db->pending_count && status == 0; i++) {
+    char path[2 * MAX_NAME_LEN];
+    snprintf(path, sizeof(path), "%s/index/%d", db->dir, db->owners[i]);
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      perror("tsdb index");
+      status = -1;
+      break;
+    }
+    status = write_all(fd, &db->entries[i], sizeof(struct tsdb_entry));
+    close(fd);
+  }
+
+  db->pending_count = 0;
+  return status;
+}
+
+/**
+ * Closes a series' block and queues it for writing.
+ * @param db The store.
+ * @param index The series.
+ * @return 0 on success, -1 on error.
+ */
+static int seal(struct tsdb *db, int index) {
+  struct series *series = &db->series[index];
+  struct tsdb_block_header header = {TSDB_MAGIC, (uint32_t)index,
+                                     series->count, (uint32_t)series->bits};
+  int64_t now = wall_ms();
+
+  if (series->count == 0) {
+    return 0;
+  }
+
+  int slot = db->pending_count++;
+  struct tsdb_entry *entry = &db->entries[slot];
+
+  memcpy(series->block, &header, sizeof(header));
+  memcpy(db->pending + (size_t)slot * TSDB_BLOCK_SIZE, series->block,
+         TSDB_BLOCK_SIZE);
+  entry->block = db->blocks++;
+  entry->count = series->count;
+  entry->min_ms = series->min_ms;
+  entry->max_ms = series->max_ms;
+  entry->sealed_ms = now > series->max_ms ? now : series->max_ms;
+  db->owners[slot] = index;
+
+  memset(series->block, 0, TSDB_BLOCK_SIZE);
+  series->bits = 0;
+  series->count = 0;
+
+  return db->pending_count == PENDING_BLOCKS ? flush_pending(db) : 0;
+}
+
+/**
+ * Hashes a series name.
+ * @param db The store.
+ * @param name The name.
+ * @return Its bucket.
+ */
+static int name_bucket(const struct tsdb *db, const char *name) {
+  uint32_t hash = 2166136261u; // FNV-1a.
+
+  for (; *name != '\0'; name++) {
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+  }
+  return (int)(hash & db->mask);
+}
+
+/**
+ * Adds a series to the in-memory table, growing it as needed.
+ * @param db The store.
+ * @param name Its name.
+ * @return Its number, or -1 on error.
+ */
+static int add_series(struct tsdb *db, const char *name) {
+  if (db->count == db->capacity) {
+    int capacity = db->capacity ? db->capacity * 2 : 1024;
+    struct series *series =
+        realloc(db->series, capacity * sizeof(struct series));
+    int *buckets = malloc(capacity * 2 * sizeof(int));
+
+    if (series == NULL || buckets == NULL) {
+      printf("Error : Series allocation failed.\n");
+      free(buckets);
+      if (series != NULL) {
+        db->series = series;
+      }
+      return -1;
+    }
+
+    db->series = series;
+    db->capacity = capacity;
+    free(db->buckets);
+    db->buckets = buckets;
+    db->mask = capacity * 2 - 1;
+    memset(db->buckets, -1, capacity * 2 * sizeof(int));
+
+    for (int i = 0; i < db->count; i++) {
+      int bucket = name_bucket(db, db->series[i].name);
+      db->series[i].next = db->buckets[bucket];
+      db->buckets[bucket] = i;
+    }
+  }
+
+  struct series *series = &db->series[db->count];
+  memset(series, 0, sizeof(struct series));
+  snprintf(series->name, sizeof(series->name), "%s", name);
+
+  int bucket = name_bucket(db, series->name);
+  series->next = db->buckets[bucket];
+  db->buckets[bucket] = db->count;
+
+  return db->count++;
+}
+
+struct tsdb *tsdb_open(const char *dir) {
+  struct tsdb *db = calloc(1, sizeof(struct tsdb));
+  char path[2 * MAX_NAME_LEN];
+  struct stat st;
+
+  if (db == NULL || strlen(dir) >= sizeof(db->dir)) {
+    printf("Error : Can't open the store %s.\n", dir);
+    free(db);
+    return NULL;
+  }
+  snprintf(db->dir, sizeof(db->dir), "%s", dir);
+  db->data_fd = db->names_fd = -1;
+
+  snprintf(path, sizeof(path), "%s/index", dir);
+  if ((mkdir(dir, 0755) == -1 && errno != EEXIST) ||
+      (mkdir(path, 0755) == -1 && errno != EEXIST)) {
+    perror("tsdb mkdir");
+    free(db);
+    return NULL;
+  }
+
+  db->pending = malloc(PENDING_BLOCKS * TSDB_BLOCK_SIZE);
+  snprintf(path, sizeof(path), "%s/data", dir);
+  db->data_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  snprintf(path, sizeof(path), "%s/names", dir);
+  db->names_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+  if (db->pending == NULL || db->data_fd == -1 || db->names_fd == -1 ||
+      fstat(db->data_fd, &st) == -1) {
+    perror("tsdb open");
+    tsdb_close(db);
+    return NULL;
+  }
+
+  // A block cut short by a crash is dropped: every block must stay at a
+  // multiple of the block size. Its index entry was never written.
+  db->blocks = (uint32_t)(st.st_size / TSDB_BLOCK_SIZE);
+  if (st.st_size % TSDB_BLOCK_SIZE != 0 &&
+      ftruncate(db->data_fd, (off_t)db->blocks * TSDB_BLOCK_SIZE) == -1) {
+    perror("tsdb ftruncate");
+    tsdb_close(db);
+    return NULL;
+  }
+
+  int count;
+  char **names = tsdb_names(dir, &count);
+  if (names == NULL) {
+    tsdb_close(db);
+    return NULL;
+  }
+
+  int failed = 0;
+  for (int i = 0; i < count; i++) {
+    if (!failed && add_series(db, names[i]) == -1) {
+      failed = 1;
+    }
+    free(names[i]);
+  }
+  free(names);
+
+  if (failed) {
+    tsdb_close(db);
+    return NULL;
+  }
+
+  return db;
+}
+
+int tsdb_series(struct tsdb *db, const char *name) {
+  if (db->count > 0) {
+    for (int i = db->buckets[name_bucket(db, name)]; i != -1;
+         i = db->series[i].next) {
+      if (strncmp(db->series[i].name, name, MAX_NAME_LEN - 1) == 0) {
+        return i;
+      }
+    }
+  }
+
+  int index = add_series(db, name);
+  if (index == -1) {
+    return -1;
+  }
+
+  // The name goes on disk before any block of the series can.
+  char line[MAX_NAME_LEN + 1];
+  int len = snprintf(line, sizeof(line), "%s\n", db->series[index].name);
+  if (write_all(db->names_fd, line, len) == -1) {
+    db->count--;
+    db->buckets[name_bucket(db, db->series[index].name)] =
+        db->series[index].next;
+    return -1;
+  }
+
+  return index;
+}
+
+int tsdb_append(struct tsdb *db, int index, int64_t time_ms, double value) {
+  struct series *series = &db->series[index];
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  if (series->block == NULL &&
+      (series->block = calloc(1, TSDB_BLOCK_SIZE)) == NULL) {
+    printf("Error : Block allocation failed.\n");
+    return -1;
+  }
+
+  int64_t delta = time_ms - series->last_ms;
+  int64_t dod = delta - series->last_delta;
+
+  // A block is closed before a sample could overflow it, or when a jump in
+  // time won't fit the widest delta-of-delta.
+  if (series->count > 0 &&
+      (series->bits + MAX_SAMPLE_BITS > (int)STREAM_BITS ||
+       dod < INT32_MIN || dod > INT32_MAX)) {
+    if (seal(db, index) == -1) {
+      return -1;
+    }
+  }
+
+  unsigned char *stream =
+      series->block + sizeof(struct tsdb_block_header);
+
+  if (series->count == 0) {
+    put_bits(stream, &series->bits, (uint64_t)time_ms, 64);
+    put_bits(stream, &series->bits, bits, 64);
+    series->last_delta = 0;
+    series->leading = NO_WINDOW;
+    series->min_ms = series->max_ms = time_ms;
+  } else {
+    if (dod == 0) {
+      put_bits(stream, &series->bits, 0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+      put_bits(stream, &series->bits, 0x2, 2);
+      put_bits(stream, &series->bits, (uint64_t)(dod + 63), 7);
+    } else if (dod >= -255 && dod <= 256) {
+      put_bits(stream, &series->bits, 0x6, 3);
+      put_bits(stream, &series->bits, (uint64_t)(dod + 255), 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+      put_bits(stream, &series->bits, 0xe, 4);
+      put_bits(stream, &series->bits, (uint64_t)(dod + 2047), 12);
+    } else {
+      put_bits(stream, &series->bits, 0xf, 4);
+      put_bits(stream, &series->bits, (uint32_t)(int32_t)dod, 32);
+    }
+
+    uint64_t xor = bits ^ series->last_value;
+
+    if (xor == 0) {
+      put_bits(stream, &series->bits, 0, 1);
+    } else {
+      int leading = __builtin_clzll(xor);
+      int trailing = __builtin_ctzll(xor);
+
+      if (leading > 31) {
+        leading = 31; // All 5 bits hold.
+      }
+
+      // Inside the previous window, only the window's bits are written.
+      if (series->leading != NO_WINDOW && leading >= series->leading &&
+          trailing >= series->trailing) {
+        int len = 64 - series->leading - series->trailing;
+
+        put_bits(stream, &series->bits, 0x2, 2);
+        put_bits(stream, &series->bits, xor >> series->trailing, len);
+      } else {
+        int len = 64 - leading - trailing;
+
+        put_bits(stream, &series->bits, 0x3, 2);
+        put_bits(stream, &series->bits, (uint64_t)leading, 5);
+        put_bits(stream, &series->bits, (uint64_t)(len & 63), 6);
+        put_bits(stream, &series->bits, xor >> trailing, len);
+        series->leading = leading;
+        series->trailing = trailing;
+      }
+    }
+
+    series->last_delta = delta;
+    if (time_ms < series->min_ms) {
+      series->min_ms = time_ms;
+    }
+    if (time_ms > series->max_ms) {
+      series->max_ms = time_ms;
+    }
+  }
+
+  series->last_ms = time_ms;
+  series->last_value = bits;
+  series->count++;
+
+  return 0;
+}
+
+int tsdb_flush(struct tsdb *db) {
+  return flush_pending(db);
+}
+
+int tsdb_close(struct tsdb *db) {
+  int status = 0;
+
+  for (int i = 0; i < db->count; i++) {
+    if (db->series[i].block != NULL && seal(db, i) == -1) {
+      status = -1;
+    }
+    free(db->series[i].block);
+  }
+  if (db->data_fd != -1 && flush_pending(db) == -1) {
+    status = -1;
+  }
+
+  if (db->data_fd != -1) {
+    close(db->data_fd);
+  }
+  if (db->names_fd != -1) {
+    close(db->names_fd);
+  }
+  free(db->series);
+  free(db->buckets);
+  free(db->pending);
+  free(db);
+
+  return status;
+}
+
+char **tsdb_names(const char *dir, int *count) {
+  char path[2 * MAX_NAME_LEN];
+  char line[MAX_NAME_LEN + 1];
+  int capacity = 64;
+  char **names = malloc(capacity * sizeof(char *));
+
+  snprintf(path, sizeof(path), "%s/names", dir);
+  FILE *file = fopen(path, "r");
+  *count = 0;
+
+  if (names == NULL || file == NULL) {
+    printf("Error : Couldn't read %s.\n", path);
+    free(names);
+    if (file != NULL) {
+      fclose(file);
+    }
+    return NULL;
+  }
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+
+    if (*count == capacity) {
+      char **grown = realloc(names, capacity * 2 * sizeof(char *));
+      if (grown == NULL) {
+        break;
+      }
+      names = grown;
+      capacity *= 2;
+    }
+    names[(*count)++] = strdup(line);
+  }
+
+  fclose(file);
+  return names;
+}
+
+int tsdb_decode(const unsigned char *block, struct tsdb_sample *samples) {
+  struct tsdb_block_header header;
+  memcpy(&header, block, sizeof(header));
+
+  if (header.magic != TSDB_MAGIC || header.bits > STREAM_BITS ||
+      header.count > TSDB_MAX_SAMPLES) {
+    return -1;
+  }
+
+  const unsigned char *stream = block + sizeof(header);
+  int limit = (int)header.bits;
+  int bits = 0;
+  uint64_t time = 0, value = 0, field;
+  int64_t delta = 0;
+  int leading = 0, trailing = 0;
+
+  for (uint32_t i = 0; i < header.count; i++) {
+    if (i == 0) {
+      if (get_bits(stream, &bits, limit, 64, &time) == -1 ||
+          get_bits(stream, &bits, limit, 64, &value) == -1) {
+        return -1;
+      }
+    } else {
+      // The delta-of-delta's prefix: up to four 1 bits.
+      int ones = 0;
+      while (ones < 4) {
+        if (get_bits(stream, &bits, limit, 1, &field) == -1) {
+          return -1;
+        }
+        if (field == 0) {
+          break;
+        }
+        ones++;
+      }
+
+      static const int widths[5] = {0, 7, 9, 12, 32};
+      static const int64_t offsets[5] = {0, 63, 255, 2047, 0};
+      int64_t dod = 0;
+
+      if (ones > 0) {
+        if (get_bits(stream, &bits, limit, widths[ones], &field) == -1) {
+          return -1;
+        }
+        dod = ones == 4 ? (int32_t)(uint32_t)field
+                        : (int64_t)field - offsets[ones];
+      }
+      delta += dod;
+      time += delta;
+
+      if (get_bits(stream, &bits, limit, 1, &field) == -1) {
+        return -1;
+      }
+      if (field == 1) {
+        if (get_bits(stream, &bits, limit, 1, &field) == -1) {
+          return -1;
+        }
+        if (field == 1) {
+          uint64_t lead, len;
+          if (get_bits(stream, &bits, limit, 5, &lead) == -1 ||
+              get_bits(stream, &bits, limit, 6, &len) == -1) {
+            return -1;
+          }
+          leading = (int)lead;
+          trailing = 64 - leading - (len == 0 ? 64 : (int)len);
+          if (trailing < 0) {
+            return -1;
+          }
+        }
+
+        uint64_t xor;
+        if (get_bits(stream, &bits, limit, 64 - leading - trailing, &xor) ==
+            -1) {
+          return -1;
+        }
+        value ^= xor << trailing;
+      }
+    }
+
+    samples[i].time_ms = (int64_t)time;
+    memcpy(&samples[i].value, &value, sizeof(value));
+  }
+
+  return (int)header.count;
+}
@@ -0,0 +1,124 @@
+#ifndef TSDB_H
+#define TSDB_H
+
+#include <stdint.h>
+
+/**
+ * Append-only, compressed time series of probe results.
+ *
+ * Each series (one per target, by name) is a sequence of samples: a time
+ * in milliseconds and a double. Samples are packed as in Facebook's Gorilla
+ * into fixed-size blocks: the first time and value whole, then each time
+ * as the change in its delta from the previous one (delta-of-delta, a
+ * single bit when probes go out on schedule) and each value XORed with the
+ * previous one, keeping only the bits between its leading and trailing
+ * zeros. RTTs in whole microseconds take one to two bytes a sample.
+ *
+ * A store is a directory:
+ * - "data": the blocks, TSDB_BLOCK_SIZE bytes each, appended as they fill.
+ * - "names": the series' names, one per line, line i naming series i.
+ * - "index/<i>": series i's index, one tsdb_entry per block in the order
+ *   they were written, so a query on one target reads only its own blocks
+ *   and can skip those sealed before the range.
+ *
+ * Blocks are written before their index entries, so a crash loses at most
+ * the samples still buffered, never the consistency of what's on disk.
+ * What is buffered: each series' block still filling, written only once
+ * full or by tsdb_close(), and sealed blocks until tsdb_flush() or until
+ * enough of them pile up.
+ */
+
+#define TSDB_BLOCK_SIZE 4096
+#define TSDB_MAGIC 0x42445354 // "TSDB"
+#define TSDB_MAX_SAMPLES (TSDB_BLOCK_SIZE * 4) // At least 2 bits a sample.
+
+/**
+ * The start of every block.
+ */
+struct tsdb_block_header {
+  uint32_t magic;
+  uint32_t series;
+  uint32_t count; // Samples in the block.
+  uint32_t bits;  // Bits of the stream used, after the header.
+};
+
+/**
+ * One block in a series' index.
+ */
+struct tsdb_entry {
+  uint32_t block; // Its number in the data file.
+  uint32_t count;
+  int64_t min_ms; // Its earliest and latest sample times.
+  int64_t max_ms;
+  int64_t sealed_ms; // When it was written: no sample in it is later.
+};
+
+/**
+ * One sample, decoded.
+ */
+struct tsdb_sample {
+  int64_t time_ms;
+  double value;
+};
+
+struct tsdb;
+
+/**
+ * Opens a store for appending, creating it if needed.
+ * @param dir The store's directory.
+ * @return The store, or NULL on error.
+ */
+struct tsdb *tsdb_open(const char *dir);
+
+/**
+ * Finds a series by name, adding it if the store doesn't have it yet.
+ * @param db The store.
+ * @param name Its name.
+ * @return The series' number, or -1 on error.
+ */
+int tsdb_series(struct tsdb *db, const char *name);
+
+/**
+ * Appends a sample to a series. Times should mostly go forward; those that
+ * don't are kept too, only less compactly.
+ * @param db The store.
+ * @param series The series.
+ * @param time_ms Its time, in milliseconds since the epoch.
+ * @param value Its value.
+ * @return 0 on success, -1 if a block couldn't be written.
+ */
+int tsdb_append(struct tsdb *db, int series, int64_t time_ms, double value);
+
+/**
+ * Writes the blocks sealed so far, with their index entries. Blocks still
+ * filling stay in memory: writing them early would pad them out.
+ * @param db The store.
+ * @return 0 on success, -1 if something couldn't be written.
+ */
+int tsdb_flush(struct tsdb *db);
+
+/**
+ * Writes every block, full or not, and closes the store.
+ * @param db The store.
+ * @return 0 on success, -1 if something couldn't be written.
+ */
+int tsdb_close(struct tsdb *db);
+
+/**
+ * Reads the names of a store's series.
+ * @param dir The store's directory.
+ * @param count Where to store the number of series.
+ * @return The names, to be freed one by one and then as a whole, or NULL
+ * on error.
+ */
+char **tsdb_names(const char *dir, int *count);
+
+/**
+ * Decodes a block.
+ * @param block The block, TSDB_BLOCK_SIZE bytes.
+ * @param samples Room for TSDB_MAX_SAMPLES samples.
+ * @return The number of samples, or -1 if the block is corrupt.
+ */
+int tsdb_decode(const unsigned char *block, struct tsdb_sample *samples);
+
+#endif
@@ -0,0 +1,320 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tsdb.h"
+
+
+#define MAX_PATH_LEN 4096
+
+/**
+ * What a query reads, and what it found.
+ */
+struct query {
+  const unsigned char *data; // The data file, mapped.
+  uint32_t blocks;           // Blocks in it.
+  int64_t from_ms;           // The range, both ends included.
+  int64_t to_ms;
+  int summary;               // Summarize each target instead of listing.
+  struct tsdb_sample *samples; // Room for one decoded block.
+};
+
+/**
+ * The summary of one target over the range.
+ */
+struct summary {
+  long long samples;
+  long long lost;
+  double min_ms;
+  double max_ms;
+  double sum_ms;
+};
+
+/**
+ * Maps a whole file read-only.
+ * @param path The file.
+ * @param size Where to store its size.
+ * @return The mapping, or NULL if the file is missing or empty.
+ */
+const void *map_file(const char *path, size_t *size);
+
+/**
+ * Finds the first entry of an index sealed at or after a time. Blocks are
+ * sealed in order, so every earlier entry holds only older samples.
+ * @param entries The index.
+ * @param count Its entries.
+ * @param from_ms The time.
+ * @return The entry's position, or count if there is none.
+ */
+int index_search(const struct tsdb_entry *entries, int count,
+                 int64_t from_ms);
+
+/**
+ * Reads a series' samples in the range, printing them or adding them to a
+ * summary.
+ * @param query The query.
+ * @param dir The store's directory.
+ * @param series The series.
+ * @param name Its name.
+ * @param summary Where to add them with -S.
+ * @return 0 on success, -1 if the store is corrupt.
+ */
+int query_series(const struct query *query, const char *dir, int series,
+                 const char *name, struct summary *summary);
+
+/**
+ * Parses a time: seconds since the epoch, or before now if negative.
+ * @param text The time.
+ * @return The time in milliseconds since the epoch.
+ */
+int64_t parse_time(const char *text);
+
+int main(int argc, char *strings[]) {
+  const char *dir = NULL;
+  const char *only = NULL;
+  struct query query;
+  int opt;
+
+  memset(&query, 0, sizeof(query));
+  query.to_ms = INT64_MAX;
+
+  while ((opt = getopt(argc, strings, "D:t:s:e:S")) != -1) {
+    switch (opt) {
+    case 'D':
+      dir = optarg;
+      break;
+    case 't':
+      only = optarg;
+      break;
+    case 's':
+      query.from_ms = parse_time(optarg);
+      break;
+    case 'e':
+      query.to_ms = parse_time(optarg);
+      break;
+    case 'S':
+      query.summary = 1;
+      break;
+    default:
+      dir = NULL;
+      break;
+    }
+  }
+
+  if (dir == NULL || optind != argc) {
+    printf("usage: %s -D history_dir [-t target] [-s from] [-e to] [-S]\n"
+           "Prints the samples ping -D stored: time, target and RTT in ms, "
+           "or \"lost\".\n"
+           "from and to are seconds since the epoch, or before now if "
+           "negative (-s -3600:\n"
+           "the last hour).\n"
+           "-S prints a summary of each target instead.\n",
+           strings[0]);
+    exit(0);
+  }
+
+  int count;
+  char **names = tsdb_names(dir, &count);
+  if (names == NULL) {
+    return -1;
+  }
+
+  char path[MAX_PATH_LEN];
+  size_t size = 0;
+  snprintf(path, sizeof(path), "%s/data", dir);
+  query.data = map_file(path, &size);
+  query.blocks = (uint32_t)(size / TSDB_BLOCK_SIZE);
+  query.samples = malloc(TSDB_MAX_SAMPLES * sizeof(struct tsdb_sample));
+
+  if (query.samples == NULL) {
+    printf("Error : Sample buffer allocation failed.\n");
+    return -1;
+  }
+
+  int status = 0;
+  int found = 0;
+
+  if (query.summary) {
+    printf("%-24s %10s %7s %10s %10s %10s\n", "target", "samples", "lost",
+           "min_ms", "avg_ms", "max_ms");
+  }
+
+  for (int i = 0; i < count && status == 0; i++) {
+    if (only != NULL && strcmp(names[i], only) != 0) {
+      continue;
+    }
+    found = 1;
+
+    struct summary summary = {0, 0, INFINITY, 0, 0};
+    status = query_series(&query, dir, i, names[i], &summary);
+
+    if (query.summary && summary.samples > 0) {
+      long long answered = summary.samples - summary.lost;
+
+      printf("%-24s %10lld %6.2f%% ", names[i], summary.samples,
+             100.0 * summary.lost / summary.samples);
+      if (answered > 0) {
+        printf("%10.3f %10.3f %10.3f\n", summary.min_ms,
+               summary.sum_ms / answered, summary.max_ms);
+      } else {
+        printf("%10s %10s %10s\n", "-", "-", "-");
+      }
+    }
+  }
+
+  if (only != NULL && !found) {
+    printf("Error : No series named %s.\n", only);
+    status = -1;
+  }
+
+  if (query.data != NULL) {
+    munmap((void *)query.data, size);
+  }
+  for (int i = 0; i < count; i++) {
+    free(names[i]);
+  }
+  free(names);
+  free(query.samples);
+
+  return status;
+}
+
+// **THE FUNCTIONS** :
+
+const void *map_file(const char *path, size_t *size) {
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  void *map;
+
+  *size = 0;
+  if (fd == -1) {
+    return NULL;
+  }
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  // Read front to back, once.
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  *size = st.st_size;
+  return map;
+}
+
+int index_search(const struct tsdb_entry *entries, int count,
+                 int64_t from_ms) {
+  int low = 0;
+  int high = count;
+
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+
+    if (entries[middle].sealed_ms < from_ms) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+int query_series(const struct query *query, const char *dir, int series,
+                 const char *name, struct summary *summary) {
+  char path[MAX_PATH_LEN];
+  size_t size;
+
+  snprintf(path, sizeof(path), "%s/index/%d", dir, series);
+  const struct tsdb_entry *entries = map_file(path, &size);
+  if (entries == NULL) {
+    return 0; // No block of it was written.
+  }
+
+  int count = (int)(size / sizeof(struct tsdb_entry));
+  int status = 0;
+
+  // Only the index is read for the blocks outside the range; the data file
+  // is touched just for those inside it.
+  for (int i = index_search(entries, count, query->from_ms); i < count; i++) {
+    const struct tsdb_entry *entry = &entries[i];
+
+    if (entry->max_ms < query->from_ms || entry->min_ms > query->to_ms) {
+      continue;
+    }
+
+    const unsigned char *block =
+        query->data + (size_t)entry->block * TSDB_BLOCK_SIZE;
+    struct tsdb_block_header header;
+    int samples = -1;
+
+    if (entry->block < query->blocks) {
+      memcpy(&header, block, sizeof(header));
+      if (header.series == (uint32_t)series) {
+        samples = tsdb_decode(block, query->samples);
+      }
+    }
+    if (samples == -1) {
+      printf("Error : Block %u of %s is corrupt.\n", entry->block, name);
+      status = -1;
+      break;
+    }
+
+    for (int j = 0; j < samples; j++) {
+      const struct tsdb_sample *sample = &query->samples[j];
+
+      if (sample->time_ms < query->from_ms || sample->time_ms > query->to_ms) {
+        continue;
+      }
+
+      if (query->summary) {
+        double rtt_ms = sample->value / 1000;
+
+        summary->samples++;
+        if (isnan(sample->value)) {
+          summary->lost++;
+          continue;
+        }
+        summary->sum_ms += rtt_ms;
+        if (rtt_ms < summary->min_ms) {
+          summary->min_ms = rtt_ms;
+        }
+        if (rtt_ms > summary->max_ms) {
+          summary->max_ms = rtt_ms;
+        }
+      } else if (isnan(sample->value)) {
+        printf("%lld.%03lld %s lost\n", (long long)(sample->time_ms / 1000),
+               (long long)(sample->time_ms % 1000), name);
+      } else {
+        printf("%lld.%03lld %s %.3f\n", (long long)(sample->time_ms / 1000),
+               (long long)(sample->time_ms % 1000), name,
+               sample->value / 1000);
+      }
+    }
+  }
+
+  munmap((void *)entries, size);
+  return status;
+}
+
+int64_t parse_time(const char *text) {
+  long long seconds = atoll(text);
+
+  if (seconds < 0) {
+    seconds += (long long)time(NULL);
+  }
+  return (int64_t)seconds * 1000;
+}
@@ -1,20 +1,206 @@
+#define _GNU_SOURCE // accept4().
+
+#include <arpa/inet.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "heartbeat.h"
+#include "timer_wheel.h"
+
 
 #define WATCHDOG_PORT 3000
 #define MAX_CLIENT_ADDR_LEN 16
-#define PING_STATUS_LEN 5
 #define TRUE 1
+#define DEFAULT_TIMEOUT_MS 10000    // Before the first RTT, and at most.
+#define DEFAULT_MIN_TIMEOUT_MS 1000 // At least, as RFC 6298 rounds up to.
+#define RTTVAR_FACTOR 4             // RTO = SRTT + K * RTTVAR.
+#define EVENT_BATCH 1024            // Events taken per epoll_wait().
+#define LISTENER UINT32_MAX         // epoll tags of the listening socket...
+#define TIMER (UINT32_MAX - 1)      // ...and of the timerfd.
+#define TIMEOUT_MSG "Timeout"
+
+enum client_state {
+  CLIENT_FREE,
+  CLIENT_HANDSHAKE, // Waiting for the destination IP.
+  CLIENT_RUNNING,   // Beating in its heartbeat slot.
+};
+
+/**
+ * One monitored pinger. Its timer in the wheel and its heartbeat slot have
+ * the same index.
+ */
+struct client {
+  int fd;
+  enum client_state state;
+  char input[MAX_CLIENT_ADDR_LEN]; // Part of the destination read so far.
+  int have;                        // Bytes of it.
+  char dest[MAX_CLIENT_ADDR_LEN];  // The address it pings.
+  char peer[INET_ADDRSTRLEN + 6];  // Its own address and port.
+  uint64_t reported_ns;            // Probe already reported as timed out.
+  int next_free;                   // Next free slot, -1 if none.
+};
+
+/**
+ * The clients, in slots reused through a free list, and their deadlines.
+ */
+struct client_table {
+  struct client *clients;
+  int used;       // Slots handed out so far.
+  int capacity;
+  int first_free; // -1 if none.
+  int active;
+  struct timer_wheel wheel; // One tick per millisecond.
+  struct heartbeat_slot *slots;
+  long long max_timeout_ns; // Until a client's first RTT, and at most.
+  long long min_timeout_ns;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+/**
+ * Takes a slot for a new connection and sends it the go-ahead byte,
+ * followed by the index of its heartbeat slot.
+ * @param table The table.
+ * @param fd The connection, non-blocking.
+ * @param address Its peer address.
+ * @return The slot, or -1 on error.
+ */
+int client_add(struct client_table *table, int fd,
+               const struct sockaddr_in *address);
+
+/**
+ * Closes a connection and frees its slot and timer.
+ * @param table The table.
+ * @param index The slot.
+ */
+void client_remove(struct client_table *table, int index);
+
+/**
+ * Reads everything waiting on a connection. The only message is the
+ * destination IP, after which the client's deadline is checked at least
+ * once per minimum timeout; anything else is ignored.
+ * @param table The table.
+ * @param index The slot.
+ * @param now The current time in milliseconds.
+ * @return 0 while the connection is open, -1 once the client is gone.
+ */
+int client_read(struct client_table *table, int index, long long now);
+
+/**
+ * Works out how long a client's probe may go unanswered, from the RTT
+ * estimate its pinger keeps in the slot: SRTT + 4 * RTTVAR (Jacobson/Karels
+ * RTO), clamped to the table's bounds. Before the first RTT the maximum is
+ * used.
+ * @param table The table.
+ * @param beat The client's heartbeat.
+ * @return The timeout in nanoseconds.
+ */
+long long client_timeout(const struct client_table *table,
+                         const struct heartbeat *beat);
+
+/**
+ * Checks a client's heartbeat when its timer comes up. Heartbeats don't
+ * wake us, so the timer is only ever pushed back here: to the deadline of
+ * the oldest unanswered probe, or the minimum timeout on if none is
+ * outstanding, since no later probe can be due sooner. A client whose
+ * probe has gone unanswered for its timeout is reported and told so, once
+ * per probe; it stays connected. Called by wheel_advance().
+ * @param index The slot.
+ * @param arg The table.
+ */
+void client_expire(int index, void *arg);
+
+/**
+ * Accepts every pending connection.
+ * @param table The table.
+ * @param listener The listening socket.
+ * @param epoll_fd The epoll instance the clients are added to.
+ * @return 0 on success, or -1 when out of descriptors, after which the
+ * listener should be left alone until a client leaves.
+ */
+int accept_clients(struct client_table *table, int listener, int epoll_fd);
+
+/**
+ * Sets a timerfd to fire at an absolute CLOCK_MONOTONIC time.
+ * @param timer The timerfd.
+ * @param deadline The time in nanoseconds, in the past to fire right away,
+ * or -1 to disarm it.
+ * @return 0 on success, -1 on error.
+ */
+int arm_timer(int timer, long long deadline);
+
+/**
+ * Reads CLOCK_MONOTONIC.
+ * @return The current time in nanoseconds.
+ */
+long long now_ns(void);
+
+/**
+ * Stops the main loop.
+ * @param signum The signal.
+ */
+void handle_signal(int signum);
+
+int main(int argc, char *strings[]) {
+  long long timeout_ms = DEFAULT_TIMEOUT_MS;
+  long long min_timeout_ms = DEFAULT_MIN_TIMEOUT_MS;
+  int keep = 0;
+  int opt;
 
-int main() {
-  int watchdog_sock = socket(AF_INET, SOCK_STREAM, 0);
+  while ((opt = getopt(argc, strings, "km:T:")) != -1) {
+    switch (opt) {
+    case 'k':
+      keep = 1;
+      break;
+    case 'm':
+      min_timeout_ms = atoll(optarg);
+      break;
+    case 'T':
+      timeout_ms = atoll(optarg);
+      break;
+    default:
+      timeout_ms = -1;
+      break;
+    }
+  }
+
+  if (timeout_ms <= 0 || min_timeout_ms <= 0) {
+    printf("usage: %s [-k] [-m min_timeout_ms] [-T timeout_ms]\n"
+           "-k keeps running after the last client leaves.\n"
+           "A probe may go unanswered for SRTT + %d * RTTVAR of its path, "
+           "at least\n"
+           "-m (%d ms by default) and at most -T (%d ms by default), which "
+           "is also\n"
+           "used until the path's first RTT is known.\n",
+           strings[0], RTTVAR_FACTOR, DEFAULT_MIN_TIMEOUT_MS,
+           DEFAULT_TIMEOUT_MS);
+    exit(0);
+  }
+
+  if (min_timeout_ms > timeout_ms) {
+    min_timeout_ms = timeout_ms;
+  }
+
+  // Every client is a descriptor; ask for as many as we are allowed.
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  int watchdog_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (watchdog_sock == -1) {
     printf("Socket not created: %d", errno);
     exit(0);
@@ -43,62 +229,354 @@ int main() {
     exit(0);
   }
 
-  int listen_status = (int)listen(watchdog_sock, 5);
+  int listen_status = (int)listen(watchdog_sock, SOMAXCONN);
   if (listen_status == -1) {
     printf("Listen failed with error code : %d", errno);
     close(watchdog_sock);
     exit(0);
   }
 
-  struct sockaddr_in client_address;
-  socklen_t client_address_len = sizeof(client_address);
-  memset(&client_address, 0, client_address_len);
+  struct client_table table;
+  memset(&table, 0, sizeof(table));
+  table.first_free = -1;
+  table.max_timeout_ns = timeout_ms * 1000000LL;
+  table.min_timeout_ns = min_timeout_ms * 1000000LL;
+  if (wheel_init(&table.wheel, 0, now_ns() / 1000000) == -1) {
+    printf("Error : Wheel allocation failed.\n");
+    close(watchdog_sock);
+    return -1;
+  }
 
-  int client_socket = accept(watchdog_sock, (struct sockaddr *)&client_address,
-                             &client_address_len);
-  if (client_socket == -1) {
-    printf("listen_status failed with error code : %d", errno);
-    close(client_socket);
-    exit(0);
+  // Created once the port is ours: a second watchdog fails to bind above
+  // and mustn't replace the first one's slots.
+  table.slots = heartbeat_create();
+  if (table.slots == NULL) {
+    close(watchdog_sock);
+    return -1;
   }
 
-  int flag1 = 1;
-  send(client_socket, &flag1, 1, 0);
+  // The wheel's next deadline is set on a timerfd as an absolute time, so
+  // the wait ends on it to the microsecond rather than after a relative
+  // epoll_wait() timeout rounded to the millisecond.
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (timer == -1 || epoll_fd == -1) {
+    perror("timerfd/epoll");
+    close(watchdog_sock);
+    return -1;
+  }
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u32 = LISTENER;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watchdog_sock, &event);
+  event.data.u32 = TIMER;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer, &event);
+  int listening = TRUE;
 
-  char dest_ip[MAX_CLIENT_ADDR_LEN];
-  bzero(dest_ip, MAX_CLIENT_ADDR_LEN);
-  int receive = (int)recv(client_socket, dest_ip, MAX_CLIENT_ADDR_LEN, 0);
-  if (receive < 1) {
-    printf("Destination IP wasn't received correctly");
-    close(client_socket);
+  struct sigaction int_action;
+  memset(&int_action, 0, sizeof(int_action));
+  int_action.sa_handler = handle_signal;
+  sigaction(SIGINT, &int_action, NULL);
+  sigaction(SIGTERM, &int_action, NULL);
+
+  // A client that closes its end of a timed out connection mustn't kill us.
+  signal(SIGPIPE, SIG_IGN);
+
+  struct epoll_event *events = malloc(EVENT_BATCH * sizeof(struct epoll_event));
+  if (events == NULL) {
+    printf("Error : Event allocation failed.\n");
+    close(epoll_fd);
+    close(watchdog_sock);
     return -1;
   }
 
-  char ping_status[PING_STATUS_LEN];
-  int timer = 0;
+  // One epoll loop for all clients. The wait ends at the wheel's next tick
+  // with work to do; heartbeats themselves never wake us, and with no
+  // timer armed nothing does until a client connects or leaves.
+  int served = 0;
 
-  while (TRUE) {
-    recv(client_socket, ping_status, PING_STATUS_LEN, 0);
-    if (strcmp("ping", ping_status) == 0) {
-      // printf("Started timer\n");
-      fcntl(client_socket, F_SETFL, O_NONBLOCK);
-      while (timer < 10) {
-        timer++;
-        recv(client_socket, ping_status, PING_STATUS_LEN, 0);
-        if (strcmp("pong", ping_status) == 0) {
-          timer = 0;
-          fcntl(client_socket, F_SETFL, 0);
-          break;
+  while (!stop) {
+    long long now = now_ns() / 1000000;
+    wheel_advance(&table.wheel, now, client_expire, &table);
+
+    if (!keep && served && table.active == 0) {
+      break;
+    }
+
+    long long next = wheel_next(&table.wheel);
+    arm_timer(timer, next == -1 ? -1 : next * 1000000);
+
+    int ready = epoll_wait(epoll_fd, events, EVENT_BATCH, -1);
+    now = now_ns() / 1000000;
+
+    for (int i = 0; i < ready; i++) {
+      uint32_t tag = events[i].data.u32;
+
+      if (tag == TIMER) {
+        uint64_t expirations;
+        read(timer, &expirations, sizeof(expirations));
+      } else if (tag == LISTENER) {
+        int before = table.active;
+
+        if (accept_clients(&table, watchdog_sock, epoll_fd) == -1) {
+          epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watchdog_sock, NULL);
+          listening = 0;
+        }
+        served |= table.active > before;
+      } else if (table.clients[tag].state == CLIENT_FREE) {
+        // Removed earlier in this batch.
+      } else if (client_read(&table, (int)tag, now) == -1) {
+        client_remove(&table, (int)tag);
+
+        // A descriptor was freed: take new clients again.
+        if (!listening) {
+          event.events = EPOLLIN;
+          event.data.u32 = LISTENER;
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watchdog_sock, &event);
+          listening = TRUE;
         }
-        sleep(1);
-      }
-      if (timer == 10) {
-        printf("Disconnected\n");
-        close(client_socket);
-        break;
       }
     }
   }
 
+  for (int i = 0; i < table.used; i++) {
+    if (table.clients[i].state != CLIENT_FREE) {
+      client_remove(&table, i);
+    }
+  }
+
+  free(events);
+  free(table.clients);
+  wheel_free(&table.wheel);
+  heartbeat_destroy(table.slots);
+  close(epoll_fd);
+  close(timer);
+  close(watchdog_sock);
+
   return 0;
 }
+
+// **THE FUNCTIONS** :
+
+int client_add(struct client_table *table, int fd,
+               const struct sockaddr_in *address) {
+  int index = table->first_free;
+
+  if (index != -1) {
+    table->first_free = table->clients[index].next_free;
+  } else {
+    if (table->used == table->capacity) {
+      int capacity = table->capacity ? table->capacity * 2 : 1024;
+      struct client *clients =
+          realloc(table->clients, capacity * sizeof(struct client));
+
+      if (clients == NULL) {
+        printf("Error : Client allocation failed.\n");
+        return -1;
+      }
+      table->clients = clients;
+      table->capacity = capacity;
+
+      if (wheel_grow(&table->wheel, capacity) == -1) {
+        printf("Error : Wheel allocation failed.\n");
+        return -1;
+      }
+    }
+    if (table->used == HEARTBEAT_SLOTS) {
+      printf("Error : No heartbeat slot left.\n");
+      return -1;
+    }
+    index = table->used++;
+  }
+
+  struct client *client = &table->clients[index];
+  memset(client, 0, sizeof(struct client));
+  client->fd = fd;
+  client->state = CLIENT_HANDSHAKE;
+  client->next_free = -1;
+
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &address->sin_addr, ip, sizeof(ip));
+  snprintf(client->peer, sizeof(client->peer), "%s:%d", ip,
+           ntohs(address->sin_port));
+
+  heartbeat_reset(&table->slots[index]);
+
+  char hello[1 + sizeof(uint32_t)];
+  uint32_t slot = (uint32_t)index;
+  hello[0] = 1;
+  memcpy(hello + 1, &slot, sizeof(slot));
+  send(fd, hello, sizeof(hello), 0);
+  table->active++;
+
+  return index;
+}
+
+void client_remove(struct client_table *table, int index) {
+  struct client *client = &table->clients[index];
+
+  // Closing the descriptor also takes it out of the epoll set.
+  wheel_cancel(&table->wheel, index);
+  close(client->fd);
+  client->state = CLIENT_FREE;
+  client->next_free = table->first_free;
+  table->first_free = index;
+  table->active--;
+}
+
+int client_read(struct client_table *table, int index, long long now) {
+  struct client *client = &table->clients[index];
+
+  while (TRUE) {
+    char discard[64];
+    int bytes;
+
+    if (client->state == CLIENT_HANDSHAKE) {
+      bytes = (int)recv(client->fd, client->input + client->have,
+                        MAX_CLIENT_ADDR_LEN - client->have, 0);
+    } else {
+      bytes = (int)recv(client->fd, discard, sizeof(discard), 0);
+    }
+
+    if (bytes == 0) {
+      return -1;
+    }
+    if (bytes < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0
+                                                                       : -1;
+    }
+
+    if (client->state == CLIENT_HANDSHAKE) {
+      client->have += bytes;
+      if (client->have == MAX_CLIENT_ADDR_LEN) {
+        memcpy(client->dest, client->input, MAX_CLIENT_ADDR_LEN);
+        client->dest[MAX_CLIENT_ADDR_LEN - 1] = '\0';
+        client->state = CLIENT_RUNNING;
+        wheel_arm(&table->wheel, index,
+                  now + table->min_timeout_ns / 1000000);
+      }
+    }
+  }
+}
+
+void client_expire(int index, void *arg) {
+  struct client_table *table = arg;
+  struct client *client = &table->clients[index];
+  struct heartbeat beat;
+  long long now = now_ns();
+  long long recheck = (now + table->min_timeout_ns) / 1000000;
+
+  heartbeat_read(&table->slots[index], &beat);
+
+  if (beat.ping_ns == 0) {
+    wheel_arm(&table->wheel, index, recheck);
+    return;
+  }
+
+  long long timeout_ns = client_timeout(table, &beat);
+  long long deadline = (long long)beat.ping_ns + timeout_ns;
+  if (deadline > now) {
+    // Rounded up, so the timer never fires before the deadline.
+    wheel_arm(&table->wheel, index, (deadline + 999999) / 1000000);
+    return;
+  }
+
+  if (beat.ping_ns != client->reported_ns) {
+    long long silence = now - (long long)beat.ping_ns;
+
+    client->reported_ns = beat.ping_ns;
+    printf("Timeout : %s pinging %s got no reply for %lld.%03lld ms "
+           "(timeout %lld ms, srtt %lld.%03lld ms).\n",
+           client->peer, client->dest, silence / 1000000,
+           silence / 1000 % 1000, timeout_ns / 1000000,
+           (long long)beat.srtt_ns / 1000000,
+           (long long)beat.srtt_ns / 1000 % 1000);
+    fflush(stdout);
+
+    // Best effort: a client too far behind to take it is dropped at EOF.
+    send(client->fd, TIMEOUT_MSG, sizeof(TIMEOUT_MSG), MSG_DONTWAIT);
+  }
+  wheel_arm(&table->wheel, index, recheck);
+}
+
+long long client_timeout(const struct client_table *table,
+                         const struct heartbeat *beat) {
+  if (beat->srtt_ns == 0) {
+    return table->max_timeout_ns;
+  }
+
+  long long rto =
+      (long long)(beat->srtt_ns + RTTVAR_FACTOR * beat->rttvar_ns);
+  if (rto < table->min_timeout_ns) {
+    return table->min_timeout_ns;
+  }
+  if (rto > table->max_timeout_ns) {
+    return table->max_timeout_ns;
+  }
+
+  return rto;
+}
+
+int accept_clients(struct client_table *table, int listener, int epoll_fd) {
+  while (TRUE) {
+    struct sockaddr_in client_address;
+    socklen_t client_address_len = sizeof(client_address);
+    int fd = accept4(listener, (struct sockaddr *)&client_address,
+                     &client_address_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd == -1) {
+      if (errno == EMFILE || errno == ENFILE || errno == ENOMEM ||
+          errno == ENOBUFS) {
+        printf("Error : Out of descriptors at %d clients.\n", table->active);
+        return -1;
+      }
+      // EAGAIN once the queue is empty; anything else is the client's.
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      continue;
+    }
+
+    int index = client_add(table, fd, &client_address);
+    if (index == -1) {
+      close(fd);
+      return -1;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = (uint32_t)index;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      client_remove(table, index);
+    }
+  }
+}
+
+int arm_timer(int timer, long long deadline) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+
+  // A zero it_value disarms the timer, so "right away" is 1 ns.
+  if (deadline != -1) {
+    if (deadline <= 0) {
+      deadline = 1;
+    }
+    spec.it_value.tv_sec = deadline / 1000000000LL;
+    spec.it_value.tv_nsec = deadline % 1000000000LL;
+  }
+
+  return timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void handle_signal(int signum) {
+  (void)signum;
+  stop = 1;
+}
@@ -9,7 +9,7 @@
 
 #define P 80            // port number P
 #define P_PLUS_1 81     // port number P+1
-#define MAX_BUF_LEN 100 // maximum buffer length
+#define MAX_BUF_LEN 65536 // maximum buffer length, large enough for any datagram
 
 int main(int argc, char *argv[]) {
   // check for correct number of command line arguments
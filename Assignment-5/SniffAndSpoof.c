@@ -9,6 +9,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "checksum.h"
+
 
 /**
  *This code is a packet sniffer that captures ICMP packets, specifically ICMP
@@ -25,14 +27,6 @@
  * in a loop until the program is closed.
  */
 
-/**
- * Calculates the checksum for the given data.
- * @param p_address Pointer to the data.
- * @param len Length of the data.
- * @return The calculated checksum.
- */
-unsigned short checksum(unsigned short *p_address, int len);
-
 /**
  * Sends a spoofed IP packet.
  * @param p_ip_header Pointer to the IP header of the packet to send.
@@ -146,7 +140,7 @@ void process_packet(u_char *args, const struct pcap_pkthdr *header,
     icmp_header->un.echo.id = p_icmp_hdr->un.echo.id;
     icmp_header->un.echo.sequence = p_icmp_hdr->un.echo.sequence;
     icmp_header->checksum =
-        checksum((unsigned short *)icmp_header, sizeof(struct icmphdr));
+        inet_checksum(icmp_header, sizeof(struct icmphdr));
 
     send_spoof(ip_header);
   }
@@ -170,26 +164,3 @@ void send_spoof(struct iphdr *p_ip_header) {
   }
   close(sock);
 }
-
-// Function to calculate the checksum for an input buffer
-unsigned short checksum(unsigned short *p_address, int len) {
-  int i = len;
-  int sum = 0;
-  unsigned short *w = p_address;
-  unsigned short answer = 0;
-
-  while (i > 1) {
-    sum += *w++;
-    i -= 2;
-  }
-  if (i == 1) {
-    *((unsigned char *)&answer) = *((unsigned char *)w);
-    sum += answer;
-  }
-
-  sum = (sum >> 16) + (sum & 0xffff);
-  sum += (sum >> 16);
-  answer = ~sum;
-
-  return answer;
-}
\ No newline at end of file
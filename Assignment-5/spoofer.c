@@ -7,6 +7,8 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "checksum.h"
+
 
 #define BUF_SIZE 1024
 
@@ -21,14 +23,6 @@
  * protocol number and replace the `struct icmphdr` type
  */
 
-/**
- * Calculates the checksum for the given data.
- * @param p_address Pointer to the data.
- * @param len Length of the data.
- * @return The calculated checksum.
- */
-unsigned short checksum(unsigned short *p_address, int len);
-
 int main(int argc, char *argv[]) {
   if (argc != 3) {
     fprintf(stderr, "Usage: %s <src_ip> <dst_ip>\n", argv[0]);
@@ -66,7 +60,7 @@ int main(int argc, char *argv[]) {
   ip_hdr.daddr = inet_addr(argv[2]);
 
   // Calculate the checksum for the IP header
-  ip_hdr.check = checksum((unsigned short *)&ip_hdr, sizeof(ip_hdr));
+  ip_hdr.check = inet_checksum(&ip_hdr, sizeof(ip_hdr));
 
   // Create the ICMP header
   struct icmphdr icmp_hdr;
@@ -78,7 +72,7 @@ int main(int argc, char *argv[]) {
   icmp_hdr.checksum = 0;
 
   // Calculate the checksum for the ICMP header
-  icmp_hdr.checksum = checksum((unsigned short *)&icmp_hdr, sizeof(icmp_hdr));
+  icmp_hdr.checksum = inet_checksum(&icmp_hdr, sizeof(icmp_hdr));
 
   // Combine the IP and ICMP headers and send the packet
   char buf[BUF_SIZE];
@@ -101,27 +95,3 @@ int main(int argc, char *argv[]) {
 
   return 0;
 }
-
-// Function to calculate the checksum for an input buffer
-unsigned short checksum(unsigned short *p_address, int len) {
-  int n_left = len;
-  int sum = 0;
-  unsigned short *w = p_address;
-  unsigned short answer = 0;
-
-  while (n_left > 1) {
-    sum += *w++;
-    n_left -= 2;
-  }
-
-  if (n_left == 1) {
-    *((unsigned char *)&answer) = *((unsigned char *)w);
-    sum += answer;
-  }
-
-  sum = (sum >> 16) + (sum & 0xffff);
-  sum += (sum >> 16);
-  answer = ~sum;
-
-  return answer;
-}
\ No newline at end of file